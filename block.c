@@ -549,6 +549,25 @@ int bdrv_probe_geometry(BlockDriverState *bs, HDGeometry *geo)
     return -ENOTSUP;
 }
 
+/**
+ * Try to get a file descriptor from which @bytes bytes of @bs's data at
+ * *@offset can be read without going through the block layer.
+ * On success, return the descriptor and store the offset of the data in
+ * the file in *@offset.  On failure return -errno.
+ * Filters are not skipped, since reading directly would bypass them.
+ * @bs must not be empty.
+ */
+int bdrv_get_data_fd(BlockDriverState *bs, uint64_t *offset, uint64_t bytes)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_get_data_fd) {
+        return drv->bdrv_get_data_fd(bs, offset, bytes);
+    }
+
+    return -ENOTSUP;
+}
+
 /*
  * Create a uniquely-named empty temporary file.
  * Return 0 upon success, otherwise a negative errno value.
@@ -857,6 +876,28 @@ int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* do nothing, default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static char *bdrv_child_get_parent_desc(BdrvChild *c)
 {
     BlockDriverState *parent = c->opaque;
@@ -3507,6 +3548,8 @@ static void bdrv_close(BlockDriverState *bs)
 
     g_free(bs->opaque);
     bs->opaque = NULL;
+    g_free(bs->latency);
+    bs->latency = NULL;
     atomic_set(&bs->copy_on_read, 0);
     bs->backing_file[0] = '\0';
     bs->backing_format[0] = '\0';
@@ -4327,6 +4370,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_get_specific_stats) {
+        return NULL;
+    }
+    return drv->bdrv_get_specific_stats(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
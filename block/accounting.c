@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -182,6 +183,77 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+static unsigned block_latency_hdr_bucket(uint64_t latency)
+{
+    int bits = 64 - clz64(latency);
+
+    if (bits <= BLOCK_LATENCY_HDR_SUB_BITS) {
+        return latency;
+    }
+    if (bits > BLOCK_LATENCY_HDR_MAX_BITS) {
+        return BLOCK_LATENCY_HDR_BUCKETS - 1;
+    }
+
+    /* Use the BLOCK_LATENCY_HDR_SUB_BITS bits below the most significant
+     * one to pick a bucket within the power of two */
+    bits -= BLOCK_LATENCY_HDR_SUB_BITS;
+    return (bits << BLOCK_LATENCY_HDR_SUB_BITS) +
+           (latency >> (bits - 1)) - (1 << BLOCK_LATENCY_HDR_SUB_BITS);
+}
+
+/* Return the lowest latency that block_latency_hdr_bucket() maps to
+ * @bucket + 1 */
+static uint64_t block_latency_hdr_bucket_end(unsigned bucket)
+{
+    unsigned sub_buckets = 1 << BLOCK_LATENCY_HDR_SUB_BITS;
+    unsigned bits;
+
+    bucket++;
+    if (bucket < 2 * sub_buckets) {
+        return bucket;
+    }
+    bits = bucket >> BLOCK_LATENCY_HDR_SUB_BITS;
+    return (uint64_t)(sub_buckets + bucket % sub_buckets) << (bits - 1);
+}
+
+/* Lockless, so that it can be called for every request of a node */
+void block_latency_hdr_account(BlockLatencyHdr *hdr, uint64_t latency)
+{
+    stat64_add(&hdr->buckets[block_latency_hdr_bucket(latency)], 1);
+    stat64_add(&hdr->count, 1);
+    stat64_max(&hdr->max, latency);
+}
+
+/* Return the latency that @permille thousandths of the requests did not
+ * exceed, rounded up to the end of its bucket, or 0 if there were no
+ * requests. */
+uint64_t block_latency_hdr_percentile(BlockLatencyHdr *hdr, unsigned permille)
+{
+    uint64_t count = 0, target, seen = 0;
+    unsigned i;
+
+    assert(permille <= 1000);
+
+    /* Requests may complete while we look, so count what we see */
+    for (i = 0; i < BLOCK_LATENCY_HDR_BUCKETS; i++) {
+        count += stat64_get(&hdr->buckets[i]);
+    }
+    if (!count) {
+        return 0;
+    }
+
+    target = DIV_ROUND_UP(count * permille, 1000);
+    for (i = 0; i < BLOCK_LATENCY_HDR_BUCKETS - 1; i++) {
+        seen += stat64_get(&hdr->buckets[i]);
+        if (seen >= target && seen) {
+            break;
+        }
+    }
+
+    /* The end of the bucket may overestimate the maximum */
+    return MIN(block_latency_hdr_bucket_end(i) - 1, stat64_get(&hdr->max));
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
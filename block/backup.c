@@ -25,8 +25,20 @@
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS 64
+#define BACKUP_MAX_CHUNK (64 * MiB)
+
+/* Old data of a copy-before-write request, waiting to be written to the
+ * target by the staging worker */
+typedef struct BackupStagedChunk {
+    int64_t offset;
+    int64_t bytes;
+    void *buf;
+    QSIMPLEQ_ENTRY(BackupStagedChunk) next;
+} BackupStagedChunk;
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -49,6 +61,27 @@ typedef struct BackupBlockJob {
     int64_t copy_range_size;
 
     bool serialize_target_writes;
+
+    /* Background copy: parallel requests of adaptive size */
+    int max_workers;
+    int64_t max_chunk;
+    int64_t chunk_size;
+    int in_flight;
+    int task_ret;
+    bool task_error_is_read;
+    CoQueue task_queue;
+
+    /* Staging area for copy-before-write, 0 if disabled */
+    int64_t staging_size;
+    int64_t staged_bytes;
+    QSIMPLEQ_HEAD(, BackupStagedChunk) staged_chunks;
+    CoQueue staging_queue;
+    CoQueue staging_done;
+    bool staging_active;
+    bool staging_stop;
+    /* Failed write of the first staged chunk, handled by the job coroutine */
+    int staging_error;
+    int staging_ret;
 } BackupBlockJob;
 
 static const BlockJobDriver backup_job_driver;
@@ -90,8 +123,26 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
-/* Copy range to target with a bounce buffer and return the bytes copied. If
- * error occurred, return a negative error number */
+/* Return the length of the run of clusters at @start that still need to be
+ * copied, limited to @end, the end of the device and @max_bytes, which must be
+ * a multiple of the cluster size.  The cluster at @start must be dirty. */
+static int64_t backup_dirty_run(BackupBlockJob *job, int64_t start,
+                                int64_t end, int64_t max_bytes)
+{
+    int64_t next_zero;
+
+    next_zero = hbitmap_next_zero(job->copy_bitmap, start / job->cluster_size);
+    if (next_zero >= 0) {
+        end = MIN(end, next_zero * job->cluster_size);
+    }
+    end = MIN(end, job->len);
+
+    assert(end > start);
+    return MIN(end - start, max_bytes);
+}
+
+/* Copy the run of dirty clusters at @start to target with a bounce buffer and
+ * return the bytes copied. If error occurred, return a negative error number */
 static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
                                                       int64_t start,
                                                       int64_t end,
@@ -104,13 +155,16 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
     QEMUIOVector qiov;
     BlockBackend *blk = job->common.blk;
     int nbytes;
+    int nr_clusters;
     int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
     int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
 
-    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, 1);
-    nbytes = MIN(job->cluster_size, job->len - start);
+    nbytes = backup_dirty_run(job, start, end, job->max_chunk);
+    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
+    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, nr_clusters);
     if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        /* Later calls for the same request only copy what is left of it */
+        *bounce_buffer = blk_blockalign(blk, MIN(job->max_chunk, end - start));
     }
     iov.iov_base = *bounce_buffer;
     iov.iov_len = nbytes;
@@ -143,7 +197,7 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
 
     return nbytes;
 fail:
-    hbitmap_set(job->copy_bitmap, start / job->cluster_size, 1);
+    hbitmap_set(job->copy_bitmap, start / job->cluster_size, nr_clusters);
     return ret;
 
 }
@@ -179,6 +233,92 @@ static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
     return nbytes;
 }
 
+/* Read the run of dirty clusters at @start into the staging area and queue it
+ * for the staging worker, so that the guest write does not have to wait for
+ * the target.  Return the bytes staged, 0 if the staging area is full, or a
+ * negative error number if the source could not be read. */
+static int coroutine_fn backup_cow_to_staging(BackupBlockJob *job,
+                                              int64_t start, int64_t end)
+{
+    BackupStagedChunk *chunk;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t room;
+    int nbytes;
+    int nr_clusters;
+    void *buf;
+    int ret;
+
+    room = QEMU_ALIGN_DOWN(job->staging_size - job->staged_bytes,
+                           job->cluster_size);
+    if (room <= 0) {
+        return 0;
+    }
+
+    nbytes = backup_dirty_run(job, start, end, MIN(job->max_chunk, room));
+    buf = qemu_try_blockalign(blk_bs(job->common.blk), nbytes);
+    if (!buf) {
+        return 0;
+    }
+
+    /* Reserve the space before yielding, other guest writes may stage data
+     * concurrently */
+    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
+    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, nr_clusters);
+    job->staged_bytes += nbytes;
+
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = blk_co_preadv(job->common.blk, start, nbytes, &qiov,
+                        BDRV_REQ_NO_SERIALISING);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        hbitmap_set(job->copy_bitmap, start / job->cluster_size, nr_clusters);
+        job->staged_bytes -= nbytes;
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    trace_backup_do_cow_stage(job, start, nbytes);
+
+    chunk = g_new(BackupStagedChunk, 1);
+    *chunk = (BackupStagedChunk) {
+        .offset = start,
+        .bytes  = nbytes,
+        .buf    = buf,
+    };
+    QSIMPLEQ_INSERT_TAIL(&job->staged_chunks, chunk, next);
+    qemu_co_queue_next(&job->staging_queue);
+
+    return nbytes;
+}
+
+static int coroutine_fn backup_write_staged(BackupBlockJob *job,
+                                            BackupStagedChunk *chunk)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+
+    if (buffer_is_zero(chunk->buf, chunk->bytes)) {
+        ret = blk_co_pwrite_zeroes(job->target, chunk->offset, chunk->bytes,
+                                   BDRV_REQ_MAY_UNMAP);
+    } else {
+        iov.iov_base = chunk->buf;
+        iov.iov_len = chunk->bytes;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = blk_co_pwritev(job->target, chunk->offset, chunk->bytes, &qiov,
+                             job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, chunk->offset, ret);
+    }
+
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
@@ -208,15 +348,25 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         trace_backup_do_cow_process(job, start);
 
-        if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, end, is_write_notifier);
-            if (ret < 0) {
-                job->use_copy_range = false;
-            }
+        ret = 0;
+        if (is_write_notifier && job->staging_size) {
+            ret = backup_cow_to_staging(job, start, end);
         }
-        if (!job->use_copy_range) {
-            ret = backup_cow_with_bounce_buffer(job, start, end, is_write_notifier,
-                                                error_is_read, &bounce_buffer);
+        /* Without staging, or if the staging area is full, copy now */
+        if (ret == 0) {
+            if (job->use_copy_range) {
+                ret = backup_cow_with_offload(job, start, end,
+                                              is_write_notifier);
+                if (ret < 0) {
+                    job->use_copy_range = false;
+                }
+            }
+            if (!job->use_copy_range) {
+                ret = backup_cow_with_bounce_buffer(job, start, end,
+                                                    is_write_notifier,
+                                                    error_is_read,
+                                                    &bounce_buffer);
+            }
         }
         if (ret < 0) {
             break;
@@ -380,11 +530,83 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+/* Write staged copy-before-write data to the target until the job ends.  A
+ * chunk that could not be written stays queued until the job coroutine has
+ * decided what to do about the error in backup_staging_error(). */
+static void coroutine_fn backup_staging_worker(void *opaque)
+{
+    BackupBlockJob *job = opaque;
+    BackupStagedChunk *chunk;
+    int ret;
+
+    for (;;) {
+        chunk = QSIMPLEQ_FIRST(&job->staged_chunks);
+        if (!chunk || job->staging_error) {
+            if (job->staging_stop) {
+                break;
+            }
+            qemu_co_queue_wait(&job->staging_queue, NULL);
+            continue;
+        }
+
+        ret = backup_write_staged(job, chunk);
+        if (ret < 0) {
+            job->staging_error = ret;
+            job_enter(&job->common.job);
+            qemu_co_queue_restart_all(&job->staging_done);
+            continue;
+        }
+
+        QSIMPLEQ_REMOVE_HEAD(&job->staged_chunks, next);
+        job->staged_bytes -= chunk->bytes;
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
+        qemu_co_queue_restart_all(&job->staging_done);
+    }
+
+    /* Only a failed or cancelled job leaves chunks behind */
+    while ((chunk = QSIMPLEQ_FIRST(&job->staged_chunks))) {
+        QSIMPLEQ_REMOVE_HEAD(&job->staged_chunks, next);
+        job->staged_bytes -= chunk->bytes;
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
+    }
+
+    job->staging_active = false;
+    qemu_co_queue_restart_all(&job->staging_done);
+}
+
+/* Apply the target error policy to a failed write of the staging worker.
+ * Returns true if the job must fail. */
+static bool coroutine_fn backup_staging_error(BackupBlockJob *job)
+{
+    BlockErrorAction action;
+
+    if (job->staging_ret < 0) {
+        return true;
+    }
+    if (!job->staging_error) {
+        return false;
+    }
+
+    action = backup_error_action(job, false, -job->staging_error);
+    if (action == BLOCK_ERROR_ACTION_REPORT) {
+        job->staging_ret = job->staging_error;
+        return true;
+    }
+
+    /* Retry the chunk, once the user resumed the job if it was stopped */
+    job_pause_point(&job->common.job);
+    job->staging_error = 0;
+    qemu_co_queue_restart_all(&job->staging_queue);
+    return false;
+}
+
 static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 {
     uint64_t delay_ns;
 
-    if (job_is_cancelled(&job->common.job)) {
+    if (job_is_cancelled(&job->common.job) || backup_staging_error(job)) {
         return true;
     }
 
@@ -401,6 +623,169 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+/* Return 1 if any part of the cluster at @offset is allocated in the topmost
+ * image, 0 if not, or a negative error number */
+static int backup_cluster_is_allocated(BackupBlockJob *job, int64_t offset)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int alloced = 0;
+    int64_t i, n;
+
+    for (i = 0; i < job->cluster_size;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, offset + i, job->cluster_size - i, &n);
+        i += n;
+
+        if (alloced || n == 0) {
+            break;
+        }
+    }
+
+    return alloced;
+}
+
+typedef struct BackupTask {
+    BackupBlockJob *job;
+    int64_t offset;
+    int64_t bytes;
+} BackupTask;
+
+static void coroutine_fn backup_task_entry(void *opaque)
+{
+    BackupTask *task = opaque;
+    BackupBlockJob *job = task->job;
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job, task->offset, task->bytes, &error_is_read, false);
+    if (ret < 0) {
+        if (job->task_ret == 0) {
+            job->task_ret = ret;
+            job->task_error_is_read = error_is_read;
+        }
+        /* Start over with small requests */
+        job->chunk_size = job->cluster_size;
+    } else {
+        job->chunk_size = MIN(job->chunk_size * 2, job->max_chunk);
+    }
+
+    g_free(task);
+    job->in_flight--;
+    qemu_co_queue_restart_all(&job->task_queue);
+}
+
+/* Copy all clusters set in copy_bitmap with up to max_workers requests in
+ * flight.  Requests cover runs of dirty clusters and grow from one cluster up
+ * to max_chunk while copying succeeds. */
+static int coroutine_fn backup_run_parallel(BackupBlockJob *job)
+{
+    int64_t nb_clusters = DIV_ROUND_UP(job->len, job->cluster_size);
+    int64_t cluster = 0, next_zero, nb, i;
+    BackupTask *task;
+    Coroutine *co;
+    HBitmapIter hbi;
+    int ret = 0;
+
+    job->chunk_size = job->cluster_size;
+    qemu_co_queue_init(&job->task_queue);
+
+    for (;;) {
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        if (job->task_ret < 0) {
+            BlockErrorAction action =
+                backup_error_action(job, job->task_error_is_read,
+                                    -job->task_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->task_ret;
+                break;
+            }
+            job->task_ret = 0;
+            /* Failed clusters are dirty again, retry them */
+            cluster = 0;
+        }
+
+        if (job->in_flight >= job->max_workers) {
+            qemu_co_queue_wait(&job->task_queue, NULL);
+            continue;
+        }
+
+        if (cluster < nb_clusters) {
+            hbitmap_iter_init(&hbi, job->copy_bitmap, cluster);
+            cluster = hbitmap_iter_next(&hbi, true);
+        } else {
+            cluster = -1;
+        }
+        if (cluster < 0) {
+            if (job->in_flight == 0 && hbitmap_empty(job->copy_bitmap)) {
+                break;
+            }
+            /* Wait for requests that may fail and dirty clusters again */
+            if (job->in_flight) {
+                qemu_co_queue_wait(&job->task_queue, NULL);
+            }
+            cluster = 0;
+            continue;
+        }
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            ret = backup_cluster_is_allocated(job, cluster * job->cluster_size);
+            if (ret < 0) {
+                BlockErrorAction action = backup_error_action(job, true, -ret);
+                if (action == BLOCK_ERROR_ACTION_REPORT) {
+                    break;
+                }
+                ret = 0;
+                continue;
+            } else if (ret == 0) {
+                /* Already in the backing file */
+                hbitmap_reset(job->copy_bitmap, cluster, 1);
+                cluster++;
+                continue;
+            }
+            ret = 0;
+        }
+
+        next_zero = hbitmap_next_zero(job->copy_bitmap, cluster);
+        nb = next_zero < 0 ? nb_clusters - cluster : next_zero - cluster;
+        nb = MIN(nb, job->chunk_size / job->cluster_size);
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            for (i = 1; i < nb; i++) {
+                if (backup_cluster_is_allocated(job, (cluster + i) *
+                                                job->cluster_size) != 1) {
+                    break;
+                }
+            }
+            nb = i;
+        }
+
+        task = g_new(BackupTask, 1);
+        *task = (BackupTask) {
+            .job    = job,
+            .offset = cluster * job->cluster_size,
+            .bytes  = nb * job->cluster_size,
+        };
+        cluster += nb;
+
+        job->in_flight++;
+        co = qemu_coroutine_create(backup_task_entry, task);
+        qemu_coroutine_enter(co);
+    }
+
+    while (job->in_flight > 0) {
+        qemu_co_queue_wait(&job->task_queue, NULL);
+    }
+
+    return ret;
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     int ret;
@@ -488,6 +873,13 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         hbitmap_set(s->copy_bitmap, 0, nb_clusters);
     }
 
+    if (s->staging_size) {
+        QSIMPLEQ_INIT(&s->staged_chunks);
+        qemu_co_queue_init(&s->staging_queue);
+        qemu_co_queue_init(&s->staging_done);
+        s->staging_active = true;
+        qemu_coroutine_enter(qemu_coroutine_create(backup_staging_worker, s));
+    }
 
     s->before_write.notify = backup_before_write_notify;
     bdrv_add_before_write_notifier(bs, &s->before_write);
@@ -495,11 +887,13 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     if (s->sync_mode == MIRROR_SYNC_MODE_NONE) {
         /* All bits are set in copy_bitmap to allow any cluster to be copied.
          * This does not actually require them to be copied. */
-        while (!job_is_cancelled(job)) {
+        while (!job_is_cancelled(job) && !backup_staging_error(s)) {
             /* Yield until the job is cancelled.  We just let our before_write
              * notify callback service CoW requests. */
             job_yield(job);
         }
+    } else if (s->max_workers > 1 || s->max_chunk > s->cluster_size) {
+        ret = backup_run_parallel(s);
     } else if (s->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
         ret = backup_run_incremental(s);
     } else {
@@ -514,30 +908,11 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
             }
 
             if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i;
-                int64_t n;
-
                 /* Check to see if these blocks are already in the
                  * backing file. */
+                alloced = backup_cluster_is_allocated(s, offset);
 
-                for (i = 0; i < s->cluster_size;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs, offset + i,
-                                          s->cluster_size - i, &n);
-                    i += n;
-
-                    if (alloced || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
+                /* If the above check never found any sectors that are in
                  * the topmost image, skip this backup. */
                 if (alloced == 0) {
                     continue;
@@ -569,6 +944,23 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     /* wait until pending backup_do_cow() calls have completed */
     qemu_co_rwlock_wrlock(&s->flush_rwlock);
     qemu_co_rwlock_unlock(&s->flush_rwlock);
+
+    /* and until all staged data has been written to the target */
+    if (s->staging_size) {
+        while (!QSIMPLEQ_EMPTY(&s->staged_chunks) && ret == 0 &&
+               !job_is_cancelled(job) && !backup_staging_error(s))
+        {
+            qemu_co_queue_wait(&s->staging_done, NULL);
+        }
+        s->staging_stop = true;
+        qemu_co_queue_restart_all(&s->staging_queue);
+        while (s->staging_active) {
+            qemu_co_queue_wait(&s->staging_done, NULL);
+        }
+        if (ret == 0) {
+            ret = s->staging_ret;
+        }
+    }
     hbitmap_free(s->copy_bitmap);
 
     return ret;
@@ -593,7 +985,7 @@ static const BlockJobDriver backup_job_driver = {
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, const BackupPerf *perf,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -625,6 +1017,32 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (perf && perf->has_max_workers &&
+        (perf->max_workers < 1 || perf->max_workers > BACKUP_MAX_WORKERS)) {
+        error_setg(errp, "max-workers must be between 1 and %d",
+                   BACKUP_MAX_WORKERS);
+        return NULL;
+    }
+
+    if (perf && perf->has_max_chunk &&
+        (perf->max_chunk < 0 || perf->max_chunk > BACKUP_MAX_CHUNK)) {
+        error_setg(errp, "max-chunk must be between 0 and %" PRId64,
+                   BACKUP_MAX_CHUNK);
+        return NULL;
+    }
+
+    if (perf && perf->has_staging_size && perf->staging_size) {
+        if (perf->staging_size < 0) {
+            error_setg(errp, "staging-size must not be negative");
+            return NULL;
+        }
+        if (bdrv_chain_contains(target, bs)) {
+            error_setg(errp, "staging-size cannot be used if the target is "
+                       "backed by the source");
+            return NULL;
+        }
+    }
+
     if (compress && target->drv->bdrv_co_pwritev_compressed == NULL) {
         error_setg(errp, "Compression is not supported for this drive %s",
                    bdrv_get_device_name(target));
@@ -727,6 +1145,21 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                                QEMU_ALIGN_UP(job->copy_range_size,
                                              job->cluster_size));
 
+    job->max_workers = 1;
+    job->max_chunk = job->cluster_size;
+    if (perf && perf->has_max_workers) {
+        job->max_workers = perf->max_workers;
+    }
+    /* Compressed writes must be exactly one cluster */
+    if (perf && perf->has_max_chunk && !compress) {
+        job->max_chunk = MAX(job->cluster_size,
+                             QEMU_ALIGN_UP(perf->max_chunk,
+                                           job->cluster_size));
+    }
+    if (perf && perf->has_staging_size) {
+        job->staging_size = perf->staging_size;
+    }
+
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
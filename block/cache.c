@@ -0,0 +1,1554 @@
+/*
+ * Block-level cache filter driver
+ *
+ * Caches the data of its child node in blocks of a fixed size, in a RAM
+ * tier that is shared by all cache nodes on top of the same child and in an
+ * optional local file that keeps the cached data across restarts.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qapi/qmp/qdict.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "trace.h"
+
+#define CACHE_OPT_BLOCK_SIZE        "block-size"
+#define CACHE_OPT_RAM_SIZE          "ram-size"
+#define CACHE_OPT_MODE              "mode"
+
+#define CACHE_DEFAULT_BLOCK_SIZE    (64 * KiB)
+#define CACHE_MIN_BLOCK_SIZE        512
+#define CACHE_MAX_BLOCK_SIZE        (2 * MiB)
+#define CACHE_DEFAULT_RAM_SIZE      (64 * MiB)
+
+/* Largest request issued to the child or the cache file for a run of blocks */
+#define CACHE_MAX_RUN_BYTES         (1 * MiB)
+
+/* Cache file format */
+#define CACHE_MAGIC                 0x51434346 /* "QCCF" */
+#define CACHE_VERSION               1
+#define CACHE_FLAG_CLEAN            (1ULL << 0)
+#define CACHE_BITMAP_ALIGN          4096
+
+/*
+ * The cache file starts with this header (all fields big endian) and the
+ * filename of the cached node, followed by the valid and the dirty bitmap
+ * (little endian, one bit per block) and the data area, where block N lives
+ * at data_offset + N * block_size.
+ *
+ * A cache file whose filename or length do not match the cached node is
+ * thrown away unless it has dirty blocks.
+ *
+ * The valid bitmap is only written when the node is deactivated, which sets
+ * CACHE_FLAG_CLEAN; blocks that are not dirty are therefore forgotten after
+ * an unclean shutdown.  The dirty bitmap is updated before a write to the
+ * cache file completes.
+ */
+typedef struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t flags;
+    uint32_t block_size;
+    uint32_t child_name_size;
+    uint64_t length;
+    uint64_t valid_offset;
+    uint64_t dirty_offset;
+    uint64_t bitmap_size;
+    uint64_t data_offset;
+} QEMU_PACKED CacheHeader;
+
+#define CACHE_MAX_CHILD_NAME        (CACHE_BITMAP_ALIGN - sizeof(CacheHeader))
+
+typedef struct CacheEntry {
+    int64_t index;
+    uint8_t *data;
+    bool dirty;
+    QTAILQ_ENTRY(CacheEntry) next;
+} CacheEntry;
+
+typedef struct BDRVCacheState BDRVCacheState;
+
+/*
+ * The RAM tier of a child node.  All parents of a node run in the same
+ * AioContext, so the tier needs no locking as long as no entry is used
+ * across a yield.  @gen is incremented whenever cached data may have become
+ * stale; a request that read data from the child only inserts it into the
+ * cache if @gen did not change in the meantime.
+ */
+typedef struct CacheTier {
+    BlockDriverState *child;
+    uint32_t block_size;
+    bool writeback;
+    uint64_t max_blocks;
+    uint64_t nb_blocks;
+    uint64_t nb_dirty;
+    uint64_t gen;
+    GHashTable *entries;
+    QTAILQ_HEAD(, CacheEntry) lru;      /* clean entries, oldest first */
+    QTAILQ_HEAD(, CacheEntry) dirty;
+    QLIST_HEAD(, BDRVCacheState) nodes;
+    QLIST_ENTRY(CacheTier) next;
+} CacheTier;
+
+struct BDRVCacheState {
+    BlockDriverState *bs;
+    CacheTier *tier;
+    QLIST_ENTRY(BDRVCacheState) next;
+
+    uint32_t block_size;
+    uint64_t ram_blocks;
+    uint64_t max_run;
+    int64_t length;
+    int64_t nb_blocks;
+    bool writeback;
+    bool needs_write;
+    bool active;
+
+    /* Serializes writes, write-back and flushes in write-back mode */
+    CoMutex lock;
+
+    /* Local file tier */
+    BdrvChild *cache_file;
+    CacheHeader header;
+    char *child_name;
+    unsigned long *valid;
+    unsigned long *dirty;
+    /* Serializes writes to the data area in write-back mode */
+    CoMutex file_lock;
+
+    uint64_t ram_hits;
+    uint64_t file_hits;
+    uint64_t misses;
+    uint64_t writebacks;
+};
+
+static QLIST_HEAD(, CacheTier) cache_tiers =
+    QLIST_HEAD_INITIALIZER(cache_tiers);
+
+static QemuOptsList cache_runtime_opts = {
+    .name = "cache",
+    .head = QTAILQ_HEAD_INITIALIZER(cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache block",
+        },
+        {
+            .name = CACHE_OPT_RAM_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the RAM tier",
+        },
+        {
+            .name = CACHE_OPT_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "Write mode (writethrough, writeback)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static CacheEntry *cache_tier_lookup(CacheTier *tier, int64_t index)
+{
+    return g_hash_table_lookup(tier->entries, &index);
+}
+
+static void cache_tier_touch(CacheTier *tier, CacheEntry *e)
+{
+    if (!e->dirty) {
+        QTAILQ_REMOVE(&tier->lru, e, next);
+        QTAILQ_INSERT_TAIL(&tier->lru, e, next);
+    }
+}
+
+static void cache_tier_mark_dirty(CacheTier *tier, CacheEntry *e)
+{
+    if (!e->dirty) {
+        QTAILQ_REMOVE(&tier->lru, e, next);
+        QTAILQ_INSERT_TAIL(&tier->dirty, e, next);
+        e->dirty = true;
+        tier->nb_dirty++;
+    }
+}
+
+static void cache_tier_mark_clean(CacheTier *tier, CacheEntry *e)
+{
+    if (e->dirty) {
+        QTAILQ_REMOVE(&tier->dirty, e, next);
+        QTAILQ_INSERT_TAIL(&tier->lru, e, next);
+        e->dirty = false;
+        tier->nb_dirty--;
+    }
+}
+
+static void cache_tier_drop(CacheTier *tier, CacheEntry *e)
+{
+    g_hash_table_remove(tier->entries, &e->index);
+    if (e->dirty) {
+        QTAILQ_REMOVE(&tier->dirty, e, next);
+        tier->nb_dirty--;
+    } else {
+        QTAILQ_REMOVE(&tier->lru, e, next);
+    }
+    tier->nb_blocks--;
+    g_free(e->data);
+    g_free(e);
+}
+
+/* Evicts clean entries until there is room for @room more blocks */
+static bool cache_tier_make_room(CacheTier *tier, uint64_t room)
+{
+    while (tier->nb_blocks + room > tier->max_blocks) {
+        CacheEntry *e = QTAILQ_FIRST(&tier->lru);
+        if (!e) {
+            return false;
+        }
+        cache_tier_drop(tier, e);
+    }
+    return true;
+}
+
+/*
+ * Inserts a clean entry for block @index, taking ownership of @data.
+ * Returns NULL and frees @data if the tier is full of dirty blocks.
+ */
+static CacheEntry *cache_tier_insert(CacheTier *tier, int64_t index,
+                                     uint8_t *data)
+{
+    CacheEntry *e;
+
+    assert(!cache_tier_lookup(tier, index));
+    if (!cache_tier_make_room(tier, 1)) {
+        g_free(data);
+        return NULL;
+    }
+
+    e = g_new0(CacheEntry, 1);
+    e->index = index;
+    e->data = data;
+    g_hash_table_insert(tier->entries, &e->index, e);
+    QTAILQ_INSERT_TAIL(&tier->lru, e, next);
+    tier->nb_blocks++;
+    return e;
+}
+
+static void cache_tier_insert_copy(CacheTier *tier, int64_t index,
+                                   const uint8_t *buf)
+{
+    uint8_t *data;
+
+    if (!tier->max_blocks || cache_tier_lookup(tier, index)) {
+        return;
+    }
+    data = g_try_malloc(tier->block_size);
+    if (data) {
+        memcpy(data, buf, tier->block_size);
+        cache_tier_insert(tier, index, data);
+    }
+}
+
+/* Drops the clean RAM copies of blocks [first, first + nb) */
+static void cache_tier_invalidate(CacheTier *tier, int64_t first, int64_t nb)
+{
+    CacheEntry *e, *next_e;
+    int64_t i;
+
+    tier->gen++;
+
+    if (nb > tier->nb_blocks) {
+        QTAILQ_FOREACH_SAFE(e, &tier->lru, next, next_e) {
+            if (e->index >= first && e->index < first + nb) {
+                cache_tier_drop(tier, e);
+            }
+        }
+        return;
+    }
+
+    for (i = first; i < first + nb; i++) {
+        e = cache_tier_lookup(tier, i);
+        if (e && !e->dirty) {
+            cache_tier_drop(tier, e);
+        }
+    }
+}
+
+static int cache_tier_attach(BDRVCacheState *s, Error **errp)
+{
+    BlockDriverState *child = s->bs->file->bs;
+    CacheTier *tier;
+
+    QLIST_FOREACH(tier, &cache_tiers, next) {
+        if (tier->child == child) {
+            break;
+        }
+    }
+
+    if (tier) {
+        if (tier->writeback || s->writeback) {
+            error_setg(errp, "Node '%s' is already cached; the RAM tier cannot "
+                       "be shared with a write-back cache node",
+                       bdrv_get_node_name(child));
+            return -EINVAL;
+        }
+        if (tier->block_size != s->block_size) {
+            error_setg(errp, "Node '%s' is already cached with block-size "
+                       "%" PRIu32, bdrv_get_node_name(child),
+                       tier->block_size);
+            return -EINVAL;
+        }
+        tier->max_blocks = MAX(tier->max_blocks, s->ram_blocks);
+    } else {
+        tier = g_new0(CacheTier, 1);
+        tier->child = child;
+        tier->block_size = s->block_size;
+        tier->writeback = s->writeback;
+        tier->max_blocks = s->ram_blocks;
+        tier->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+        QTAILQ_INIT(&tier->lru);
+        QTAILQ_INIT(&tier->dirty);
+        QLIST_INIT(&tier->nodes);
+        bdrv_ref(child);
+        QLIST_INSERT_HEAD(&cache_tiers, tier, next);
+    }
+
+    QLIST_INSERT_HEAD(&tier->nodes, s, next);
+    s->tier = tier;
+    return 0;
+}
+
+static void cache_tier_detach(BDRVCacheState *s)
+{
+    CacheTier *tier = s->tier;
+    BDRVCacheState *other;
+    CacheEntry *e;
+
+    QLIST_REMOVE(s, next);
+    s->tier = NULL;
+
+    if (!QLIST_EMPTY(&tier->nodes)) {
+        tier->max_blocks = 0;
+        QLIST_FOREACH(other, &tier->nodes, next) {
+            tier->max_blocks = MAX(tier->max_blocks, other->ram_blocks);
+        }
+        cache_tier_make_room(tier, 0);
+        return;
+    }
+
+    while ((e = QTAILQ_FIRST(&tier->lru)) || (e = QTAILQ_FIRST(&tier->dirty))) {
+        cache_tier_drop(tier, e);
+    }
+    g_hash_table_destroy(tier->entries);
+    QLIST_REMOVE(tier, next);
+    bdrv_unref(tier->child);
+    g_free(tier);
+}
+
+/*
+ * Forgets the cached copies of the byte range in the RAM tier and in the
+ * file tiers of all nodes sharing the RAM tier.  Must not be called on a
+ * range with dirty blocks.
+ */
+static void cache_invalidate(BDRVCacheState *s, int64_t offset, int64_t bytes)
+{
+    int64_t first = offset / s->block_size;
+    int64_t nb = DIV_ROUND_UP(offset + bytes, s->block_size) - first;
+    BDRVCacheState *node;
+
+    trace_cache_invalidate(s->bs, offset, bytes);
+
+    cache_tier_invalidate(s->tier, first, nb);
+    QLIST_FOREACH(node, &s->tier->nodes, next) {
+        if (node->valid && first < node->nb_blocks) {
+            bitmap_clear(node->valid, first, MIN(nb, node->nb_blocks - first));
+        }
+    }
+}
+
+/* Writes the words of @map that hold the bits for blocks [first, last] */
+static int cache_file_write_bitmap(BDRVCacheState *s, unsigned long *map,
+                                   uint64_t base, int64_t first, int64_t last)
+{
+    int64_t w0 = first / BITS_PER_LONG;
+    int64_t nb_words = last / BITS_PER_LONG - w0 + 1;
+    unsigned long *buf;
+    int ret;
+
+    if (!s->nb_blocks) {
+        return 0;
+    }
+
+    buf = g_new(unsigned long, nb_words);
+    bitmap_to_le(buf, map + w0, nb_words * BITS_PER_LONG);
+    ret = bdrv_pwrite(s->cache_file, base + w0 * sizeof(unsigned long), buf,
+                      nb_words * sizeof(unsigned long));
+    g_free(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int cache_file_read_bitmap(BDRVCacheState *s, unsigned long *map,
+                                  uint64_t base)
+{
+    size_t size = BITS_TO_LONGS(s->nb_blocks) * sizeof(unsigned long);
+    unsigned long *buf;
+    int ret;
+
+    if (!size) {
+        return 0;
+    }
+
+    buf = g_malloc(size);
+    ret = bdrv_pread(s->cache_file, base, buf, size);
+    if (ret >= 0) {
+        bitmap_from_le(map, buf, s->nb_blocks);
+    }
+    g_free(buf);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int cache_file_write_header(BDRVCacheState *s)
+{
+    uint8_t buf[sizeof(CacheHeader) + CACHE_MAX_CHILD_NAME];
+    CacheHeader h = {
+        .magic          = cpu_to_be32(s->header.magic),
+        .version        = cpu_to_be32(s->header.version),
+        .flags          = cpu_to_be64(s->header.flags),
+        .block_size     = cpu_to_be32(s->header.block_size),
+        .child_name_size = cpu_to_be32(s->header.child_name_size),
+        .length         = cpu_to_be64(s->header.length),
+        .valid_offset   = cpu_to_be64(s->header.valid_offset),
+        .dirty_offset   = cpu_to_be64(s->header.dirty_offset),
+        .bitmap_size    = cpu_to_be64(s->header.bitmap_size),
+        .data_offset    = cpu_to_be64(s->header.data_offset),
+    };
+    int ret;
+
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), s->child_name, s->header.child_name_size);
+    ret = bdrv_pwrite(s->cache_file, 0, buf,
+                      sizeof(h) + s->header.child_name_size);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Writes back the dirty blocks in [first, last] to the child.  Works both
+ * inside and outside of coroutine context; in a coroutine the caller must
+ * hold s->lock.
+ */
+static int cache_writeback(BlockDriverState *bs, int64_t first, int64_t last)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheTier *tier = s->tier;
+    CacheEntry *e, *next_e;
+    uint8_t *buf;
+    int64_t index, end;
+    int ret = 0;
+
+    if (!s->cache_file) {
+        if (!s->writeback) {
+            return 0;
+        }
+        QTAILQ_FOREACH_SAFE(e, &tier->dirty, next, next_e) {
+            int64_t offset = e->index * s->block_size;
+
+            if (e->index < first || e->index > last) {
+                continue;
+            }
+            trace_cache_writeback(bs, e->index, 1);
+            ret = bdrv_pwrite(bs->file, offset, e->data,
+                              MIN(s->block_size, s->length - offset));
+            if (ret < 0) {
+                return ret;
+            }
+            cache_tier_mark_clean(tier, e);
+            s->writebacks++;
+        }
+        return 0;
+    }
+
+    last = MIN(last, s->nb_blocks - 1);
+    index = find_next_bit(s->dirty, last + 1, first);
+    if (index > last) {
+        return 0;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->max_run * s->block_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (index <= last) {
+        int64_t offset = index * s->block_size;
+        int64_t run, bytes;
+
+        end = find_next_zero_bit(s->dirty, last + 1, index);
+        run = MIN(end - index, s->max_run);
+        bytes = MIN(run * s->block_size, s->length - offset);
+
+        trace_cache_writeback(bs, index, run);
+        ret = bdrv_pread(s->cache_file, s->header.data_offset + offset, buf,
+                         bytes);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, bytes);
+        if (ret < 0) {
+            goto out;
+        }
+        s->writebacks += run;
+
+        index = find_next_bit(s->dirty, last + 1, index + run);
+    }
+
+    /* Only forget about the dirty blocks once they are stable in the child */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+    bitmap_clear(s->dirty, first, last - first + 1);
+    ret = cache_file_write_bitmap(s, s->dirty, s->header.dirty_offset,
+                                  first, last);
+
+out:
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int cache_writeback_all(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    if (!s->nb_blocks) {
+        return 0;
+    }
+    return cache_writeback(bs, 0, s->nb_blocks - 1);
+}
+
+/* Places the bitmaps and the data area for a node of @h->length bytes */
+static void cache_file_layout(CacheHeader *h)
+{
+    uint64_t nb_blocks = DIV_ROUND_UP(h->length, h->block_size);
+
+    h->bitmap_size = ROUND_UP(DIV_ROUND_UP(nb_blocks, 8), CACHE_BITMAP_ALIGN);
+    h->valid_offset = CACHE_BITMAP_ALIGN;
+    h->dirty_offset = h->valid_offset + h->bitmap_size;
+    h->data_offset = ROUND_UP(h->dirty_offset + h->bitmap_size,
+                              h->block_size);
+}
+
+/* Returns 1 if the dirty bitmap described by @h has any bit set */
+static int cache_file_any_dirty(BDRVCacheState *s, CacheHeader *h)
+{
+    uint64_t size = DIV_ROUND_UP(DIV_ROUND_UP(h->length, h->block_size), 8);
+    uint64_t pos, len;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = g_malloc(CACHE_BITMAP_ALIGN);
+    for (pos = 0; pos < size && ret == 0; pos += len) {
+        len = MIN(size - pos, CACHE_BITMAP_ALIGN);
+        ret = bdrv_pread(s->cache_file, h->dirty_offset + pos, buf, len);
+        if (ret >= 0) {
+            ret = !buffer_is_zero(buf, len);
+        }
+    }
+    g_free(buf);
+
+    return ret;
+}
+
+static int cache_file_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheHeader h, layout, *expected = &s->header;
+    char child_name[CACHE_MAX_CHILD_NAME];
+    int64_t file_length;
+    int ret;
+
+    s->child_name = g_strndup(bs->file->bs->filename, CACHE_MAX_CHILD_NAME);
+
+    expected->magic = CACHE_MAGIC;
+    expected->version = CACHE_VERSION;
+    expected->flags = 0;
+    expected->block_size = s->block_size;
+    expected->child_name_size = strlen(s->child_name);
+    expected->length = s->length;
+    cache_file_layout(expected);
+
+    s->valid = bitmap_new(s->nb_blocks);
+    s->dirty = bitmap_new(s->nb_blocks);
+
+    file_length = bdrv_getlength(s->cache_file->bs);
+    if (file_length < 0) {
+        error_setg_errno(errp, -file_length,
+                         "Could not get the size of the cache file");
+        return file_length;
+    }
+
+    if (file_length == 0) {
+        /* A new cache file; it is initialized on activation */
+        return 0;
+    }
+
+    ret = bdrv_pread(s->cache_file, 0, &h, sizeof(h));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache file header");
+        return ret;
+    }
+
+    h.magic = be32_to_cpu(h.magic);
+    if (h.magic == 0 && buffer_is_zero(&h, sizeof(h))) {
+        return 0;
+    }
+    if (h.magic != CACHE_MAGIC) {
+        error_setg(errp, "'%s' is not a cache file",
+                   s->cache_file->bs->filename);
+        return -EINVAL;
+    }
+
+    h.version = be32_to_cpu(h.version);
+    h.flags = be64_to_cpu(h.flags);
+    h.block_size = be32_to_cpu(h.block_size);
+    h.child_name_size = be32_to_cpu(h.child_name_size);
+    h.length = be64_to_cpu(h.length);
+    h.valid_offset = be64_to_cpu(h.valid_offset);
+    h.dirty_offset = be64_to_cpu(h.dirty_offset);
+    h.bitmap_size = be64_to_cpu(h.bitmap_size);
+    h.data_offset = be64_to_cpu(h.data_offset);
+
+    if (h.version != CACHE_VERSION) {
+        error_setg(errp, "Unsupported cache file version %" PRIu32,
+                   h.version);
+        return -ENOTSUP;
+    }
+    if (h.block_size != expected->block_size) {
+        error_setg(errp, "The cache file was created with block-size "
+                   "%" PRIu32, h.block_size);
+        return -EINVAL;
+    }
+
+    layout = h;
+    if (h.length <= INT64_MAX) {
+        cache_file_layout(&layout);
+    }
+    if (h.length > INT64_MAX ||
+        h.child_name_size > CACHE_MAX_CHILD_NAME ||
+        h.valid_offset != layout.valid_offset ||
+        h.dirty_offset != layout.dirty_offset ||
+        h.bitmap_size != layout.bitmap_size ||
+        h.data_offset != layout.data_offset)
+    {
+        error_setg(errp, "Corrupt cache file header");
+        return -EINVAL;
+    }
+
+    ret = bdrv_pread(s->cache_file, sizeof(h), child_name, h.child_name_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache file header");
+        return ret;
+    }
+
+    if (h.length != expected->length ||
+        h.child_name_size != expected->child_name_size ||
+        memcmp(child_name, s->child_name, h.child_name_size))
+    {
+        /* The cache file belongs to another node, or the node was resized
+         * without the cache; none of the cached data can be trusted.  Dirty
+         * blocks cannot be thrown away, though. */
+        ret = cache_file_any_dirty(s, &h);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the dirty bitmap");
+            return ret;
+        }
+        if (ret) {
+            error_setg(errp, "The cache file has dirty blocks of node '%.*s' "
+                       "with length %" PRIu64, (int)h.child_name_size,
+                       child_name, h.length);
+            return -EINVAL;
+        }
+        trace_cache_file_discard(bs);
+        return 0;
+    }
+
+    ret = cache_file_read_bitmap(s, s->dirty, h.dirty_offset);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the dirty bitmap");
+        return ret;
+    }
+
+    if ((flags & BDRV_O_INACTIVE) && !bitmap_empty(s->dirty, s->nb_blocks)) {
+        error_setg(errp, "The cache file has dirty blocks and cannot be "
+                   "used by an inactive node");
+        return -EINVAL;
+    }
+
+    if (h.flags & CACHE_FLAG_CLEAN) {
+        ret = cache_file_read_bitmap(s, s->valid, h.valid_offset);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the valid bitmap");
+            return ret;
+        }
+        bitmap_or(s->valid, s->valid, s->dirty, s->nb_blocks);
+    } else {
+        /* Only the dirty blocks survive an unclean shutdown */
+        bitmap_copy(s->valid, s->dirty, s->nb_blocks);
+    }
+
+    return 0;
+}
+
+static int cache_activate(BlockDriverState *bs, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->cache_file) {
+        s->active = true;
+        return 0;
+    }
+
+    if (!bitmap_empty(s->dirty, s->nb_blocks)) {
+        if (bdrv_is_read_only(bs)) {
+            error_setg(errp, "The cache file has dirty blocks, but the node "
+                       "is read-only");
+            return -EACCES;
+        }
+        if (!s->writeback) {
+            ret = cache_writeback_all(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not write back the dirty "
+                                 "blocks of the cache file");
+                return ret;
+            }
+        }
+    }
+
+    s->header.flags &= ~CACHE_FLAG_CLEAN;
+    ret = cache_file_write_header(s);
+    if (ret == 0) {
+        ret = cache_file_write_bitmap(s, s->dirty, s->header.dirty_offset,
+                                      0, s->nb_blocks - 1);
+    }
+    if (ret == 0) {
+        ret = bdrv_flush(s->cache_file->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache file");
+        return ret;
+    }
+
+    s->active = true;
+    return 0;
+}
+
+/*
+ * Writes back all dirty blocks and, if there is a cache file, records its
+ * valid and dirty bitmaps so that the cached data can be used again.
+ */
+static int cache_deactivate(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret, ret2;
+
+    if (!s->active) {
+        return 0;
+    }
+
+    ret = cache_writeback_all(bs);
+
+    if (s->cache_file) {
+        ret2 = cache_file_write_bitmap(s, s->valid, s->header.valid_offset,
+                                       0, s->nb_blocks - 1);
+        if (ret2 == 0) {
+            ret2 = cache_file_write_bitmap(s, s->dirty,
+                                           s->header.dirty_offset,
+                                           0, s->nb_blocks - 1);
+        }
+        if (ret2 == 0) {
+            ret2 = bdrv_flush(s->cache_file->bs);
+        }
+        if (ret2 == 0) {
+            s->header.flags |= CACHE_FLAG_CLEAN;
+            ret2 = cache_file_write_header(s);
+        }
+        if (ret2 == 0) {
+            ret2 = bdrv_flush(s->cache_file->bs);
+        }
+        ret = ret < 0 ? ret : ret2;
+    }
+
+    s->active = false;
+    return ret;
+}
+
+static bool cache_has_file_options(QDict *options)
+{
+    const QDictEntry *e;
+
+    for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+        const char *key = qdict_entry_key(e);
+        if (!strcmp(key, "cache-file") || strstart(key, "cache-file.", NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int cache_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t block_size, ram_size;
+    int mode, ret;
+
+    s->bs = bs;
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->file_lock);
+
+    opts = qemu_opts_create(&cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    block_size = qemu_opt_get_size(opts, CACHE_OPT_BLOCK_SIZE,
+                                   CACHE_DEFAULT_BLOCK_SIZE);
+    if (block_size < CACHE_MIN_BLOCK_SIZE ||
+        block_size > CACHE_MAX_BLOCK_SIZE || !is_power_of_2(block_size))
+    {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d", CACHE_MIN_BLOCK_SIZE, CACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->block_size = block_size;
+    s->max_run = MAX(CACHE_MAX_RUN_BYTES / block_size, 1);
+
+    ram_size = qemu_opt_get_size(opts, CACHE_OPT_RAM_SIZE,
+                                 CACHE_DEFAULT_RAM_SIZE);
+    s->ram_blocks = ram_size / block_size;
+
+    mode = qapi_enum_parse(&BlockdevCacheFilterMode_lookup,
+                           qemu_opt_get(opts, CACHE_OPT_MODE),
+                           BLOCKDEV_CACHE_FILTER_MODE_WRITETHROUGH,
+                           &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->writeback = mode == BLOCKDEV_CACHE_FILTER_MODE_WRITEBACK;
+
+    if (cache_has_file_options(options)) {
+        /* The cache file is written even if the node itself is read-only */
+        if (!qdict_haskey(options, "cache-file")) {
+            qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                                  "off");
+        }
+    } else if (s->writeback && s->ram_blocks < 2) {
+        error_setg(errp, "Write-back mode needs a cache-file or a ram-size of "
+                   "at least two blocks");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Write-back and replaying the dirty blocks of a cache file write to the
+     * child independently of the parents' requests */
+    s->needs_write = !bdrv_is_read_only(bs) &&
+                     (s->writeback || cache_has_file_options(options));
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_file, true, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->length = bdrv_getlength(bs->file->bs);
+    if (s->length < 0) {
+        error_setg_errno(errp, -s->length, "Could not get the size of the "
+                         "cached node");
+        ret = s->length;
+        goto fail;
+    }
+    s->nb_blocks = DIV_ROUND_UP(s->length, s->block_size);
+
+    if (!s->writeback) {
+        bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+                                    (BDRV_REQ_FUA &
+                                        bs->file->bs->supported_write_flags);
+    } else {
+        /* FUA writes are emulated with a flush */
+        bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED;
+    }
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+                               ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP) &
+                                    bs->file->bs->supported_zero_flags);
+
+    ret = cache_tier_attach(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (s->cache_file) {
+        ret = cache_file_open(bs, flags, errp);
+        if (ret < 0) {
+            goto fail_detach;
+        }
+    }
+
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = cache_activate(bs, errp);
+        if (ret < 0) {
+            goto fail_detach;
+        }
+    }
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail_detach:
+    cache_tier_detach(s);
+fail:
+    if (s->cache_file) {
+        bdrv_unref_child(bs, s->cache_file);
+        s->cache_file = NULL;
+    }
+    g_free(s->valid);
+    g_free(s->dirty);
+    g_free(s->child_name);
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void cache_close(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    cache_deactivate(bs);
+    cache_tier_detach(s);
+    g_free(s->valid);
+    g_free(s->dirty);
+    g_free(s->child_name);
+}
+
+#define PERM_PASSTHROUGH (BLK_PERM_CONSISTENT_READ \
+                          | BLK_PERM_WRITE \
+                          | BLK_PERM_RESIZE)
+#define PERM_UNCHANGED (BLK_PERM_ALL & ~PERM_PASSTHROUGH)
+
+static void cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                             const BdrvChildRole *role,
+                             BlockReopenQueue *reopen_queue,
+                             uint64_t perm, uint64_t shared,
+                             uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    /* The cache file is attached after bs->file */
+    if (c ? c != bs->file : bs->file != NULL) {
+        *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE | BLK_PERM_RESIZE;
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED |
+                   BLK_PERM_GRAPH_MOD;
+        return;
+    }
+
+    *nperm = (perm & PERM_PASSTHROUGH) | BLK_PERM_WRITE_UNCHANGED;
+    if (s->needs_write) {
+        *nperm |= BLK_PERM_WRITE;
+    }
+
+    /* Writes that bypass this node would leave stale data in the cache */
+    *nshared = (shared & BLK_PERM_CONSISTENT_READ) | PERM_UNCHANGED;
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        *nshared |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+}
+
+static int64_t cache_getlength(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    return s->length;
+}
+
+/*
+ * Stores @run blocks that were read from the child in the file tier, unless
+ * the cached data may have become stale in the meantime.  The cache is best
+ * effort, so errors are ignored.
+ */
+static void coroutine_fn cache_file_populate(BlockDriverState *bs,
+                                             int64_t index, int64_t run,
+                                             uint8_t *buf, uint64_t gen)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (s->writeback) {
+        qemu_co_mutex_lock(&s->file_lock);
+    }
+    if (s->tier->gen == gen) {
+        ret = bdrv_pwrite(s->cache_file,
+                          s->header.data_offset + index * s->block_size,
+                          buf, run * s->block_size);
+        if (ret >= 0 && s->tier->gen == gen) {
+            bitmap_set(s->valid, index, run);
+        }
+    }
+    if (s->writeback) {
+        qemu_co_mutex_unlock(&s->file_lock);
+    }
+}
+
+/*
+ * Reads blocks [index, index + run) into @buf, from the cache file if
+ * @index is valid there (in which case @run must be 1), and from the child
+ * otherwise.  Data read from the child is inserted into both tiers.
+ */
+static int coroutine_fn cache_fill(BlockDriverState *bs, int64_t index,
+                                   int64_t run, uint8_t *buf)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheTier *tier = s->tier;
+    uint64_t gen = tier->gen;
+    int64_t offset = index * s->block_size;
+    int64_t bytes = MIN(run * s->block_size, s->length - offset);
+    bool from_file = s->valid && test_bit(index, s->valid);
+    int64_t i;
+    int ret;
+
+    if (from_file) {
+        assert(run == 1);
+        ret = bdrv_pread(s->cache_file, s->header.data_offset + offset, buf,
+                         bytes);
+    } else {
+        ret = bdrv_pread(bs->file, offset, buf, bytes);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    memset(buf + bytes, 0, run * s->block_size - bytes);
+
+    if (from_file) {
+        s->file_hits++;
+    } else {
+        s->misses += run;
+    }
+
+    if (tier->gen != gen) {
+        /* Raced with a write, the data may already be stale */
+        return 0;
+    }
+
+    for (i = 0; i < run; i++) {
+        cache_tier_insert_copy(tier, index + i, buf + i * s->block_size);
+    }
+    if (!from_file && s->cache_file && s->active) {
+        cache_file_populate(bs, index, run, buf, gen);
+    }
+    return 0;
+}
+
+static bool cache_block_cached(BDRVCacheState *s, int64_t index)
+{
+    return cache_tier_lookup(s->tier, index) ||
+           (s->valid && test_bit(index, s->valid));
+}
+
+static int coroutine_fn cache_co_preadv(BlockDriverState *bs,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, int flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheTier *tier = s->tier;
+    uint64_t end = offset + bytes;
+    int64_t index = offset / s->block_size;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    while (index * s->block_size < end) {
+        uint64_t block_start = index * s->block_size;
+        uint64_t start = MAX(offset, block_start);
+        CacheEntry *e = cache_tier_lookup(tier, index);
+        int64_t run = 1;
+
+        if (e) {
+            uint64_t len = MIN(end, block_start + s->block_size) - start;
+
+            qemu_iovec_from_buf(qiov, start - offset,
+                                e->data + (start - block_start), len);
+            cache_tier_touch(tier, e);
+            s->ram_hits++;
+            index++;
+            continue;
+        }
+
+        if (!s->valid || !test_bit(index, s->valid)) {
+            /* Read the following missed blocks with the same request */
+            while (run < s->max_run &&
+                   (index + run) * s->block_size < end &&
+                   !cache_block_cached(s, index + run))
+            {
+                run++;
+            }
+        }
+
+        if (!buf) {
+            buf = qemu_try_blockalign(bs->file->bs,
+                                      s->max_run * s->block_size);
+            if (!buf) {
+                return -ENOMEM;
+            }
+        }
+
+        ret = cache_fill(bs, index, run, buf);
+        if (ret < 0) {
+            break;
+        }
+        qemu_iovec_from_buf(qiov, start - offset, buf + (start - block_start),
+                            MIN(end, block_start + run * s->block_size) -
+                            start);
+        index += run;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Reads a whole block from the child for a read-modify-write cycle */
+static int coroutine_fn cache_read_block(BlockDriverState *bs, int64_t index,
+                                         uint8_t *buf)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t offset = index * s->block_size;
+    int64_t bytes = MIN(s->block_size, s->length - offset);
+    int ret;
+
+    ret = bdrv_pread(bs->file, offset, buf, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    memset(buf + bytes, 0, s->block_size - bytes);
+    return 0;
+}
+
+/* Write-back without a cache file: dirty blocks are kept in RAM */
+static int coroutine_fn cache_write_ram(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheTier *tier = s->tier;
+    uint64_t end = offset + bytes;
+    int64_t first = offset / s->block_size;
+    int64_t last = (end - 1) / s->block_size;
+    int64_t index;
+    int ret;
+
+    if (last - first + 1 > tier->max_blocks / 2) {
+        /* Too large to be absorbed, write it through */
+        ret = cache_writeback(bs, first, last);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, 0);
+        cache_invalidate(s, offset, bytes);
+        return ret;
+    }
+
+    /* Keep concurrent reads from caching the old data */
+    tier->gen++;
+
+    for (index = first; index <= last; index++) {
+        uint64_t block_start = index * s->block_size;
+        uint64_t start = MAX(offset, block_start);
+        uint64_t len = MIN(end, block_start + s->block_size) - start;
+        CacheEntry *e = cache_tier_lookup(tier, index);
+
+        if (!e) {
+            uint8_t *data;
+
+            if (!cache_tier_make_room(tier, 1)) {
+                /* Only dirty blocks are left, e.g. because an earlier
+                 * write-back failed */
+                ret = cache_writeback(bs, 0, s->nb_blocks - 1);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+
+            data = g_try_malloc(s->block_size);
+            if (!data) {
+                return -ENOMEM;
+            }
+            if (len < s->block_size) {
+                ret = cache_read_block(bs, index, data);
+                if (ret < 0) {
+                    g_free(data);
+                    return ret;
+                }
+            }
+            /* A read may have cached the block while we were waiting */
+            e = cache_tier_lookup(tier, index);
+            if (e) {
+                g_free(data);
+            } else {
+                e = cache_tier_insert(tier, index, data);
+                if (!e) {
+                    return -ENOSPC;
+                }
+            }
+        }
+
+        qemu_iovec_to_buf(qiov, start - offset,
+                          e->data + (start - block_start), len);
+        cache_tier_mark_dirty(tier, e);
+    }
+
+    tier->gen++;
+
+    if (tier->nb_dirty > tier->max_blocks / 2) {
+        return cache_writeback(bs, 0, s->nb_blocks - 1);
+    }
+    return 0;
+}
+
+/* Write-back with a cache file: dirty blocks are kept in the cache file */
+static int coroutine_fn cache_write_file(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t start = offset;
+    int64_t first = offset / s->block_size;
+    int64_t last = (end - 1) / s->block_size;
+    QEMUIOVector local_qiov;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    /* The RAM tier only holds clean data in this mode */
+    cache_tier_invalidate(s->tier, first, last - first + 1);
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->file_lock);
+
+    while (start < end) {
+        int64_t index = start / s->block_size;
+        uint64_t block_start = index * s->block_size;
+        uint64_t len;
+
+        if (start == block_start && end - start >= s->block_size) {
+            len = QEMU_ALIGN_DOWN(end - start, s->block_size);
+        } else {
+            len = MIN(end, block_start + s->block_size) - start;
+        }
+
+        if (len % s->block_size == 0 || test_bit(index, s->valid)) {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, start - offset, len);
+            ret = bdrv_co_pwritev(s->cache_file,
+                                  s->header.data_offset + start, len,
+                                  &local_qiov, 0);
+        } else {
+            /* Partial write to a block that the cache file doesn't hold */
+            if (!buf) {
+                buf = qemu_try_blockalign(s->cache_file->bs, s->block_size);
+                if (!buf) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+            }
+            ret = cache_read_block(bs, index, buf);
+            if (ret < 0) {
+                goto out;
+            }
+            qemu_iovec_to_buf(qiov, start - offset,
+                              buf + (start - block_start), len);
+            ret = bdrv_pwrite(s->cache_file,
+                              s->header.data_offset + block_start, buf,
+                              s->block_size);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        bitmap_set(s->valid, index, DIV_ROUND_UP(start + len, s->block_size) -
+                                    index);
+        bitmap_set(s->dirty, index, DIV_ROUND_UP(start + len, s->block_size) -
+                                    index);
+        start += len;
+    }
+
+    ret = cache_file_write_bitmap(s, s->dirty, s->header.dirty_offset,
+                                  first, last);
+
+out:
+    /* A read that started after the invalidation above may have cached the
+     * old data of the child in the meantime */
+    cache_tier_invalidate(s->tier, first, last - first + 1);
+    qemu_co_mutex_unlock(&s->file_lock);
+    qemu_iovec_destroy(&local_qiov);
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn cache_co_pwritev(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov, int flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->writeback) {
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+        if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+            cache_invalidate(s, offset, bytes);
+        }
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->cache_file) {
+        ret = cache_write_file(bs, offset, bytes, qiov);
+    } else {
+        ret = cache_write_ram(bs, offset, bytes, qiov);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int bytes,
+                                               BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = cache_writeback(bs, offset / s->block_size,
+                          (offset + bytes - 1) / s->block_size);
+    if (ret == 0) {
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+        cache_invalidate(s, offset, bytes);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn cache_co_pdiscard(BlockDriverState *bs,
+                                          int64_t offset, int bytes)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = cache_writeback(bs, offset / s->block_size,
+                          (offset + bytes - 1) / s->block_size);
+    if (ret == 0) {
+        ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+        cache_invalidate(s, offset, bytes);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * Dirty blocks are only in the cache and must be reported as data even if
+ * the child still has a hole there; everything else is the child's business.
+ */
+static int coroutine_fn cache_co_block_status(BlockDriverState *bs,
+                                              bool want_zero,
+                                              int64_t offset, int64_t bytes,
+                                              int64_t *pnum, int64_t *map,
+                                              BlockDriverState **file)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheTier *tier = s->tier;
+    int64_t first = offset / s->block_size;
+    int64_t last = (offset + bytes - 1) / s->block_size;
+    int64_t end;
+    CacheEntry *e;
+    bool dirty;
+
+    if (s->dirty) {
+        dirty = test_bit(first, s->dirty);
+        end = dirty ? find_next_zero_bit(s->dirty, last + 1, first)
+                    : find_next_bit(s->dirty, last + 1, first);
+    } else {
+        e = cache_tier_lookup(tier, first);
+        dirty = e && e->dirty;
+        if (dirty) {
+            for (end = first + 1; end <= last; end++) {
+                e = cache_tier_lookup(tier, end);
+                if (!e || !e->dirty) {
+                    break;
+                }
+            }
+        } else {
+            end = last + 1;
+            QTAILQ_FOREACH(e, &tier->dirty, next) {
+                if (e->index > first && e->index < end) {
+                    end = e->index;
+                }
+            }
+        }
+    }
+
+    bytes = MIN(end * s->block_size, offset + bytes) - offset;
+    if (dirty) {
+        *pnum = bytes;
+        return BDRV_BLOCK_DATA;
+    }
+    return bdrv_co_block_status_from_file(bs, want_zero, offset, bytes,
+                                          pnum, map, file);
+}
+
+static int coroutine_fn cache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->writeback) {
+        return 0;
+    }
+
+    /* Dirty blocks in the cache file are safe once the file is flushed;
+     * dirty blocks in RAM must reach the child, which is flushed after us */
+    qemu_co_mutex_lock(&s->lock);
+    if (s->cache_file) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+    } else {
+        ret = cache_writeback_all(bs);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static void coroutine_fn cache_co_invalidate_cache(BlockDriverState *bs,
+                                                   Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    /* Someone else may have written to the child while we were inactive */
+    cache_tier_invalidate(s->tier, 0, s->nb_blocks);
+    if (s->valid) {
+        bitmap_copy(s->valid, s->dirty, s->nb_blocks);
+    }
+
+    cache_activate(bs, errp);
+}
+
+static int cache_inactivate(BlockDriverState *bs)
+{
+    return cache_deactivate(bs);
+}
+
+static BlockStatsSpecific *cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_CACHE;
+    stats->u.cache = (BlockStatsSpecificCache) {
+        .ram_hits       = s->ram_hits,
+        .file_hits      = s->file_hits,
+        .misses         = s->misses,
+        .ram_blocks     = s->tier->nb_blocks,
+        .file_blocks    = s->valid ? bitmap_count_one(s->valid,
+                                                      s->nb_blocks) : 0,
+        .dirty_blocks   = s->dirty ? bitmap_count_one(s->dirty, s->nb_blocks)
+                                   : s->tier->nb_dirty,
+        .writebacks     = s->writebacks,
+    };
+
+    return stats;
+}
+
+static void cache_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void cache_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static bool cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                              BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_cache = {
+    .format_name                        = "cache",
+    .instance_size                      = sizeof(BDRVCacheState),
+
+    .bdrv_open                          = cache_open,
+    .bdrv_close                         = cache_close,
+    .bdrv_child_perm                    = cache_child_perm,
+
+    .bdrv_getlength                     = cache_getlength,
+
+    .bdrv_co_preadv                     = cache_co_preadv,
+    .bdrv_co_pwritev                    = cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = cache_co_pdiscard,
+    .bdrv_co_flush_to_os                = cache_co_flush_to_os,
+
+    .bdrv_co_invalidate_cache           = cache_co_invalidate_cache,
+    .bdrv_inactivate                    = cache_inactivate,
+
+    .bdrv_eject                         = cache_eject,
+    .bdrv_lock_medium                   = cache_lock_medium,
+
+    .bdrv_co_block_status               = cache_co_block_status,
+    .bdrv_get_specific_stats            = cache_get_specific_stats,
+
+    .bdrv_recurse_is_first_non_filter   = cache_recurse_is_first_non_filter,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_cache_init(void)
+{
+    bdrv_register(&bdrv_cache);
+}
+
+block_init(bdrv_cache_init);
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
+#include "qemu/processor.h"
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
@@ -37,7 +38,7 @@
  *     or enabled. A frozen bitmap can only abdicate() or reclaim().
  */
 struct BdrvDirtyBitmap {
-    QemuMutex *mutex;
+    BlockDriverState *bs;       /* Owner; its dirty_bitmap_mutex protects us */
     HBitmap *bitmap;            /* Dirty bitmap implementation */
     HBitmap *meta;              /* Meta dirty bitmap */
     bool qmp_locked;            /* Bitmap is locked, it can't be modified
@@ -67,24 +68,40 @@ struct BdrvDirtyBitmapIter {
     BdrvDirtyBitmap *bitmap;
 };
 
+/* bdrv_set_dirty() does not take dirty_bitmap_mutex; it only announces
+ * itself in bs->dirty_bitmap_writers while it sets bits with
+ * hbitmap_set_atomic().  Whoever takes the mutex waits for those writers to
+ * finish, and makes new ones fall back to taking the mutex until it is
+ * released.  This way holders of the mutex still have exclusive access to
+ * the bitmaps.
+ */
 static inline void bdrv_dirty_bitmaps_lock(BlockDriverState *bs)
 {
     qemu_mutex_lock(&bs->dirty_bitmap_mutex);
+    atomic_set(&bs->dirty_bitmap_exclusive, true);
+
+    /* Pairs with smp_mb() in bdrv_set_dirty() */
+    smp_mb();
+    while (atomic_read(&bs->dirty_bitmap_writers)) {
+        cpu_relax();
+    }
+    smp_mb_acquire();
 }
 
 static inline void bdrv_dirty_bitmaps_unlock(BlockDriverState *bs)
 {
+    atomic_store_release(&bs->dirty_bitmap_exclusive, false);
     qemu_mutex_unlock(&bs->dirty_bitmap_mutex);
 }
 
 void bdrv_dirty_bitmap_lock(BdrvDirtyBitmap *bitmap)
 {
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
 }
 
 void bdrv_dirty_bitmap_unlock(BdrvDirtyBitmap *bitmap)
 {
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
 /* Called with BQL or dirty_bitmap lock taken.  */
@@ -123,8 +140,8 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
         return NULL;
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
-    bitmap->mutex = &bs->dirty_bitmap_mutex;
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ctz32(granularity));
+    bitmap->bs = bs;
+    bitmap->bitmap = hbitmap_alloc_sparse(bitmap_size, ctz32(granularity));
     bitmap->size = bitmap_size;
     bitmap->name = g_strdup(name);
     bitmap->disabled = false;
@@ -149,19 +166,19 @@ void bdrv_create_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                                    int chunk_size)
 {
     assert(!bitmap->meta);
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     bitmap->meta = hbitmap_create_meta(bitmap->bitmap,
                                        chunk_size * BITS_PER_BYTE);
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 void bdrv_release_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap)
 {
     assert(bitmap->meta);
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     hbitmap_free_meta(bitmap->bitmap);
     bitmap->meta = NULL;
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
@@ -188,9 +205,9 @@ bool bdrv_dirty_bitmap_user_locked(BdrvDirtyBitmap *bitmap) {
 
 void bdrv_dirty_bitmap_set_qmp_locked(BdrvDirtyBitmap *bitmap, bool qmp_locked)
 {
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     bitmap->qmp_locked = qmp_locked;
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 bool bdrv_dirty_bitmap_qmp_locked(BdrvDirtyBitmap *bitmap)
@@ -260,10 +277,10 @@ void bdrv_enable_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap)
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_enable_successor(BdrvDirtyBitmap *bitmap)
 {
-    assert(bitmap->mutex == bitmap->successor->mutex);
-    qemu_mutex_lock(bitmap->mutex);
+    assert(bitmap->bs == bitmap->successor->bs);
+    bdrv_dirty_bitmap_lock(bitmap);
     bdrv_enable_dirty_bitmap_locked(bitmap->successor);
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 /* Called within bdrv_dirty_bitmap_lock..unlock and with BQL taken.  */
@@ -341,9 +358,9 @@ BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap(BlockDriverState *bs,
 {
     BdrvDirtyBitmap *ret;
 
-    qemu_mutex_lock(parent->mutex);
+    bdrv_dirty_bitmap_lock(parent);
     ret = bdrv_reclaim_dirty_bitmap_locked(bs, parent, errp);
-    qemu_mutex_unlock(parent->mutex);
+    bdrv_dirty_bitmap_unlock(parent);
 
     return ret;
 }
@@ -615,8 +632,8 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bitmap->bitmap = hbitmap_alloc_sparse(bitmap->size,
+                                              hbitmap_granularity(backup));
         *out = backup;
     }
     bdrv_dirty_bitmap_unlock(bitmap);
@@ -683,6 +700,25 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes)
         return;
     }
 
+    /* Fast path: nobody holds dirty_bitmap_mutex, and whoever takes it
+     * will wait for us to finish.  The list of bitmaps cannot change either,
+     * because that also requires the mutex.
+     */
+    atomic_inc(&bs->dirty_bitmap_writers);
+    smp_mb();
+    if (!atomic_load_acquire(&bs->dirty_bitmap_exclusive)) {
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            if (!bdrv_dirty_bitmap_enabled(bitmap)) {
+                continue;
+            }
+            assert(!bdrv_dirty_bitmap_readonly(bitmap));
+            hbitmap_set_atomic(bitmap->bitmap, offset, bytes);
+        }
+        atomic_dec(&bs->dirty_bitmap_writers);
+        return;
+    }
+    atomic_dec(&bs->dirty_bitmap_writers);
+
     bdrv_dirty_bitmaps_lock(bs);
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
         if (!bdrv_dirty_bitmap_enabled(bitmap)) {
@@ -720,9 +756,9 @@ bool bdrv_dirty_bitmap_readonly(const BdrvDirtyBitmap *bitmap)
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_set_readonly(BdrvDirtyBitmap *bitmap, bool value)
 {
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     bitmap->readonly = value;
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 bool bdrv_has_readonly_bitmaps(BlockDriverState *bs)
@@ -740,17 +776,17 @@ bool bdrv_has_readonly_bitmaps(BlockDriverState *bs)
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_set_persistance(BdrvDirtyBitmap *bitmap, bool persistent)
 {
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     bitmap->persistent = persistent;
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_set_migration(BdrvDirtyBitmap *bitmap, bool migration)
 {
-    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_lock(bitmap);
     bitmap->migration = migration;
-    qemu_mutex_unlock(bitmap->mutex);
+    bdrv_dirty_bitmap_unlock(bitmap);
 }
 
 bool bdrv_dirty_bitmap_get_persistance(BdrvDirtyBitmap *bitmap)
@@ -793,9 +829,9 @@ void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
     bool ret;
 
     /* only bitmaps from one bds are supported */
-    assert(dest->mutex == src->mutex);
+    assert(dest->bs == src->bs);
 
-    qemu_mutex_lock(dest->mutex);
+    bdrv_dirty_bitmap_lock(dest);
 
     if (bdrv_dirty_bitmap_user_locked(dest)) {
         error_setg(errp, "Bitmap '%s' is currently in use by another"
@@ -816,7 +852,8 @@ void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        dest->bitmap = hbitmap_alloc_sparse(dest->size,
+                                            hbitmap_granularity(*backup));
         ret = hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         ret = hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
@@ -824,5 +861,5 @@ void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
     assert(ret);
 
 out:
-    qemu_mutex_unlock(dest->mutex);
+    bdrv_dirty_bitmap_unlock(dest);
 }
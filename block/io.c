@@ -584,6 +584,55 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+static int64_t bdrv_latency_start(BlockDriverState *bs)
+{
+    return atomic_read(&bs->latency) ? cpu_get_host_ticks() : 0;
+}
+
+static void bdrv_latency_done(BlockDriverState *bs, enum BlockAcctType type,
+                              int64_t start_ticks)
+{
+    BdrvLatency *latency = atomic_read(&bs->latency);
+    int64_t ticks;
+
+    if (!latency || !start_ticks) {
+        return;
+    }
+    ticks = cpu_get_host_ticks() - start_ticks;
+    block_latency_hdr_account(&latency->hdr[type], MAX(ticks, 0));
+}
+
+void bdrv_latency_enable(BlockDriverState *bs, bool enable)
+{
+    BdrvLatency *old = bs->latency;
+    BdrvLatency *latency = NULL;
+
+    if (enable) {
+        latency = g_new0(BdrvLatency, 1);
+        latency->start_ticks = cpu_get_host_ticks();
+        latency->start_ns = get_clock();
+    }
+
+    /* No request may see the histograms change between its start and its
+     * end */
+    bdrv_drained_begin(bs);
+    atomic_set(&bs->latency, latency);
+    bdrv_drained_end(bs);
+
+    g_free(old);
+}
+
+uint64_t bdrv_latency_ns(BdrvLatency *latency, uint64_t ticks)
+{
+    int64_t elapsed_ticks = cpu_get_host_ticks() - latency->start_ticks;
+    int64_t elapsed_ns = get_clock() - latency->start_ns;
+
+    if (elapsed_ticks <= 0 || elapsed_ns <= 0) {
+        return ticks;
+    }
+    return (double)ticks * elapsed_ns / elapsed_ticks;
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -595,6 +644,12 @@ static void tracked_request_end(BdrvTrackedRequest *req)
         atomic_dec(&req->bs->serialising_in_flight);
     }
 
+    if (req->type == BDRV_TRACKED_READ) {
+        bdrv_latency_done(req->bs, BLOCK_ACCT_READ, req->start_ticks);
+    } else if (req->type == BDRV_TRACKED_WRITE) {
+        bdrv_latency_done(req->bs, BLOCK_ACCT_WRITE, req->start_ticks);
+    }
+
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
@@ -621,6 +676,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
+        .start_ticks    = bdrv_latency_start(bs),
     };
 
     qemu_co_queue_init(&req->wait_queue);
@@ -2565,8 +2621,10 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
     int current_gen;
     int ret = 0;
+    int64_t start_ticks;
 
     bdrv_inc_in_flight(bs);
+    start_ticks = bdrv_latency_start(bs);
 
     if (!bdrv_is_inserted(bs) || bdrv_is_read_only(bs) ||
         bdrv_is_sg(bs)) {
@@ -2668,6 +2726,8 @@ out:
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 
+    bdrv_latency_done(bs, BLOCK_ACCT_FLUSH, start_ticks);
+
 early_exit:
     bdrv_dec_in_flight(bs);
     return ret;
@@ -3005,6 +3065,10 @@ static int coroutine_fn bdrv_co_copy_range_internal(
         return ret;
     }
     if (write_flags & BDRV_REQ_ZERO_WRITE) {
+        if (write_flags & BDRV_REQ_COPY_ON_READ) {
+            /* Let the caller copy-on-read, it checks the allocation status */
+            return -ENOTSUP;
+        }
         return bdrv_co_pwrite_zeroes(dst, dst_offset, bytes, write_flags);
     }
 
@@ -3042,11 +3106,33 @@ static int coroutine_fn bdrv_co_copy_range_internal(
         tracked_request_end(&req);
         bdrv_dec_in_flight(src->bs);
     } else {
+        bool copy_on_read = write_flags & BDRV_REQ_COPY_ON_READ;
+
+        /* The allocation status is only meaningful for the node the caller
+         * wants to populate, so do not pass the flag down */
+        if (copy_on_read) {
+            write_flags &= ~BDRV_REQ_COPY_ON_READ;
+            write_flags |= BDRV_REQ_SERIALISING;
+        }
+
         bdrv_inc_in_flight(dst->bs);
         tracked_request_begin(&req, dst->bs, dst_offset, bytes,
                               BDRV_TRACKED_WRITE);
         ret = bdrv_co_write_req_prepare(dst, dst_offset, bytes, &req,
                                         write_flags);
+        if (!ret && copy_on_read) {
+            int64_t pnum;
+
+            /* Overlapping writes have completed by now, and new ones wait
+             * for this request; do not overwrite what they wrote */
+            ret = bdrv_is_allocated(dst->bs, dst_offset, bytes, &pnum);
+            if (ret == 0 && pnum < bytes) {
+                ret = 1;
+            }
+            if (ret > 0) {
+                ret = -EAGAIN;
+            }
+        }
         if (!ret) {
             ret = dst->bs->drv->bdrv_co_copy_range_to(dst->bs,
                                                       src, src_offset,
@@ -0,0 +1,655 @@
+/*
+ * Linux io_uring support.
+ *
+ * Unlike Linux AIO, io_uring also handles buffered I/O, so it can be used
+ * without cache.direct=on.  Submissions and completions go through two
+ * rings shared with the kernel: a batch of requests costs a single
+ * io_uring_enter() and completions are reaped without any syscall at all.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+
+#include <liburing.h>
+
+/*
+ * Size of the submission queue.  The completion queue is twice as large,
+ * so in_flight may exceed MAX_ENTRIES by up to one full submission batch
+ * without the completion queue overflowing.
+ */
+#define MAX_ENTRIES 128
+
+/* Size of the registered file table */
+#define MAX_FIXED_FILES 64
+
+/* Maximum number of buffers registered with bdrv_register_buf() */
+#define MAX_FIXED_BUFFERS 16
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    uint64_t offset;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may complete short even before EOF; the rest of the
+     * request is then resubmitted using this shortened copy of qiov.
+     */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+
+    /*
+     * Failed requests whose sqe had already been published in the
+     * submission ring.  They are replaced by NOPs at the front of the ring,
+     * which are neither in_queue nor in_flight.
+     */
+    unsigned int ring_nops;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /* Registered files, indexed by their slot in the kernel's table */
+    int fixed_fds[MAX_FIXED_FILES];
+    bool files_registered;
+
+    /* Buffers passed to luring_register_buf() */
+    struct iovec bufs[MAX_FIXED_BUFFERS];
+    unsigned int nr_bufs;
+    bool bufs_registered;
+};
+
+static void ioq_submit(LuringState *s);
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Queue the unread part of a short read.  The request keeps its registered
+ * file, if any, but always goes back as a plain readv.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    uint8_t flags = luringcb->sqeq.flags;
+    int fd = luringcb->sqeq.fd;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    io_uring_prep_readv(&luringcb->sqeq, fd, resubmit_qiov->iov,
+                        resubmit_qiov->niov,
+                        luringcb->offset + luringcb->total_read);
+    luringcb->sqeq.flags = flags;
+    io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
+
+    luring_resubmit(s, luringcb);
+}
+
+/* Stores the result of a request and wakes up its coroutine */
+static void luring_complete(LuringAIOCB *luringcb, int ret)
+{
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+
+    luringcb->ret = ret;
+    /* If the coroutine is already entered it must be in ioq_submit() and
+     * will notice luringcb->ret has been filled in when it eventually runs
+     * later.  Coroutines cannot be entered recursively so avoid doing
+     * that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+/*
+ * Completes an I/O request and wakes up the coroutine that submitted it,
+ * unless the request has to be queued again.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb,
+                                      int ret)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+
+    if (ret == -EINTR || ret == -EAGAIN) {
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
+    if (ret >= 0 && qiov) {
+        if (luringcb->is_read) {
+            if (ret > 0 && luringcb->total_read + ret < qiov->size) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            }
+            if (ret == 0) {
+                /* EOF, pad with zeros */
+                qemu_iovec_memset(qiov, luringcb->total_read, 0,
+                                  qiov->size - luringcb->total_read);
+            }
+            ret = 0;
+        } else {
+            ret = (ret == qiov->size) ? 0 : -ENOSPC;
+        }
+    }
+
+    luring_complete(luringcb, ret);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests and invokes their callbacks.
+ *
+ * Like qemu_laio_process_completions(), this supports nested event loops:
+ * each completion is consumed from the ring before its coroutine runs, and
+ * the completion BH stays scheduled until the ring is empty so a nested
+ * aio_poll() can pick up where we left off.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* NOPs that replaced failed requests, see ioq_fail_head() */
+        if (!luringcb) {
+            continue;
+        }
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        luring_process_completion(s, luringcb, ret);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+
+    /* Requests that went back to the queue will not raise an event of their
+     * own, so make sure somebody submits them.
+     */
+    if (!s->io_q.plugged && !s->io_q.blocked && s->io_q.in_queue) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions_and_submit(s);
+    }
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+/*
+ * While the event loop busy-polls the completion queue there is no point
+ * in the kernel signalling the eventfd for every completion, so turn that
+ * off for the duration.
+ */
+static void qemu_luring_poll_begin(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    io_uring_cq_eventfd_toggle(&s->ring, false);
+}
+
+static void qemu_luring_poll_end(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    io_uring_cq_eventfd_toggle(&s->ring, true);
+
+    /* Completions that arrived while the eventfd was off did not signal it */
+    smp_mb();
+    if (io_uring_cq_ready(&s->ring)) {
+        event_notifier_set(&s->e);
+    }
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+    io_q->ring_nops = 0;
+}
+
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Turn a single-buffer readv/writev into the fixed variant if the buffer
+ * lies within a registered one, which saves the kernel from pinning the
+ * pages for every request.  This is done as the request is handed to the
+ * kernel, so the buffer index can never be stale.
+ */
+static void luring_use_fixed_buffer(LuringState *s, struct io_uring_sqe *sqe)
+{
+    struct iovec *iov;
+    uintptr_t start, end;
+    unsigned int i;
+
+    if (!s->bufs_registered || sqe->len != 1) {
+        return;
+    }
+    if (sqe->opcode != IORING_OP_READV && sqe->opcode != IORING_OP_WRITEV) {
+        return;
+    }
+
+    iov = (struct iovec *)(uintptr_t)sqe->addr;
+    start = (uintptr_t)iov->iov_base;
+    end = start + iov->iov_len;
+    for (i = 0; i < s->nr_bufs; i++) {
+        uintptr_t buf = (uintptr_t)s->bufs[i].iov_base;
+
+        if (start >= buf && end <= buf + s->bufs[i].iov_len) {
+            sqe->opcode = sqe->opcode == IORING_OP_READV ?
+                          IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = start;
+            sqe->len = iov->iov_len;
+            sqe->buf_index = i;
+            return;
+        }
+    }
+}
+
+/*
+ * Fails the oldest request that the kernel has not consumed yet.  Its sqe
+ * may already be published in the submission ring, where it cannot be taken
+ * back; it is turned into a NOP whose completion is ignored instead.
+ */
+static void ioq_fail_head(LuringState *s, int ret)
+{
+    struct io_uring_sq *sq = &s->ring.sq;
+    unsigned head = atomic_load_acquire(sq->khead);
+    LuringAIOCB *luringcb;
+
+    if (*sq->ktail - head > s->io_q.ring_nops) {
+        unsigned idx = sq->array[(head + s->io_q.ring_nops) & *sq->kring_mask];
+        struct io_uring_sqe *sqe = &sq->sqes[idx];
+
+        luringcb = (LuringAIOCB *)(uintptr_t)sqe->user_data;
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        s->io_q.ring_nops++;
+    } else {
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+    }
+    s->io_q.in_queue--;
+    luring_complete(luringcb, ret);
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    unsigned int nops;
+    int ret;
+
+    while (s->io_q.in_queue > 0 && s->io_q.in_flight < MAX_ENTRIES) {
+        /* Move as many queued requests as fit into the submission ring */
+        while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            luring_use_fixed_buffer(s, sqe);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == 0) {
+            ret = -EAGAIN;
+        }
+        if (ret < 0) {
+            /* Wait for completions to free up resources, if there are any */
+            if ((ret == -EAGAIN || ret == -EBUSY) && s->io_q.in_flight) {
+                break;
+            }
+            ioq_fail_head(s, ret);
+            continue;
+        }
+
+        /* The kernel consumes the ring in order, NOPs first */
+        nops = MIN(ret, s->io_q.ring_nops);
+        s->io_q.ring_nops -= nops;
+        ret -= nops;
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int fixed;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+
+    fixed = luring_fixed_file(s, fd);
+    if (fixed >= 0) {
+        sqes->fd = fixed;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+    luringcb->offset = offset;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+/*
+ * Add @fd to the registered file table so that requests on it skip the
+ * per-request file lookup in the kernel.  This is only an optimization;
+ * if the table is full or unsupported, requests use @fd directly.  The
+ * caller must call luring_unregister_fd() before closing @fd.
+ */
+void luring_register_fd(LuringState *s, int fd)
+{
+    int i, slot = -1;
+
+    if (!s->files_registered || luring_fixed_file(s, fd) >= 0) {
+        return;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == -1) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+    if (io_uring_register_files_update(&s->ring, slot, &fd, 1) == 1) {
+        s->fixed_fds[slot] = fd;
+    }
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int slot = luring_fixed_file(s, fd);
+    int unused = -1;
+
+    if (slot < 0) {
+        return;
+    }
+    io_uring_register_files_update(&s->ring, slot, &unused, 1);
+    s->fixed_fds[slot] = -1;
+}
+
+static void luring_update_buffers(LuringState *s)
+{
+    if (s->bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->bufs_registered = false;
+    }
+    if (s->nr_bufs) {
+        /* This fails if the buffers exceed RLIMIT_MEMLOCK, in which case
+         * the requests simply use readv/writev.
+         */
+        s->bufs_registered =
+            io_uring_register_buffers(&s->ring, s->bufs, s->nr_bufs) == 0;
+    }
+}
+
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    if (s->nr_bufs == MAX_FIXED_BUFFERS) {
+        return;
+    }
+    s->bufs[s->nr_bufs].iov_base = host;
+    s->bufs[s->nr_bufs].iov_len = size;
+    s->nr_bufs++;
+    luring_update_buffers(s);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_bufs; i++) {
+        if (s->bufs[i].iov_base == host) {
+            memmove(&s->bufs[i], &s->bufs[i + 1],
+                    (s->nr_bufs - i - 1) * sizeof(s->bufs[0]));
+            s->nr_bufs--;
+            luring_update_buffers(s);
+            return;
+        }
+    }
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           qemu_luring_completion_cb,
+                           qemu_luring_poll_cb);
+    aio_set_event_notifier_poll(new_context, &s->e,
+                                qemu_luring_poll_begin,
+                                qemu_luring_poll_end);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc, i;
+    LuringState *s;
+
+    s = g_malloc0(sizeof(*s));
+    rc = event_notifier_init(&s->e, false);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to to initialize event notifier");
+        goto out_free_state;
+    }
+
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to create linux io_uring ring");
+        goto out_close_efd;
+    }
+
+    rc = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to register io_uring eventfd");
+        goto out_queue_exit;
+    }
+
+    /* A sparse file table needs Linux 5.5; older kernels use plain fds */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    s->files_registered = io_uring_register_files(&s->ring, s->fixed_fds,
+                                                  MAX_FIXED_FILES) == 0;
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_queue_exit:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
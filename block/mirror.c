@@ -75,6 +75,9 @@ typedef struct MirrorBlockJob {
     QTAILQ_HEAD(MirrorOpList, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
+    /* Cleared when an offloaded copy fails; from then on, data is copied
+     * through s->buf */
+    bool use_copy_range;
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
@@ -314,7 +317,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     int nb_chunks;
-    uint64_t ret;
+    int ret;
     uint64_t max_bytes;
 
     max_bytes = s->granularity * s->max_iov;
@@ -337,6 +340,28 @@ static void coroutine_fn mirror_co_read(void *opaque)
     assert(QEMU_IS_ALIGNED(op->offset, s->granularity));
     /* The range is sector-aligned, since bdrv_getlength() rounds up. */
     assert(QEMU_IS_ALIGNED(op->bytes, BDRV_SECTOR_SIZE));
+
+    /* Let the drivers copy the data without a bounce buffer if they can,
+     * e.g. by sharing extents on a file system that supports reflinks */
+    if (s->use_copy_range) {
+        s->in_flight++;
+        s->bytes_in_flight += op->bytes;
+        trace_mirror_one_iteration(s, op->offset, op->bytes);
+
+        ret = bdrv_co_copy_range(s->mirror_top_bs->backing, op->offset,
+                                 blk_root(s->target), op->offset, op->bytes,
+                                 0, 0);
+        if (ret >= 0) {
+            mirror_write_complete(op, ret);
+            return;
+        }
+
+        trace_mirror_copy_range_fail(s, op->offset, ret);
+        s->use_copy_range = false;
+        s->in_flight--;
+        s->bytes_in_flight -= op->bytes;
+    }
+
     nb_chunks = DIV_ROUND_UP(op->bytes, s->granularity);
 
     while (s->buf_free_count < nb_chunks) {
@@ -1600,6 +1625,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -34,14 +34,18 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
 
-static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
+static coroutine_fn int nbd_co_receive_read_chunk_inline(
+        NBDClientConnection *conn, NBDClientRequest *req, Error **errp);
+
+static void nbd_recv_coroutines_wake_all(NBDClientConnection *conn)
 {
+    NBDClientSession *s = conn->session;
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         NBDClientRequest *req = &s->requests[i];
 
-        if (req->coroutine && req->receiving) {
+        if (req->coroutine && req->receiving && req->conn == conn) {
             aio_co_wake(req->coroutine);
         }
     }
@@ -50,34 +54,47 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
 static void nbd_teardown_connection(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
 
-    if (!client->ioc) { /* Already closed */
+    if (!client->num_conns) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
-                         QIO_CHANNEL_SHUTDOWN_BOTH,
-                         NULL);
-    BDRV_POLL_WHILE(bs, client->read_reply_co);
+    for (i = 0; i < client->num_conns; i++) {
+        qio_channel_shutdown(client->conns[i].ioc,
+                             QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
+    }
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *conn = &client->conns[i];
+
+        BDRV_POLL_WHILE(bs, conn->read_reply_co);
+    }
 
     nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *conn = &client->conns[i];
+
+        object_unref(OBJECT(conn->sioc));
+        conn->sioc = NULL;
+        object_unref(OBJECT(conn->ioc));
+        conn->ioc = NULL;
+    }
+    client->num_conns = 0;
 }
 
 static coroutine_fn void nbd_read_reply_entry(void *opaque)
 {
-    NBDClientSession *s = opaque;
+    NBDClientConnection *conn = opaque;
+    NBDClientSession *s = conn->session;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
 
-    while (!s->quit) {
-        assert(s->reply.handle == 0);
-        ret = nbd_receive_reply(s->ioc, &s->reply, &local_err);
+    while (!conn->quit) {
+        assert(conn->reply.handle == 0);
+        ret = nbd_receive_reply(conn->ioc, &conn->reply, &local_err);
         if (local_err) {
             error_report_err(local_err);
         }
@@ -89,15 +106,29 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
          * handler acts as a synchronization point and ensures that only
          * one coroutine is called until the reply finishes.
          */
-        i = HANDLE_TO_INDEX(s, s->reply.handle);
-        if (i >= MAX_NBD_REQUESTS ||
+        i = HANDLE_TO_INDEX(s, conn->reply.handle);
+        if (i >= s->max_requests ||
             !s->requests[i].coroutine ||
             !s->requests[i].receiving ||
-            (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
+            s->requests[i].conn != conn ||
+            (nbd_reply_is_structured(&conn->reply) &&
+             !s->info.structured_reply))
         {
             break;
         }
 
+        /* Data and holes of a sparse read are usually sent as several
+         * chunks; consume them here instead of switching to the request
+         * coroutine and back for each of them. */
+        ret = nbd_co_receive_read_chunk_inline(conn, &s->requests[i],
+                                               &local_err);
+        if (ret < 0) {
+            error_report_err(local_err);
+            break;
+        } else if (ret > 0) {
+            continue;
+        }
+
         /* We're woken up again by the request itself.  Note that there
          * is no race between yielding and reentering read_reply_co.  This
          * is because:
@@ -113,72 +144,120 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
         qemu_coroutine_yield();
     }
 
-    s->quit = true;
-    nbd_recv_coroutines_wake_all(s);
-    s->read_reply_co = NULL;
+    conn->quit = true;
+    nbd_recv_coroutines_wake_all(conn);
+    conn->read_reply_co = NULL;
 }
 
+/* Pick the connection with the fewest requests in flight, or NULL if all
+ * connections are dead */
+static NBDClientConnection *nbd_pick_connection(NBDClientSession *s)
+{
+    NBDClientConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NBDClientConnection *conn = &s->conns[i];
+
+        if (!conn->quit && (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
+    }
+
+    return best;
+}
+
+static void nbd_put_request_slot(NBDClientSession *s, int i)
+{
+    qemu_co_mutex_lock(&s->requests_mutex);
+    if (s->requests[i].conn) {
+        s->requests[i].conn->in_flight--;
+    }
+    s->requests[i].coroutine = NULL;
+    s->requests[i].conn = NULL;
+    s->requests[i].qiov = NULL;
+    s->free_requests[s->nb_free_requests++] = i;
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_sema);
+    qemu_co_mutex_unlock(&s->requests_mutex);
+}
+
+/*
+ * Sends @request on one of the connections.  @qiov is the payload of a
+ * write request, or the buffer that read_reply_co receives read data into.
+ */
 static int nbd_co_send_request(BlockDriverState *bs,
                                NBDRequest *request,
-                               QEMUIOVector *qiov)
+                               QEMUIOVector *qiov,
+                               NBDClientConnection **pconn)
 {
     NBDClientSession *s = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
     int rc, i;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS) {
-        qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
+    qemu_co_mutex_lock(&s->requests_mutex);
+    while (s->in_flight >= s->queue_depth * MAX(s->num_conns, 1)) {
+        qemu_co_queue_wait(&s->free_sema, &s->requests_mutex);
     }
     s->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
-            break;
-        }
-    }
-
     g_assert(qemu_in_coroutine());
-    assert(i < MAX_NBD_REQUESTS);
+    assert(s->nb_free_requests > 0);
+    i = s->free_requests[--s->nb_free_requests];
+    assert(s->requests[i].coroutine == NULL);
+
+    conn = nbd_pick_connection(s);
+    if (conn) {
+        conn->in_flight++;
+    }
 
     s->requests[i].coroutine = qemu_coroutine_self();
     s->requests[i].offset = request->from;
     s->requests[i].receiving = false;
+    s->requests[i].conn = conn;
+    s->requests[i].qiov = request->type == NBD_CMD_READ ? qiov : NULL;
+    qemu_co_mutex_unlock(&s->requests_mutex);
 
     request->handle = INDEX_TO_HANDLE(s, i);
 
-    if (s->quit) {
-        rc = -EIO;
+    if (!s->num_conns) {
+        rc = -EPIPE;
         goto err;
     }
-    if (!s->ioc) {
-        rc = -EPIPE;
+    if (!conn) {
+        rc = -EIO;
         goto err;
     }
 
-    if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
-        if (rc >= 0 && !s->quit) {
-            if (qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+    qemu_co_mutex_lock(&conn->send_mutex);
+    if (conn->quit) {
+        rc = -EIO;
+    } else if (request->type == NBD_CMD_WRITE) {
+        qio_channel_set_cork(conn->ioc, true);
+        rc = nbd_send_request(conn->ioc, request);
+        if (rc >= 0 && !conn->quit) {
+            if (qio_channel_writev_all(conn->ioc, qiov->iov, qiov->niov,
                                        NULL) < 0) {
                 rc = -EIO;
             }
         } else if (rc >= 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(conn->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(conn->ioc, request);
     }
+    if (rc < 0) {
+        conn->quit = true;
+    }
+    qemu_co_mutex_unlock(&conn->send_mutex);
 
 err:
     if (rc < 0) {
-        s->quit = true;
-        s->requests[i].coroutine = NULL;
-        s->in_flight--;
-        qemu_co_queue_next(&s->free_sema);
+        nbd_put_request_slot(s, i);
+        return rc;
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    *pconn = conn;
     return rc;
 }
 
@@ -315,7 +394,7 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
+static int nbd_co_receive_offset_data_payload(NBDClientConnection *conn,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
@@ -323,9 +402,9 @@ static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &conn->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -334,7 +413,7 @@ static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
         return -EINVAL;
     }
 
-    if (nbd_read(s->ioc, &offset, sizeof(offset), errp) < 0) {
+    if (nbd_read(conn->ioc, &offset, sizeof(offset), errp) < 0) {
         return -EIO;
     }
     be64_to_cpus(&offset);
@@ -350,7 +429,7 @@ static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(conn->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -360,14 +439,14 @@ static int nbd_co_receive_offset_data_payload(NBDClientSession *s,
 /* nbd_co_receive_structured_payload
  */
 static coroutine_fn int nbd_co_receive_structured_payload(
-        NBDClientSession *s, void **payload, Error **errp)
+        NBDClientConnection *conn, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&conn->reply));
 
-    len = s->reply.structured.length;
+    len = conn->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -384,7 +463,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, errp);
+    ret = nbd_read(conn->ioc, *payload, len, errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -394,6 +473,50 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     return 0;
 }
 
+/* nbd_co_receive_read_chunk_inline
+ * Receive a chunk of a structured read reply in read_reply_co itself.  Only
+ * data and hole chunks that are not the last one of their reply are handled
+ * this way; anything else still wakes up the request coroutine.
+ * Returns 1 if the chunk was consumed, 0 if it must be passed to the
+ * request, and -errno if the connection has to be dropped.
+ */
+static coroutine_fn int nbd_co_receive_read_chunk_inline(
+        NBDClientConnection *conn, NBDClientRequest *req, Error **errp)
+{
+    NBDStructuredReplyChunk *chunk = &conn->reply.structured;
+    void *payload = NULL;
+    int ret;
+
+    if (!req->qiov || !nbd_reply_is_structured(&conn->reply) ||
+        (chunk->flags & NBD_REPLY_FLAG_DONE)) {
+        return 0;
+    }
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        ret = nbd_co_receive_offset_data_payload(conn, req->offset, req->qiov,
+                                                 errp);
+        break;
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        ret = nbd_co_receive_structured_payload(conn, &payload, errp);
+        if (ret == 0) {
+            ret = nbd_parse_offset_hole_payload(chunk, payload, req->offset,
+                                                req->qiov, errp);
+        }
+        g_free(payload);
+        break;
+    default:
+        return 0;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    conn->reply.handle = 0;
+    return 1;
+}
+
 /* nbd_co_do_receive_one_chunk
  * for simple reply:
  *   set request_ret to received reply error
@@ -409,10 +532,11 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        NBDClientSession *s, uint64_t handle, bool only_structured,
+        NBDClientConnection *conn, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
     int ret;
+    NBDClientSession *s = conn->session;
     int i = HANDLE_TO_INDEX(s, handle);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
@@ -426,32 +550,32 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     s->requests[i].receiving = true;
     qemu_coroutine_yield();
     s->requests[i].receiving = false;
-    if (!s->ioc || s->quit) {
+    if (!conn->ioc || conn->quit) {
         error_setg(errp, "Connection closed");
         return -EIO;
     }
 
-    assert(s->reply.handle == handle);
+    assert(conn->reply.handle == handle);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&conn->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(conn->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(conn->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
     assert(s->info.structured_reply);
-    chunk = &s->reply.structured;
+    chunk = &conn->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -473,7 +597,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(conn, s->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -481,7 +605,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(conn, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -496,30 +620,30 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
 }
 
 /* nbd_co_receive_one_chunk
- * Read reply, wake up read_reply_co and set s->quit if needed.
+ * Read reply, wake up read_reply_co and set conn->quit if needed.
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        NBDClientSession *s, uint64_t handle, bool only_structured,
+        NBDClientConnection *conn, uint64_t handle, bool only_structured,
         QEMUIOVector *qiov, NBDReply *reply, void **payload, Error **errp)
 {
     int request_ret;
-    int ret = nbd_co_do_receive_one_chunk(s, handle, only_structured,
+    int ret = nbd_co_do_receive_one_chunk(conn, handle, only_structured,
                                           &request_ret, qiov, payload, errp);
 
     if (ret < 0) {
-        s->quit = true;
+        conn->quit = true;
     } else {
         /* For assert at loop start in nbd_read_reply_entry */
         if (reply) {
-            *reply = s->reply;
+            *reply = conn->reply;
         }
-        s->reply.handle = 0;
+        conn->reply.handle = 0;
         ret = request_ret;
     }
 
-    if (s->read_reply_co) {
-        aio_co_wake(s->read_reply_co);
+    if (conn->read_reply_co) {
+        aio_co_wake(conn->read_reply_co);
     }
 
     return ret;
@@ -554,14 +678,15 @@ static void nbd_iter_error(NBDReplyChunkIter *iter, bool fatal,
 
 /* NBD_FOREACH_REPLY_CHUNK
  */
-#define NBD_FOREACH_REPLY_CHUNK(s, iter, handle, structured, \
+#define NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, structured, \
                                 qiov, reply, payload) \
     for (iter = (NBDReplyChunkIter) { .only_structured = structured }; \
-         nbd_reply_chunk_iter_receive(s, &iter, handle, qiov, reply, payload);)
+         nbd_reply_chunk_iter_receive(conn, &iter, handle, qiov, reply, \
+                                      payload);)
 
 /* nbd_reply_chunk_iter_receive
  */
-static bool nbd_reply_chunk_iter_receive(NBDClientSession *s,
+static bool nbd_reply_chunk_iter_receive(NBDClientConnection *conn,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
@@ -571,7 +696,7 @@ static bool nbd_reply_chunk_iter_receive(NBDClientSession *s,
     NBDReply local_reply;
     NBDStructuredReplyChunk *chunk;
     Error *local_err = NULL;
-    if (s->quit) {
+    if (conn->quit) {
         error_setg(&local_err, "Connection closed");
         nbd_iter_error(iter, true, -EIO, &local_err);
         goto break_loop;
@@ -586,15 +711,15 @@ static bool nbd_reply_chunk_iter_receive(NBDClientSession *s,
         reply = &local_reply;
     }
 
-    ret = nbd_co_receive_one_chunk(s, handle, iter->only_structured,
+    ret = nbd_co_receive_one_chunk(conn, handle, iter->only_structured,
                                    qiov, reply, payload, &local_err);
     if (ret < 0) {
-        /* If it is a fatal error s->quit is set by nbd_co_receive_one_chunk */
-        nbd_iter_error(iter, s->quit, ret, &local_err);
+        /* If it is a fatal error, nbd_co_receive_one_chunk sets conn->quit */
+        nbd_iter_error(iter, conn->quit, ret, &local_err);
     }
 
     /* Do not execute the body of NBD_FOREACH_REPLY_CHUNK for simple reply. */
-    if (nbd_reply_is_simple(&s->reply) || s->quit) {
+    if (nbd_reply_is_simple(&conn->reply) || conn->quit) {
         goto break_loop;
     }
 
@@ -616,22 +741,18 @@ static bool nbd_reply_chunk_iter_receive(NBDClientSession *s,
     return true;
 
 break_loop:
-    s->requests[HANDLE_TO_INDEX(s, handle)].coroutine = NULL;
-
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->in_flight--;
-    qemu_co_queue_next(&s->free_sema);
-    qemu_co_mutex_unlock(&s->send_mutex);
+    nbd_put_request_slot(conn->session,
+                         HANDLE_TO_INDEX(conn->session, handle));
 
     return false;
 }
 
-static int nbd_co_receive_return_code(NBDClientSession *s, uint64_t handle,
-                                      Error **errp)
+static int nbd_co_receive_return_code(NBDClientConnection *conn,
+                                      uint64_t handle, Error **errp)
 {
     NBDReplyChunkIter iter;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, NULL, NULL) {
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, false, NULL, NULL, NULL) {
         /* nbd_reply_chunk_iter_receive does all the work */
     }
 
@@ -639,16 +760,17 @@ static int nbd_co_receive_return_code(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
-                                        uint64_t offset, QEMUIOVector *qiov,
-                                        Error **errp)
+static int nbd_co_receive_cmdread_reply(NBDClientConnection *conn,
+                                        uint64_t handle, uint64_t offset,
+                                        QEMUIOVector *qiov, Error **errp)
 {
+    NBDClientSession *s = conn->session;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
     Error *local_err = NULL;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, s->info.structured_reply,
                             qiov, &reply, &payload)
     {
         int ret;
@@ -665,14 +787,14 @@ static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
             ret = nbd_parse_offset_hole_payload(&reply.structured, payload,
                                                 offset, qiov, &local_err);
             if (ret < 0) {
-                s->quit = true;
+                conn->quit = true;
                 nbd_iter_error(&iter, true, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
                 /* not allowed reply type */
-                s->quit = true;
+                conn->quit = true;
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) for CMD_READ",
                            chunk->type, nbd_reply_type_lookup(chunk->type));
@@ -688,10 +810,11 @@ static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
+static int nbd_co_receive_blockstatus_reply(NBDClientConnection *conn,
                                             uint64_t handle, uint64_t length,
                                             NBDExtent *extent, Error **errp)
 {
+    NBDClientSession *s = conn->session;
     NBDReplyChunkIter iter;
     NBDReply reply;
     void *payload = NULL;
@@ -699,7 +822,7 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
     bool received = false;
 
     assert(!extent->length);
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(conn, iter, handle, s->info.structured_reply,
                             NULL, &reply, &payload)
     {
         int ret;
@@ -710,7 +833,7 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
         switch (chunk->type) {
         case NBD_REPLY_TYPE_BLOCK_STATUS:
             if (received) {
-                s->quit = true;
+                conn->quit = true;
                 error_setg(&local_err, "Several BLOCK_STATUS chunks in reply");
                 nbd_iter_error(&iter, true, -EINVAL, &local_err);
             }
@@ -720,13 +843,13 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
                                                 payload, length, extent,
                                                 &local_err);
             if (ret < 0) {
-                s->quit = true;
+                conn->quit = true;
                 nbd_iter_error(&iter, true, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
-                s->quit = true;
+                conn->quit = true;
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) "
                            "for CMD_BLOCK_STATUS",
@@ -755,7 +878,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -764,12 +887,12 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(bs, request, write_qiov, &conn);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_return_code(client, request->handle, &local_err);
+    ret = nbd_co_receive_return_code(conn, request->handle, &local_err);
     if (local_err) {
         error_report_err(local_err);
     }
@@ -781,25 +904,25 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
 
-    assert(bytes <= NBD_MAX_BUFFER_SIZE);
+    assert(bytes <= bs->bl.max_transfer);
     assert(!flags);
 
     if (!bytes) {
         return 0;
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(bs, &request, qiov, &conn);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_cmdread_reply(client, request.handle, offset, qiov,
+    ret = nbd_co_receive_cmdread_reply(conn, request.handle, offset, qiov,
                                        &local_err);
     if (local_err) {
         error_report_err(local_err);
@@ -823,7 +946,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         request.flags |= NBD_CMD_FLAG_FUA;
     }
 
-    assert(bytes <= NBD_MAX_BUFFER_SIZE);
+    assert(bytes <= bs->bl.max_transfer);
 
     if (!bytes) {
         return 0;
@@ -901,6 +1024,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
     int64_t ret;
     NBDExtent extent = { 0 };
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -917,12 +1041,12 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(bs, &request, NULL, &conn);
     if (ret < 0) {
         return ret;
     }
 
-    ret = nbd_co_receive_blockstatus_reply(client, request.handle, bytes,
+    ret = nbd_co_receive_blockstatus_reply(conn, request.handle, bytes,
                                            &extent, &local_err);
     if (local_err) {
         error_report_err(local_err);
@@ -937,32 +1061,99 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
            (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
 }
 
+static void nbd_connection_detach_aio_context(NBDClientConnection *conn)
+{
+    qio_channel_detach_aio_context(QIO_CHANNEL(conn->ioc));
+}
+
+static void nbd_connection_attach_aio_context(NBDClientConnection *conn,
+                                              AioContext *new_context)
+{
+    qio_channel_attach_aio_context(QIO_CHANNEL(conn->ioc), new_context);
+    if (conn->read_reply_co) {
+        aio_co_schedule(new_context, conn->read_reply_co);
+    }
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        nbd_connection_detach_aio_context(&client->conns[i]);
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
-    aio_co_schedule(new_context, client->read_reply_co);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        nbd_connection_attach_aio_context(&client->conns[i], new_context);
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
+    if (!client->num_conns) {
         return;
     }
 
-    nbd_send_request(client->ioc, &request);
+    for (i = 0; i < client->num_conns; i++) {
+        nbd_send_request(client->conns[i].ioc, &request);
+    }
 
     nbd_teardown_connection(bs);
+
+    g_free(client->requests);
+    client->requests = NULL;
+    g_free(client->free_requests);
+    client->free_requests = NULL;
+    client->max_requests = 0;
+}
+
+/* Start using a negotiated connection.  @ioc is the TLS channel on top of
+ * @sioc, if any; its reference is passed to @conn. */
+static void nbd_connection_start(BlockDriverState *bs,
+                                 NBDClientConnection *conn,
+                                 QIOChannelSocket *sioc, QIOChannel *ioc)
+{
+    conn->session = nbd_get_client_session(bs);
+    qemu_co_mutex_init(&conn->send_mutex);
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
+
+    if (ioc) {
+        conn->ioc = ioc;
+    } else {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
+    }
+
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+    conn->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, conn);
+    nbd_connection_attach_aio_context(conn, bdrv_get_aio_context(bs));
+}
+
+/* We have connected, but must fail for other reasons. The connection is
+ * still blocking; send NBD_CMD_DISC as a courtesy to the server. */
+static void nbd_connection_abort(QIOChannelSocket *sioc, QIOChannel *ioc)
+{
+    NBDRequest request = { .type = NBD_CMD_DISC };
+
+    nbd_send_request(ioc ?: QIO_CHANNEL(sioc), &request);
+    if (ioc) {
+        object_unref(OBJECT(ioc));
+    }
 }
 
 int nbd_client_init(BlockDriverState *bs,
@@ -971,10 +1162,13 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     const char *x_dirty_bitmap,
+                    int queue_depth,
+                    int max_connections,
                     Error **errp)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    int ret;
+    QIOChannel *ioc = NULL;
+    int i, ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
@@ -986,7 +1180,7 @@ int nbd_client_init(BlockDriverState *bs,
     client->info.x_dirty_bitmap = g_strdup(x_dirty_bitmap);
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 tlscreds, hostname,
-                                &client->ioc, &client->info, errp);
+                                &ioc, &client->info, errp);
     g_free(client->info.x_dirty_bitmap);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -1012,35 +1206,81 @@ int nbd_client_init(BlockDriverState *bs,
         bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
-
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    /* The table has room for all connections that may be added later */
+    client->queue_depth = queue_depth;
+    client->max_requests = queue_depth * max_connections;
+    client->requests = g_new0(NBDClientRequest, client->max_requests);
+    client->free_requests = g_new(int, client->max_requests);
+    for (i = 0; i < client->max_requests; i++) {
+        client->free_requests[i] = client->max_requests - 1 - i;
     }
+    client->nb_free_requests = client->max_requests;
 
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
-    client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    qemu_co_mutex_init(&client->requests_mutex);
+    qemu_co_queue_init(&client->free_sema);
+    client->num_conns = 1;
+    nbd_connection_start(bs, &client->conns[0], sioc, ioc);
 
     logout("Established connection with NBD server\n");
     return 0;
 
  fail:
-    /*
-     * We have connected, but must fail for other reasons. The
-     * connection is still blocking; send NBD_CMD_DISC as a courtesy
-     * to the server.
-     */
-    {
-        NBDRequest request = { .type = NBD_CMD_DISC };
+    nbd_connection_abort(sioc, ioc);
+    return ret;
+}
 
-        nbd_send_request(client->ioc ?: QIO_CHANNEL(sioc), &request);
+/* Open one more connection to the export.  Only valid if the server
+ * advertised NBD_FLAG_CAN_MULTI_CONN on the first one. */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              const char *x_dirty_bitmap,
+                              Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    QIOChannel *ioc = NULL;
+    NBDExportInfo info = {
+        .request_sizes = true,
+        .structured_reply = true,
+        .base_allocation = true,
+    };
+    int ret;
+
+    assert(client->info.flags & NBD_FLAG_CAN_MULTI_CONN);
+    assert(client->num_conns > 0 && client->num_conns < MAX_NBD_CONNECTIONS);
+    assert(client->queue_depth * (client->num_conns + 1) <=
+           client->max_requests);
+
+    logout("adding connection %d\n", client->num_conns);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    info.x_dirty_bitmap = g_strdup(x_dirty_bitmap);
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
+                                tlscreds, hostname,
+                                &ioc, &info, errp);
+    g_free(info.x_dirty_bitmap);
+    if (ret < 0) {
         return ret;
     }
+
+    /* Requests may be sent on any connection, so they must all agree */
+    if (info.size != client->info.size ||
+        info.flags != client->info.flags ||
+        info.structured_reply != client->info.structured_reply ||
+        info.base_allocation != client->info.base_allocation ||
+        (info.base_allocation &&
+         info.meta_base_allocation_id !=
+         client->info.meta_base_allocation_id)) {
+        error_setg(errp, "NBD server changed the export parameters on "
+                   "connection %d", client->num_conns + 1);
+        nbd_connection_abort(sioc, ioc);
+        return -EINVAL;
+    }
+
+    nbd_connection_start(bs, &client->conns[client->num_conns], sioc, ioc);
+    client->num_conns++;
+
+    return 0;
 }
@@ -15,28 +15,51 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
+#define NBD_DEFAULT_QUEUE_DEPTH 16    /* requests in flight per connection */
+#define NBD_MAX_QUEUE_DEPTH     1024
+#define MAX_NBD_CONNECTIONS     16
+
+typedef struct NBDClientSession NBDClientSession;
+typedef struct NBDClientConnection NBDClientConnection;
 
 typedef struct {
     Coroutine *coroutine;
     uint64_t offset;        /* original offset of the request */
     bool receiving;         /* waiting for read_reply_co? */
+    NBDClientConnection *conn; /* connection the request was sent on */
+    QEMUIOVector *qiov;     /* buffer for data received by read_reply_co */
 } NBDClientRequest;
 
-typedef struct NBDClientSession {
+struct NBDClientConnection {
+    NBDClientSession *session;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    NBDExportInfo info;
 
     CoMutex send_mutex;
-    CoQueue free_sema;
     Coroutine *read_reply_co;
     int in_flight;
 
-    NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
     bool quit;
-} NBDClientSession;
+};
+
+struct NBDClientSession {
+    NBDExportInfo info;
+
+    /* All connections share one request table, so that a handle identifies
+     * a request independently of the connection it was sent on */
+    CoMutex requests_mutex;
+    CoQueue free_sema;
+    int in_flight;
+    int queue_depth;        /* per connection */
+    int max_requests;
+    NBDClientRequest *requests;
+    int *free_requests;     /* stack of unused indexes into @requests */
+    int nb_free_requests;
+
+    int num_conns;
+    NBDClientConnection conns[MAX_NBD_CONNECTIONS];
+};
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
 
@@ -46,7 +69,16 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     const char *x_dirty_bitmap,
+                    int queue_depth,
+                    int max_connections,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              const char *x_dirty_bitmap,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes);
@@ -40,6 +40,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #define EN_OPTSTR ":exportname="
 
@@ -384,10 +385,56 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "more than one (default 1)",
+        },
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight on each "
+                    "connection (default 16)",
+        },
         { /* end of list */ }
     },
 };
 
+/* Open the connections beyond the first one that the "connections" option
+ * asks for */
+static int nbd_add_connections(BlockDriverState *bs, int connections,
+                               QCryptoTLSCreds *tlscreds,
+                               const char *hostname,
+                               const char *x_dirty_bitmap, Error **errp)
+{
+    BDRVNBDState *s = bs->opaque;
+    QIOChannelSocket *sioc;
+    int ret;
+
+    if (!(s->client.info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        warn_report("NBD server does not allow multiple connections to the "
+                    "export, using only one");
+        return 0;
+    }
+
+    while (s->client.num_conns < connections) {
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            return -ECONNREFUSED;
+        }
+
+        ret = nbd_client_add_connection(bs, sioc, s->export, tlscreds,
+                                        hostname, x_dirty_bitmap, errp);
+        object_unref(OBJECT(sioc));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -397,6 +444,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QIOChannelSocket *sioc = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    int64_t connections, queue_depth;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -419,6 +467,21 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->export = g_strdup(qemu_opt_get(opts, "export"));
 
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
+    queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                      NBD_DEFAULT_QUEUE_DEPTH);
+    if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   NBD_MAX_QUEUE_DEPTH);
+        goto error;
+    }
+
     s->tlscredsid = g_strdup(qemu_opt_get(opts, "tls-creds"));
     if (s->tlscredsid) {
         tlscreds = nbd_get_tls_creds(s->tlscredsid, errp);
@@ -445,7 +508,15 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export, tlscreds, hostname,
-                          qemu_opt_get(opts, "x-dirty-bitmap"), errp);
+                          qemu_opt_get(opts, "x-dirty-bitmap"), queue_depth,
+                          connections, errp);
+    if (ret == 0 && connections > 1) {
+        ret = nbd_add_connections(bs, connections, tlscreds, hostname,
+                                  qemu_opt_get(opts, "x-dirty-bitmap"), errp);
+        if (ret < 0) {
+            nbd_client_close(bs);
+        }
+    }
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -471,7 +542,13 @@ static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     NBDClientSession *s = nbd_get_client_session(bs);
     uint32_t min = s->info.min_block;
-    uint32_t max = MIN_NON_ZERO(NBD_MAX_BUFFER_SIZE, s->info.max_block);
+    uint32_t max = NBD_MAX_BUFFER_SIZE;
+
+    /* Requests larger than 32 MiB are only allowed if the server advertised
+     * a maximum block size during negotiation */
+    if (s->info.max_block) {
+        max = MIN(s->info.max_block, NBD_MAX_CLIENT_BLOCK_SIZE);
+    }
 
     bs->bl.request_alignment = min ? min : BDRV_SECTOR_SIZE;
     bs->bl.max_pdiscard = max;
@@ -425,6 +425,35 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static BlockLatencyPercentiles *bdrv_latency_percentiles(BdrvLatency *latency,
+                                                         BlockLatencyHdr *hdr)
+{
+    BlockLatencyPercentiles *p = g_new0(BlockLatencyPercentiles, 1);
+
+    p->count = stat64_get(&hdr->count);
+    p->p50_ns = bdrv_latency_ns(latency,
+                                block_latency_hdr_percentile(hdr, 500));
+    p->p99_ns = bdrv_latency_ns(latency,
+                                block_latency_hdr_percentile(hdr, 990));
+    p->p999_ns = bdrv_latency_ns(latency,
+                                 block_latency_hdr_percentile(hdr, 999));
+    p->max_ns = bdrv_latency_ns(latency, stat64_get(&hdr->max));
+    return p;
+}
+
+static BlockNodeLatency *bdrv_query_latency(BdrvLatency *latency)
+{
+    BlockNodeLatency *info = g_new0(BlockNodeLatency, 1);
+
+    info->rd = bdrv_latency_percentiles(latency,
+                                        &latency->hdr[BLOCK_ACCT_READ]);
+    info->wr = bdrv_latency_percentiles(latency,
+                                        &latency->hdr[BLOCK_ACCT_WRITE]);
+    info->flush = bdrv_latency_percentiles(latency,
+                                           &latency->hdr[BLOCK_ACCT_FLUSH]);
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -529,6 +558,16 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    if (s->driver_specific) {
+        s->has_driver_specific = true;
+    }
+
+    if (bs->latency) {
+        s->has_x_latency = true;
+        s->x_latency = bdrv_query_latency(bs->latency);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -33,6 +33,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     prefetched;    /* inserted by readahead, not used yet */
+    int      hash_next;     /* next entry in the same hash bucket, or -1 */
+    int      lru_prev;      /* neighbours in the LRU list, or -1 */
+    int      lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +48,21 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Incremented whenever a table is written back or dropped, so that
+     * tables read from disk without a cache reference can be validated,
+     * see qcow2_cache_insert() */
+    uint64_t                gen;
+
+    /* Chained hash index of the entries that hold a table (offset != 0) */
+    int                    *hash_buckets;
+    int                     hash_bits;
+
+    /* All entries with ref == 0, least recently used first.  Unused
+     * entries (offset == 0) are kept at the head so that they are
+     * recycled before any cached table is evicted. */
+    int                     lru_head;
+    int                     lru_tail;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +78,129 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t table = offset / c->table_size;
+
+    /* Fibonacci hashing, so that consecutive tables spread out */
+    return (table * 0x9e3779b97f4a7c15ULL) >> (64 - c->hash_bits);
+}
+
+/* Return the index of the entry caching the table at @offset, or -1 */
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->hash_buckets[qcow2_cache_hash(c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = &c->hash_buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->hash_buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static void qcow2_cache_lru_remove(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->lru_prev >= 0) {
+        c->entries[t->lru_prev].lru_next = t->lru_next;
+    } else {
+        c->lru_head = t->lru_next;
+    }
+    if (t->lru_next >= 0) {
+        c->entries[t->lru_next].lru_prev = t->lru_prev;
+    } else {
+        c->lru_tail = t->lru_prev;
+    }
+    t->lru_prev = t->lru_next = -1;
+}
+
+static void qcow2_cache_lru_add_tail(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    t->lru_prev = c->lru_tail;
+    t->lru_next = -1;
+    if (c->lru_tail >= 0) {
+        c->entries[c->lru_tail].lru_next = i;
+    } else {
+        c->lru_head = i;
+    }
+    c->lru_tail = i;
+}
+
+static void qcow2_cache_lru_add_head(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    t->lru_prev = -1;
+    t->lru_next = c->lru_head;
+    if (c->lru_head >= 0) {
+        c->entries[c->lru_head].lru_prev = i;
+    } else {
+        c->lru_tail = i;
+    }
+    c->lru_head = i;
+}
+
+/*
+ * Drop the table held by unreferenced entry @i, making the entry the
+ * first one to be reused.
+ */
+static void qcow2_cache_entry_free(Qcow2Cache *c, int i)
+{
+    assert(c->entries[i].ref == 0);
+
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    c->entries[i].offset = 0;
+    c->entries[i].lru_counter = 0;
+    c->entries[i].prefetched = false;
+
+    qcow2_cache_lru_remove(c, i);
+    qcow2_cache_lru_add_head(c, i);
+}
+
+/* Mark all entries unused and rebuild the index and LRU list */
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->hash_buckets[i] = -1;
+    }
+
+    c->lru_head = c->lru_tail = -1;
+    c->gen++;
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].lru_counter = 0;
+        c->entries[i].prefetched = false;
+        c->entries[i].hash_next = -1;
+        qcow2_cache_lru_add_tail(c, i);
+    }
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -106,8 +248,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_free(c, i);
             i++;
             to_clean++;
         }
@@ -134,17 +275,21 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->hash_bits = MAX(ctz64(pow2ceil(num_tables)), 1);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->hash_buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash_buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(c);
     return c;
 }
 
@@ -157,6 +302,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash_buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -224,6 +370,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
+    c->gen++;
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
                       qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
@@ -307,10 +454,9 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
     }
 
+    qcow2_cache_reset(c);
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
@@ -324,9 +470,6 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -341,29 +484,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    if (c->lru_head == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = c->lru_head;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -374,10 +507,11 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_free(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+            s->l2_cache_misses++;
         }
 
         ret = bdrv_pread(bs->file, offset,
@@ -389,10 +523,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].prefetched) {
+        c->entries[i].prefetched = false;
+        if (c == s->l2_table_cache) {
+            s->l2_readahead_hits++;
+        }
+    }
+    if (c->entries[i].ref++ == 0) {
+        qcow2_cache_lru_remove(c, i);
+    }
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -413,6 +556,57 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Return the current generation of @c.  A table that is read from disk
+ * while the generation does not change cannot have been modified in the
+ * meantime, unless it is cached.
+ */
+uint64_t qcow2_cache_gen(Qcow2Cache *c)
+{
+    return c->gen;
+}
+
+/*
+ * Insert the table at @offset, which the caller has read from disk into
+ * @table at generation @gen, without taking a reference to it.
+ *
+ * Only a clean, unreferenced entry is replaced.  Returns -EBUSY if there is
+ * no such entry, and -ESTALE if the table may have changed since it was
+ * read.  If the table is already cached, nothing happens.
+ */
+int qcow2_cache_insert(Qcow2Cache *c, uint64_t offset, const void *table,
+                       uint64_t gen)
+{
+    int i;
+
+    assert(offset != 0 && QEMU_IS_ALIGNED(offset, c->table_size));
+
+    if (qcow2_cache_lookup(c, offset) >= 0) {
+        return 0;
+    }
+    if (gen != c->gen) {
+        return -ESTALE;
+    }
+
+    i = c->lru_head;
+    if (i < 0 || c->entries[i].dirty) {
+        return -EBUSY;
+    }
+
+    qcow2_cache_entry_free(c, i);
+    memcpy(qcow2_cache_get_table_addr(c, i), table, c->table_size);
+    c->entries[i].offset = offset;
+    c->entries[i].prefetched = true;
+    qcow2_cache_hash_insert(c, i);
+
+    /* Keep it until a request had a chance to use it */
+    c->entries[i].lru_counter = ++c->lru_counter;
+    qcow2_cache_lru_remove(c, i);
+    qcow2_cache_lru_add_tail(c, i);
+
+    return 0;
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -422,6 +616,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        qcow2_cache_lru_add_tail(c, i);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -436,25 +631,18 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_free(c, i);
     c->entries[i].dirty = false;
+    c->gen++;
 
     qcow2_cache_table_release(c, i, 1);
 }
@@ -26,6 +26,10 @@
 
 #define ZLIB_CONST
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
 
 #include "block/block_int.h"
 #include "block/qdict.h"
@@ -459,6 +463,56 @@ static void report_unsupported_feature(Error **errp, Qcow2Feature *table,
     g_free(features);
 }
 
+static int validate_compression_type(BDRVQcow2State *s, Error **errp)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        break;
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#ifndef CONFIG_ZSTD
+        error_setg(errp, "qcow2: This build of QEMU does not support zstd "
+                   "compression");
+        return -ENOTSUP;
+#endif
+        break;
+    default:
+        error_setg(errp, "qcow2: Unknown compression type %u",
+                   s->compression_type);
+        return -ENOTSUP;
+    }
+
+    /* Any compression type other than zlib must be flagged as incompatible,
+     * so that older versions refuse to open the image */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) {
+            error_setg(errp, "qcow2: Compression type incompatible feature "
+                       "bit must not be set for zlib");
+            return -EINVAL;
+        }
+    } else if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+        error_setg(errp, "qcow2: Compression type incompatible feature bit "
+                   "must be set for %s",
+                   Qcow2CompressionType_str(s->compression_type));
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the length of the fixed part of a version 3 header.  zlib images
+ * do not need the compression_type field, so they keep the 104 byte header
+ * that older versions wrote unless unknown fields follow it.
+ */
+static size_t qcow2_header_length(BDRVQcow2State *s)
+{
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        return offsetof(QCowHeader, compression_type);
+    }
+    return sizeof(QCowHeader);
+}
+
 /*
  * Sets the dirty bit and flushes afterwards if necessary.
  *
@@ -712,6 +766,23 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_RESERVE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Host space reserved at once for each sequential "
+                    "allocating writer (0 = disabled)",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESS_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of clusters compressed in parallel",
+        },
+        {
+            .name = QCOW2_OPT_L2_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of L2 cache entries read ahead of sequential "
+                    "requests (0 = disabled)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -783,7 +854,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     bool l2_cache_size_set, refcount_cache_size_set, combined_cache_size_set;
     int min_refcount_cache = MIN_REFCOUNT_CACHE_SIZE * s->cluster_size;
     uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
-    uint64_t max_l2_cache = virtual_disk_size / (s->cluster_size / 8);
+    uint64_t max_l2_cache = virtual_disk_size /
+                            (s->cluster_size / l2_entry_size(s));
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
@@ -855,6 +927,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_reserve_clusters;
+    uint64_t compress_threads;
+    uint64_t l2_readahead;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -914,6 +989,9 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Return reserved clusters while their refcounts can still be flushed */
+    qcow2_release_alloc_streams(bs);
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -932,7 +1010,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -961,6 +1039,30 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Host cluster reservations for sequential writers */
+    r->alloc_reserve_clusters =
+        qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_RESERVE_SIZE, 0) /
+        s->cluster_size;
+    if (r->alloc_reserve_clusters > INT_MAX / s->cluster_size) {
+        error_setg(errp, "Allocation reserve size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->compress_threads =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESS_THREADS,
+                            DEFAULT_COMPRESS_THREADS);
+    if (r->compress_threads < 1 || r->compress_threads > INT_MAX) {
+        error_setg(errp, QCOW2_OPT_COMPRESS_THREADS
+                   " must be between 1 and %d", INT_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Leave at least half of the L2 cache to the tables in use */
+    r->l2_readahead = qemu_opt_get_number(opts, QCOW2_OPT_L2_READAHEAD, 0);
+    r->l2_readahead = MIN(r->l2_readahead, l2_cache_size / 2);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1111,6 +1213,13 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->alloc_reserve_clusters = r->alloc_reserve_clusters;
+    s->compress_threads = r->compress_threads;
+
+    s->l2_readahead = r->l2_readahead;
+    s->l2_readahead_seq = 0;
+    s->l2_readahead_next = 0;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1230,6 +1339,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
     if (header.header_length > sizeof(header)) {
         s->unknown_header_fields_size = header.header_length - sizeof(header);
         s->unknown_header_fields = g_malloc(s->unknown_header_fields_size);
@@ -1271,6 +1386,18 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    ret = validate_compression_type(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (has_subclusters(s) && s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Unsupported cluster size for extended L2 entries: "
+                   "2^%d", s->cluster_bits);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     if (s->incompatible_features & QCOW2_INCOMPAT_CORRUPT) {
         /* Corrupt images may not be written to unless they are being repaired
          */
@@ -1322,7 +1449,13 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1414,7 +1547,6 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    s->cluster_cache_offset = -1;
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -1424,6 +1556,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_prefetches);
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
@@ -1599,6 +1732,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->compress_wait_queue);
+    QTAILQ_INIT(&s->compressed_writes);
+    qemu_co_queue_init(&s->compressed_writes_queue);
 
     return ret;
 
@@ -1679,7 +1814,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
@@ -1804,16 +1939,18 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
 
     *pnum = bytes;
 
-    if (cluster_offset != 0 && ret != QCOW2_CLUSTER_COMPRESSED &&
-        !s->crypto) {
+    if ((ret == QCOW2_SUBCLUSTER_NORMAL ||
+         ret == QCOW2_SUBCLUSTER_ZERO_ALLOC) && !s->crypto) {
         index_in_cluster = offset & (s->cluster_size - 1);
         *map = cluster_offset | index_in_cluster;
         *file = bs->file->bs;
         status |= BDRV_BLOCK_OFFSET_VALID;
     }
-    if (ret == QCOW2_CLUSTER_ZERO_PLAIN || ret == QCOW2_CLUSTER_ZERO_ALLOC) {
+    if (ret == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+        ret == QCOW2_SUBCLUSTER_ZERO_ALLOC) {
         status |= BDRV_BLOCK_ZERO;
-    } else if (ret != QCOW2_CLUSTER_UNALLOCATED) {
+    } else if (ret != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+               ret != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
         status |= BDRV_BLOCK_DATA;
     }
     return status;
@@ -1854,6 +1991,76 @@ out:
     return ret;
 }
 
+/*
+ * Drop all decompressed clusters.  Called whenever the image is written to,
+ * because a write may free a compressed cluster and reuse its host offset.
+ * Bumping the generation makes reads that are still decompressing drop
+ * their result instead of adding it to the cache.
+ */
+static void qcow2_decompress_cache_invalidate(BDRVQcow2State *s)
+{
+    int i;
+
+    s->decompress_cache_gen++;
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        qemu_vfree(s->decompress_cache[i].data);
+        s->decompress_cache[i].data = NULL;
+        s->decompress_cache[i].coffset = 0;
+    }
+}
+
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_lookup(BDRVQcow2State *s, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        Qcow2DecompressedCluster *c = &s->decompress_cache[i];
+        if (c->coffset == coffset) {
+            c->lru_counter = ++s->decompress_cache_lru;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a decompressed cluster to the cache, taking ownership of @data.  The
+ * least recently used entry is evicted if the cache is full.
+ */
+static void qcow2_decompress_cache_insert(BDRVQcow2State *s, uint64_t coffset,
+                                          uint8_t *data)
+{
+    Qcow2DecompressedCluster *victim = &s->decompress_cache[0];
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        Qcow2DecompressedCluster *c = &s->decompress_cache[i];
+        if (c->coffset == coffset) {
+            /* Another request decompressed the same cluster meanwhile */
+            qemu_vfree(data);
+            c->lru_counter = ++s->decompress_cache_lru;
+            return;
+        }
+        if (victim->data &&
+            (!c->data || c->lru_counter < victim->lru_counter)) {
+            victim = c;
+        }
+    }
+
+    qemu_vfree(victim->data);
+    victim->coffset = coffset;
+    victim->data = data;
+    victim->lru_counter = ++s->decompress_cache_lru;
+}
+
+static coroutine_fn int
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t file_cluster_offset,
+                           uint64_t offset_in_cluster,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov);
+
 static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                                         uint64_t bytes, QEMUIOVector *qiov,
                                         int flags)
@@ -1891,7 +2098,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
 
         switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
 
             if (bs->backing) {
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
@@ -1908,24 +2116,23 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             }
             break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
             qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+        case QCOW2_SUBCLUSTER_COMPRESSED:
+            qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_co_preadv_compressed(bs, cluster_offset,
+                                             offset_in_cluster, cur_bytes,
+                                             &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
             break;
 
-        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_SUBCLUSTER_NORMAL:
             if ((cluster_offset & 511) != 0) {
                 ret = -EIO;
                 goto fail;
@@ -2058,7 +2265,7 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    qcow2_decompress_cache_invalidate(s);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -2178,6 +2385,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_alloc_streams(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2223,8 +2432,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompress_cache_invalidate(s);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2323,7 +2531,7 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    header_length = qcow2_header_length(s) + s->unknown_header_fields_size;
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -2349,6 +2557,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -2357,7 +2566,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = qcow2_header_length(s);
         break;
     default:
         ret = -EINVAL;
@@ -2412,7 +2621,7 @@ int qcow2_update_header(BlockDriverState *bs)
 
     /* Feature table */
     if (s->qcow_version >= 3) {
-        Qcow2Feature features[] = {
+        Qcow2Feature features[5] = {
             {
                 .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
                 .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
@@ -2429,9 +2638,30 @@ int qcow2_update_header(BlockDriverState *bs)
                 .name = "lazy refcounts",
             },
         };
+        size_t nb_features = 3;
+
+        /* Only name the compression type and extended L2 bits if they are
+         * used, so that other images keep the feature table older versions
+         * wrote */
+        if (s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) {
+            features[nb_features++] = (Qcow2Feature) {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            };
+        }
+        if (has_subclusters(s)) {
+            features[nb_features++] = (Qcow2Feature) {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            };
+        }
+        assert(nb_features <= ARRAY_SIZE(features));
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
-                             features, sizeof(features), buflen);
+                             features, nb_features * sizeof(features[0]),
+                             buflen);
         if (ret < 0) {
             goto fail;
         }
@@ -2609,6 +2839,7 @@ static int coroutine_fn preallocate_co(BlockDriverState *bs, uint64_t offset,
 
         while (meta) {
             QCowL2Meta *next = meta->next;
+            meta->prealloc = true;
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
@@ -2708,22 +2939,24 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -2918,6 +3151,46 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (!qcow2_opts->has_compression_type) {
+        qcow2_opts->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (version < 3) {
+            error_setg(errp, "Non-zlib compression type is only supported "
+                       "with compatibility level 1.1 and above (use "
+                       "version=v3 or greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+#ifndef CONFIG_ZSTD
+        if (qcow2_opts->compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+            error_setg(errp, "This build of QEMU does not support zstd "
+                       "compression");
+            ret = -ENOTSUP;
+            goto out;
+        }
+#endif
+    }
+
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
 
     /* Create BlockBackend to write to the image */
     blk = blk_new(BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL);
@@ -2938,7 +3211,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     {
         int64_t prealloc_size =
             qcow2_calc_prealloc_size(qcow2_opts->size, cluster_size,
-                                     refcount_order);
+                                     refcount_order, qcow2_opts->extended_l2);
 
         ret = blk_truncate(blk, prealloc_size, qcow2_opts->preallocation, errp);
         if (ret < 0) {
@@ -2960,6 +3233,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = qcow2_opts->compression_type,
     };
 
     /* We'll update this to correct value later */
@@ -2969,6 +3243,17 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->compatible_features |=
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    } else {
+        header->header_length =
+            cpu_to_be32(offsetof(QCowHeader, compression_type));
+    }
 
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
@@ -3147,6 +3432,8 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_CLUSTER_SIZE,       "cluster-size" },
         { BLOCK_OPT_LAZY_REFCOUNTS,     "lazy-refcounts" },
         { BLOCK_OPT_REFCOUNT_BITS,      "refcount-bits" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { NULL, NULL },
@@ -3232,8 +3519,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    uint32_t head = offset_into_subcluster(s, offset);
+    uint32_t tail = offset_into_subcluster(s, offset + bytes);
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3244,24 +3531,25 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         uint64_t off;
         unsigned int nr;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of subcluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
+        offset = QEMU_ALIGN_DOWN(offset, s->subcluster_size);
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED &&
-            ret != QCOW2_CLUSTER_ZERO_PLAIN &&
-            ret != QCOW2_CLUSTER_ZERO_ALLOC) {
+        if (ret != QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN &&
+            ret != QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC &&
+            ret != QCOW2_SUBCLUSTER_ZERO_PLAIN &&
+            ret != QCOW2_SUBCLUSTER_ZERO_ALLOC) {
             qemu_co_mutex_unlock(&s->lock);
             return -ENOTSUP;
         }
@@ -3301,6 +3589,42 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Compressed clusters cannot be shared with the destination, so inflate the
+ * data and write it like a normal request would.
+ */
+static int coroutine_fn
+qcow2_co_copy_compressed(BlockDriverState *bs, uint64_t cluster_descriptor,
+                         uint64_t offset_in_cluster, BdrvChild *dst,
+                         uint64_t dst_offset, uint64_t bytes,
+                         BdrvRequestFlags write_flags)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    /* The caller must check the allocation status in @dst first */
+    if (write_flags & BDRV_REQ_COPY_ON_READ) {
+        return -ENOTSUP;
+    }
+
+    iov.iov_len = bytes;
+    iov.iov_base = qemu_try_blockalign(bs, bytes);
+    if (!iov.iov_base) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = qcow2_co_preadv_compressed(bs, cluster_descriptor,
+                                     offset_in_cluster, bytes, &qiov);
+    if (ret >= 0) {
+        ret = bdrv_co_pwritev(dst, dst_offset, bytes, &qiov, write_flags);
+    }
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
 static int coroutine_fn
 qcow2_co_copy_range_from(BlockDriverState *bs,
                          BdrvChild *src, uint64_t src_offset,
@@ -3319,6 +3643,7 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
 
     while (bytes != 0) {
         uint64_t copy_offset = 0;
+        bool compressed = false;
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
         cur_write_flags = write_flags;
@@ -3329,7 +3654,8 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
         }
 
         switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
             if (bs->backing && bs->backing->bs) {
                 int64_t backing_length = bdrv_getlength(bs->backing->bs);
                 if (src_offset >= backing_length) {
@@ -3344,16 +3670,16 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
             }
             break;
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
             cur_write_flags |= BDRV_REQ_ZERO_WRITE;
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
-            ret = -ENOTSUP;
-            goto out;
+        case QCOW2_SUBCLUSTER_COMPRESSED:
+            compressed = true;
+            break;
 
-        case QCOW2_CLUSTER_NORMAL:
+        case QCOW2_SUBCLUSTER_NORMAL:
             child = bs->file;
             copy_offset += offset_into_cluster(s, src_offset);
             if ((copy_offset & 511) != 0) {
@@ -3366,10 +3692,18 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
             abort();
         }
         qemu_co_mutex_unlock(&s->lock);
-        ret = bdrv_co_copy_range_from(child,
-                                      copy_offset,
-                                      dst, dst_offset,
-                                      cur_bytes, read_flags, cur_write_flags);
+        if (compressed) {
+            ret = qcow2_co_copy_compressed(bs, copy_offset,
+                                           offset_into_cluster(s, src_offset),
+                                           dst, dst_offset, cur_bytes,
+                                           cur_write_flags);
+        } else {
+            ret = bdrv_co_copy_range_from(child,
+                                          copy_offset,
+                                          dst, dst_offset,
+                                          cur_bytes, read_flags,
+                                          cur_write_flags);
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -3401,7 +3735,7 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
     QCowL2Meta *l2meta = NULL;
 
     assert(!bs->encrypted);
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    qcow2_decompress_cache_invalidate(s);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -3485,6 +3819,10 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /* Reserved clusters would keep the image file from shrinking, and they
+     * are useless after the resize anyway */
+    qcow2_release_alloc_streams(bs);
+
     /* cannot proceed if image has snapshots */
     if (s->nb_snapshots) {
         error_setg(errp, "Can't resize an image which has snapshots");
@@ -3610,7 +3948,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -3720,16 +4058,17 @@ fail:
 }
 
 /*
- * qcow2_compress()
+ * qcow2_zlib_compress()
  *
- * @dest - destination buffer, at least of @size-1 bytes
- * @src - source buffer, @size bytes
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
  *
  * Returns: compressed size on success
- *          -1 if compression is inefficient
+ *          -1 destination buffer is not enough to store compressed data
  *          -2 on any other error
  */
-static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
 {
     ssize_t ret;
     z_stream strm;
@@ -3744,14 +4083,14 @@ static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
 
     /* strm.next_in is not const in old zlib versions, such as those used on
      * OpenBSD/NetBSD, so cast the const away */
-    strm.avail_in = size;
+    strm.avail_in = src_size;
     strm.next_in = (void *) src;
-    strm.avail_out = size - 1;
+    strm.avail_out = dest_size;
     strm.next_out = dest;
 
     ret = deflate(&strm, Z_FINISH);
     if (ret == Z_STREAM_END) {
-        ret = size - 1 - strm.avail_out;
+        ret = dest_size - strm.avail_out;
     } else {
         ret = (ret == Z_OK ? -1 : -2);
     }
@@ -3761,20 +4100,134 @@ static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
     return ret;
 }
 
-#define MAX_COMPRESS_THREADS 4
+/*
+ * qcow2_zlib_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes.
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -1 on fail
+ */
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    int ret = 0;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -1;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled,
+         * but @src buffer may be processed partly (because in qcow2 we know
+         * size of compressed data with precision of one sector) */
+        ret = -1;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * qcow2_zstd_compress()
+ *
+ * Compress @src into a single zstd frame.  See qcow2_zlib_compress() for
+ * the parameters and return value.
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ? -1 : -2;
+    }
+
+    return ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Decompress the zstd frame at the start of @src.  The compressed data is
+ * followed by the unused tail of its last sector, so decoding stops at the
+ * end of the frame rather than at the end of @src.  See
+ * qcow2_zlib_decompress() for the parameters and return value.
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_DCtx *dctx;
+    size_t zstd_ret;
+    int ret = 0;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -1;
+    }
+
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret) || zstd_ret == 0) {
+            break;
+        }
+        if (input.pos == last_in_pos && output.pos == last_out_pos) {
+            /* No progress: the frame is truncated */
+            break;
+        }
+    }
+
+    if (output.pos != output.size) {
+        ret = -1;
+    }
+
+    ZSTD_freeDCtx(dctx);
 
+    return ret;
+}
+#endif
+
+typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size);
 typedef struct Qcow2CompressData {
     void *dest;
+    size_t dest_size;
     const void *src;
-    size_t size;
+    size_t src_size;
     ssize_t ret;
+
+    Qcow2CompressFunc func;
 } Qcow2CompressData;
 
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
-    data->ret = qcow2_compress(data->dest, data->src, data->size);
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
 
     return 0;
 }
@@ -3784,20 +4237,22 @@ static void qcow2_compress_complete(void *opaque, int ret)
     qemu_coroutine_enter(opaque);
 }
 
-/* See qcow2_compress definition for parameters description */
-static ssize_t qcow2_co_compress(BlockDriverState *bs,
-                                 void *dest, const void *src, size_t size)
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc func)
 {
     BDRVQcow2State *s = bs->opaque;
     BlockAIOCB *acb;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
     Qcow2CompressData arg = {
         .dest = dest,
+        .dest_size = dest_size,
         .src = src,
-        .size = size,
+        .src_size = src_size,
+        .func = func,
     };
 
-    while (s->nb_compress_threads >= MAX_COMPRESS_THREADS) {
+    while (s->nb_compress_threads >= s->compress_threads) {
         qemu_co_queue_wait(&s->compress_wait_queue, NULL);
     }
 
@@ -3817,6 +4272,147 @@ static ssize_t qcow2_co_compress(BlockDriverState *bs,
     return arg.ret;
 }
 
+/*
+ * Compress with the image's compression type.  See qcow2_zlib_compress()
+ * for parameters description.
+ */
+static ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+/*
+ * Decompress with the image's compression type.  See
+ * qcow2_zlib_decompress() for parameters description.
+ */
+static ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+/*
+ * Read @bytes at @offset_in_cluster of the compressed cluster described by
+ * @file_cluster_offset into @qiov.
+ *
+ * Called without s->lock: the compressed data is read and inflated in the
+ * thread pool while other requests make progress.  Up to
+ * QCOW2_DECOMPRESS_CACHE_SIZE decompressed clusters are kept so that
+ * sequential reads smaller than a cluster inflate each cluster only once.
+ */
+static coroutine_fn int
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t file_cluster_offset,
+                           uint64_t offset_in_cluster,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *c;
+    int ret = 0, csize, nb_csectors;
+    uint64_t coffset;
+    unsigned gen;
+    uint8_t *buf, *out_buf;
+    struct iovec iov;
+    QEMUIOVector local_qiov;
+
+    coffset = file_cluster_offset & s->cluster_offset_mask;
+
+    c = qcow2_decompress_cache_lookup(s, coffset);
+    if (c) {
+        qemu_iovec_from_buf(qiov, 0, c->data + offset_in_cluster, bytes);
+        return 0;
+    }
+
+    nb_csectors = ((file_cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * 512 - (coffset & 511);
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = csize;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    out_buf = qemu_try_blockalign(bs, s->cluster_size);
+    if (!out_buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    gen = s->decompress_cache_gen;
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+    if (gen == s->decompress_cache_gen) {
+        qcow2_decompress_cache_insert(s, coffset, out_buf);
+        out_buf = NULL;
+    }
+
+fail:
+    qemu_vfree(out_buf);
+    g_free(buf);
+
+    return ret;
+}
+
+/* Lets the next compressed write allocate its space; idempotent */
+static void qcow2_compressed_write_done(BDRVQcow2State *s,
+                                        Qcow2CompressedWrite *cw)
+{
+    if (QTAILQ_IN_USE(cw, next)) {
+        QTAILQ_REMOVE(&s->compressed_writes, cw, next);
+        qemu_co_queue_restart_all(&s->compressed_writes_queue);
+    }
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -3824,6 +4420,7 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
                             uint64_t bytes, QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWrite cw = {};
     QEMUIOVector hd_qiov;
     struct iovec iov;
     int ret;
@@ -3859,14 +4456,29 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     }
     qemu_iovec_to_buf(qiov, 0, buf, bytes);
 
+    /* Take our place in the allocation order before the first yield */
+    QTAILQ_INSERT_TAIL(&s->compressed_writes, &cw, next);
+
+    qcow2_decompress_cache_invalidate(s);
+
     out_buf = g_malloc(s->cluster_size);
 
-    out_len = qcow2_co_compress(bs, out_buf, buf, s->cluster_size);
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+
+    /* Compression may complete out of order, but sequential writers should
+     * still get a sequential image file */
+    while (QTAILQ_FIRST(&s->compressed_writes) != &cw) {
+        qemu_co_queue_wait(&s->compressed_writes_queue, NULL);
+    }
+
     if (out_len == -2) {
         ret = -EINVAL;
         goto fail;
     } else if (out_len == -1) {
-        /* could not compress: write normal cluster */
+        /* could not compress: write normal cluster; it doesn't allocate
+         * from the compressed write position, so don't hold up the others */
+        qcow2_compressed_write_done(s, &cw);
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
         if (ret < 0) {
             goto fail;
@@ -3890,6 +4502,8 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         goto fail;
     }
 
+    qcow2_compressed_write_done(s, &cw);
+
     iov = (struct iovec) {
         .iov_base   = out_buf,
         .iov_len    = out_len,
@@ -3904,6 +4518,7 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 success:
     ret = 0;
 fail:
+    qcow2_compressed_write_done(s, &cw);
     qemu_vfree(buf);
     g_free(out_buf);
     return ret;
@@ -4127,6 +4742,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     char *optstr;
     PreallocMode prealloc;
     bool has_backing_file;
+    bool extended_l2;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4156,12 +4772,15 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     has_backing_file = !!optstr;
     g_free(optstr);
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+
     virtual_size = qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0);
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
     /* Check that virtual disk size is valid */
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / (extended_l2 ? L2E_SIZE_EXTENDED
+                                                         : L2E_SIZE_NORMAL));
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4226,7 +4845,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits));
+                                 ctz32(refcount_bits), extended_l2);
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4244,11 +4863,28 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcow2State *s = bs->opaque;
     bdi->unallocated_blocks_are_zero = true;
+    bdi->ordered_compressed_writes = true;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2 = (BlockStatsSpecificQcow2) {
+        .l2_cache_misses        = s->l2_cache_misses,
+        .l2_readahead           = s->l2_readahead_issued,
+        .l2_readahead_hits      = s->l2_readahead_hits,
+        .l2_readahead_dropped   = s->l2_readahead_dropped,
+    };
+
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -4309,6 +4945,16 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
         spec_info->u.qcow2.data->encrypt = qencrypt;
     }
 
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        spec_info->u.qcow2.data->has_compression_type = true;
+        spec_info->u.qcow2.data->compression_type = s->compression_type;
+    }
+
+    if (has_subclusters(s)) {
+        spec_info->u.qcow2.data->has_extended_l2 = true;
+        spec_info->u.qcow2.data->extended_l2 = true;
+    }
+
     return spec_info;
 }
 
@@ -4368,6 +5014,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
      * the first place; if that happens nonetheless, returning -ENOTSUP is the
      * best thing to do anyway */
 
+    if (has_subclusters(s)) {
+        error_setg(errp, "Cannot downgrade an image with extended L2 entries");
+        return -ENOTSUP;
+    }
+
     if (s->incompatible_features) {
         error_setg(errp, "Cannot downgrade an image with incompatible features "
                    "%#" PRIx64 " set", s->incompatible_features);
@@ -4558,6 +5209,25 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                            "may not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *compression_type =
+                qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+            if (compression_type &&
+                strcmp(compression_type,
+                       Qcow2CompressionType_str(s->compression_type))) {
+                error_setg(errp, "Changing the compression type is not "
+                           "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            bool extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                                 has_subclusters(s));
+            if (extended_l2 != has_subclusters(s)) {
+                error_setg(errp, "Changing the extended L2 entries flag is "
+                           "not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -4770,6 +5440,11 @@ static QemuOptsList qcow2_create_opts = {
         BLOCK_CRYPTO_OPT_DEF_LUKS_IVGEN_HASH_ALG("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_HASH_ALG("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_ITER_TIME("encrypt."),
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables",
+        },
         {
             .name = BLOCK_OPT_CLUSTER_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -4794,6 +5469,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression "
+                    "(allowed values: zlib, zstd; default: zlib)",
+        },
         { /* end of list */ }
     }
 };
@@ -4834,6 +5515,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -493,6 +493,18 @@ static int raw_probe_geometry(BlockDriverState *bs, HDGeometry *geo)
     return bdrv_probe_geometry(bs->file->bs, geo);
 }
 
+static int raw_get_data_fd(BlockDriverState *bs, uint64_t *offset,
+                           uint64_t bytes)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_get_data_fd(bs->file->bs, offset, bytes);
+}
+
 static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
                                                BdrvChild *src,
                                                uint64_t src_offset,
@@ -556,6 +568,7 @@ BlockDriver bdrv_raw = {
     .bdrv_refresh_limits  = &raw_refresh_limits,
     .bdrv_probe_blocksizes = &raw_probe_blocksizes,
     .bdrv_probe_geometry  = &raw_probe_geometry,
+    .bdrv_get_data_fd     = &raw_get_data_fd,
     .bdrv_eject           = &raw_eject,
     .bdrv_lock_medium     = &raw_lock_medium,
     .bdrv_co_ioctl        = &raw_co_ioctl,
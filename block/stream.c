@@ -35,6 +35,10 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     int bs_flags;
+    /* Cleared when an offloaded copy fails for another reason than a
+     * concurrent write */
+    bool use_copy_range;
+    int64_t cluster_size;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockBackend *blk,
@@ -54,6 +58,36 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, qiov.size, &qiov, BDRV_REQ_COPY_ON_READ);
 }
 
+/* Like stream_populate(), but let the drivers copy the data without a
+ * bounce buffer if they can, e.g. by sharing extents on a file system that
+ * supports reflinks.  Return -ENOTSUP if the caller should copy-on-read.
+ */
+static int coroutine_fn stream_copy_range(StreamBlockJob *s,
+                                          int64_t offset, uint64_t bytes)
+{
+    BlockBackend *blk = s->common.blk;
+    BlockDriverState *bs = blk_bs(blk);
+    int ret;
+
+    /* Requests that copy-on-read must be aligned to the cluster size */
+    if (!s->use_copy_range || !QEMU_IS_ALIGNED(offset, s->cluster_size) ||
+        !QEMU_IS_ALIGNED(bytes, s->cluster_size)) {
+        return -ENOTSUP;
+    }
+
+    ret = bdrv_co_copy_range(bs->backing, offset, blk_root(blk), offset,
+                             bytes, 0,
+                             BDRV_REQ_COPY_ON_READ | BDRV_REQ_WRITE_UNCHANGED);
+    if (ret < 0) {
+        trace_stream_copy_range_fail(s, offset, ret);
+        if (ret != -EAGAIN) {
+            s->use_copy_range = false;
+        }
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -111,6 +145,7 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     int ret = 0;
     int64_t n = 0; /* bytes */
     void *buf;
+    BlockDriverInfo bdi;
 
     if (!bs->backing) {
         goto out;
@@ -125,6 +160,14 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
 
     buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
+    /* This is the alignment the block layer serialises copy-on-read with */
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        s->cluster_size = bs->bl.request_alignment;
+    } else {
+        s->cluster_size = bdi.cluster_size;
+    }
+    s->use_copy_range = true;
+
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
      * backing chain since the copy-on-read operation does not take base into
@@ -165,7 +208,10 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         }
         trace_stream_one_iteration(s, offset, n, ret);
         if (copy) {
-            ret = stream_populate(blk, offset, n, buf);
+            ret = stream_copy_range(s, offset, n);
+            if (ret == -ENOTSUP) {
+                ret = stream_populate(blk, offset, n, buf);
+            }
         }
         if (ret < 0) {
             BlockErrorAction action =
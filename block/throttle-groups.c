@@ -61,6 +61,13 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Taking the lock for every request does not scale to large groups spread
+ * across iothreads, so while no request of the group is throttled the
+ * members get credit: operations and bytes that are accounted in the
+ * ThrottleState in advance, and that they use without taking the lock.
+ * The credit is taken back as soon as a request has to wait, and from then
+ * on every request goes through the round-robin scheduler again.
  */
 typedef struct ThrottleGroup {
     Object parent_obj;
@@ -69,13 +76,20 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
+    unsigned nr_members;
+    unsigned pending_reqs[2]; /* sum of the members' pending_reqs */
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    bool credit_granted;
     QEMUClockType clock_type;
 
+    /* Largest request that counts as one operation and can therefore use
+     * credit.  Accessed with atomic operations.  */
+    unsigned int credit_max_bytes;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
@@ -253,6 +267,127 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/* Give back the credit of a ThrottleGroupMember.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_refund_credit(ThrottleGroupMember *tgm,
+                                         bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    unsigned int ops = atomic_xchg(&tgm->credit_ops[is_write], 0);
+    unsigned int bytes = atomic_xchg(&tgm->credit_bytes[is_write], 0);
+
+    throttle_account_batch(ts, is_write, ops, bytes, true);
+}
+
+/* Give back the credit of all members, because a request is about to be
+ * throttled.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_revoke_credit(ThrottleGroup *tg)
+{
+    ThrottleGroupMember *tgm;
+
+    if (!tg->credit_granted) {
+        return;
+    }
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        throttle_group_refund_credit(tgm, false);
+        throttle_group_refund_credit(tgm, true);
+    }
+    tg->credit_granted = false;
+}
+
+/* Give a ThrottleGroupMember credit for its next requests, unless requests
+ * of this type are throttled.  Each member gets a share of what the group
+ * can do before it reaches its limits, so that one member cannot starve the
+ * others.
+ *
+ * This assumes that tg->lock is held, and that the buckets have leaked
+ * recently.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_credit(ThrottleGroupMember *tgm,
+                                        bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint64_t ops, bytes;
+    unsigned share = 2 * tg->nr_members;
+
+    if (tg->any_timer_armed[is_write] || tg->pending_reqs[is_write] ||
+        atomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    /* Start again from what the whole group has left */
+    throttle_group_refund_credit(tgm, is_write);
+    throttle_headroom(ts, is_write, &ops, &bytes);
+    ops = MIN(ops / share, UINT_MAX / 2);
+    bytes = MIN(bytes / share, UINT_MAX / 2);
+
+    /* Close to the limits, let the scheduler decide for every request */
+    if (!ops || !bytes) {
+        return;
+    }
+
+    throttle_account_batch(ts, is_write, ops, bytes, false);
+    atomic_add(&tgm->credit_bytes[is_write], bytes);
+    atomic_add(&tgm->credit_ops[is_write], ops);
+    tg->credit_granted = true;
+}
+
+static bool throttle_group_take(unsigned int *credit, unsigned int n)
+{
+    unsigned int old = atomic_read(credit), prev;
+
+    do {
+        if (old < n) {
+            return false;
+        }
+        prev = old;
+        old = atomic_cmpxchg(credit, prev, prev - n);
+    } while (old != prev);
+
+    return true;
+}
+
+/* Use the credit of a ThrottleGroupMember for a request. Return whether
+ * there was enough credit; if not, the request must go through
+ * the scheduler.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static bool throttle_group_take_credit(ThrottleGroupMember *tgm,
+                                       unsigned int bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    if (bytes > atomic_read(&tg->credit_max_bytes)) {
+        return false;
+    }
+    if (!throttle_group_take(&tgm->credit_ops[is_write], 1)) {
+        return false;
+    }
+    if (!throttle_group_take(&tgm->credit_bytes[is_write], bytes)) {
+        /* The operation stays accounted; it is given back with the rest */
+        atomic_inc(&tgm->credit_ops[is_write]);
+        return false;
+    }
+
+    return true;
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -269,6 +404,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
+    bool timer_was_pending;
     bool must_wait;
 
     if (atomic_read(&tgm->io_limits_disabled)) {
@@ -280,8 +416,18 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
         return true;
     }
 
+    timer_was_pending = timer_pending(tt->timers[is_write]);
     must_wait = throttle_schedule_timer(ts, tt, is_write);
 
+    /* The unused credit of the members may be enough for this request */
+    if (must_wait && tg->credit_granted) {
+        throttle_group_revoke_credit(tg);
+        if (!timer_was_pending) {
+            timer_del(tt->timers[is_write]);
+        }
+        must_wait = throttle_schedule_timer(ts, tt, is_write);
+    }
+
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
@@ -363,6 +509,12 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    /* The request was accounted when the credit was granted */
+    if (throttle_group_take_credit(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -372,6 +524,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
         tgm->pending_reqs[is_write]++;
+        tg->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -379,6 +532,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tg->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
@@ -387,6 +541,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* If the group is not throttled, let the next requests skip the lock */
+    throttle_group_grant_credit(tgm, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -453,6 +610,30 @@ void throttle_group_restart_tgm(ThrottleGroupMember *tgm)
     }
 }
 
+/* Set the throttle configuration of a group and drop the credit of its
+ * members, which was accounted with the old configuration.
+ *
+ * This assumes that tg->lock is held, or that the group has no members yet.
+ */
+static void throttle_group_do_config(ThrottleGroup *tg, ThrottleConfig *cfg)
+{
+    ThrottleGroupMember *tgm;
+    int i;
+
+    /* The bucket levels are reset, so there is nothing to give back */
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            atomic_set(&tgm->credit_ops[i], 0);
+            atomic_set(&tgm->credit_bytes[i], 0);
+        }
+    }
+    tg->credit_granted = false;
+
+    throttle_config(&tg->ts, tg->clock_type, cfg);
+    atomic_set(&tg->credit_max_bytes,
+               cfg->op_size ? MIN(cfg->op_size, UINT_MAX) : UINT_MAX);
+}
+
 /* Update the throttle configuration for a particular group. Similar
  * to throttle_config(), but guarantees atomicity within the
  * throttling group.
@@ -465,7 +646,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
-    throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_do_config(tg, cfg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -548,6 +729,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -599,8 +781,13 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
         }
     }
 
+    for (i = 0; i < 2; i++) {
+        throttle_group_refund_credit(tgm, i);
+    }
+
     /* remove the current tgm from the list */
     QLIST_REMOVE(tgm, round_robin);
+    tg->nr_members--;
     throttle_timers_destroy(&tgm->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
@@ -750,6 +937,7 @@ static void throttle_group_obj_init(Object *obj)
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
+    tg->credit_max_bytes = UINT_MAX;
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -777,7 +965,7 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
 }
@@ -897,7 +1085,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -174,7 +174,11 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* All clients of the export go through the same BlockBackend, so what
+     * one connection writes and flushes is visible on all others */
+    exp = nbd_export_new(bs, 0, -1,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         NBD_FLAG_CAN_MULTI_CONN,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
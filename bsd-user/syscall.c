@@ -143,6 +143,34 @@ int is_error(abi_long ret)
     return (abi_ulong)ret >= (abi_ulong)(-4096);
 }
 
+/*
+ * Keep a small per-thread host iovec array so that readv/writev and
+ * friends don't need a calloc/free pair per call.  Longer vectors, or a
+ * nested user, fall back to the heap.
+ */
+#define IOVEC_SCRATCH_COUNT 64
+
+static __thread struct iovec iovec_scratch[IOVEC_SCRATCH_COUNT];
+static __thread bool iovec_scratch_busy;
+
+static struct iovec *iovec_alloc(int count)
+{
+    if (count <= IOVEC_SCRATCH_COUNT && !iovec_scratch_busy) {
+        iovec_scratch_busy = true;
+        return iovec_scratch;
+    }
+    return calloc(count, sizeof(struct iovec));
+}
+
+static void iovec_free(struct iovec *vec)
+{
+    if (vec == iovec_scratch) {
+        iovec_scratch_busy = false;
+    } else {
+        free(vec);
+    }
+}
+
 struct iovec *lock_iovec(int type, abi_ulong target_addr,
         int count, int copy)
 {
@@ -162,7 +190,7 @@ struct iovec *lock_iovec(int type, abi_ulong target_addr,
         return NULL;
     }
 
-    vec = calloc(count, sizeof(struct iovec));
+    vec = iovec_alloc(count);
     if (vec == NULL) {
         errno = ENOMEM;
         return NULL;
@@ -226,7 +254,7 @@ struct iovec *lock_iovec(int type, abi_ulong target_addr,
     }
     unlock_user(target_vec, target_addr, 0);
  fail2:
-    free(vec);
+    iovec_free(vec);
     errno = err;
     return NULL;
 }
@@ -234,6 +262,8 @@ struct iovec *lock_iovec(int type, abi_ulong target_addr,
 void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         int count, int copy)
 {
+#ifdef DEBUG_REMAP
+    /* unlock_user() does nothing otherwise, don't walk the vector again. */
     struct target_iovec *target_vec;
     int i;
 
@@ -250,8 +280,9 @@ void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
         unlock_user(target_vec, target_addr, 0);
     }
+#endif
 
-    free(vec);
+    iovec_free(vec);
 }
 
 
@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -76,6 +77,23 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/* Log-linear latency histogram: each power of two is split in
+ * 1 << BLOCK_LATENCY_HDR_SUB_BITS buckets of the same width.  Unlike
+ * BlockLatencyHistogram, it needs no configuration and its precision is the
+ * same for short and long latencies.
+ */
+#define BLOCK_LATENCY_HDR_SUB_BITS  4
+#define BLOCK_LATENCY_HDR_MAX_BITS  40
+#define BLOCK_LATENCY_HDR_BUCKETS \
+    ((BLOCK_LATENCY_HDR_MAX_BITS - BLOCK_LATENCY_HDR_SUB_BITS + 1) << \
+     BLOCK_LATENCY_HDR_SUB_BITS)
+
+typedef struct BlockLatencyHdr {
+    Stat64 count;
+    Stat64 max;
+    Stat64 buckets[BLOCK_LATENCY_HDR_BUCKETS];
+} BlockLatencyHdr;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -118,4 +136,7 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+void block_latency_hdr_account(BlockLatencyHdr *hdr, uint64_t latency);
+uint64_t block_latency_hdr_percentile(BlockLatencyHdr *hdr, unsigned permille);
+
 #endif
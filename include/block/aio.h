@@ -15,6 +15,7 @@
 #define QEMU_AIO_H
 
 #include "qemu-common.h"
+#include "qemu/bitmap.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
@@ -51,6 +52,9 @@ struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
 
+/* Number of host CPUs that the thread pool affinity bitmap can describe */
+#define THREAD_POOL_MAX_CPUS 1024
+
 struct AioContext {
     GSource source;
 
@@ -117,12 +121,27 @@ struct AioContext {
      */
     struct ThreadPool *thread_pool;
 
+    /* Thread pool parameters, see aio_context_set_thread_pool_params().
+     * thread_pool_lock protects them and the creation of thread_pool, so
+     * that a new pool cannot miss an update of the parameters.
+     */
+    QemuMutex thread_pool_lock;
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+    DECLARE_BITMAP(thread_pool_cpus, THREAD_POOL_MAX_CPUS);
+
 #ifdef CONFIG_LINUX_AIO
     /* State for native Linux AIO.  Uses aio_context_acquire/release for
      * locking.
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -387,6 +406,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -623,4 +648,28 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept around even when idle
+ * @max: maximum number of worker threads
+ *
+ * Workers are started on demand up to @max, depending on how many requests
+ * are queued, and exit after being idle for a while unless there are no
+ * more than @min of them.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
+/**
+ * aio_context_set_thread_pool_affinity:
+ * @ctx: the aio context
+ * @host_cpus: bitmap of THREAD_POOL_MAX_CPUS bits
+ *
+ * Restrict the thread pool workers to the host CPUs in @host_cpus.  An empty
+ * bitmap removes the restriction for workers that are started afterwards.
+ */
+void aio_context_set_thread_pool_affinity(AioContext *ctx,
+                                          const unsigned long *host_cpus);
+
 #endif
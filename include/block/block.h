@@ -31,6 +31,12 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if concurrent compressed writes are laid out in the image file in
+     * the order they were submitted, so that callers wanting a sequential
+     * layout need not wait for each compressed write to complete
+     */
+    bool ordered_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -116,6 +122,7 @@ typedef struct HDGeometry {
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
 #define BDRV_O_AUTO_RDONLY 0x20000 /* degrade to read-only if opening read-write fails */
+#define BDRV_O_IO_URING    0x40000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -284,6 +291,7 @@ void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
 
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
+int bdrv_parse_aio(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
                            QDict *options, const char *bdref_key,
                            BlockDriverState* parent,
@@ -478,6 +486,7 @@ const char *bdrv_get_device_or_node_name(const BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t offset, int64_t bytes,
                             int64_t *cluster_offset,
@@ -580,6 +589,8 @@ void bdrv_coroutine_enter(BlockDriverState *bs, Coroutine *co);
 void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
 int bdrv_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz);
 int bdrv_probe_geometry(BlockDriverState *bs, HDGeometry *geo);
+int bdrv_get_data_fd(BlockDriverState *bs, uint64_t *offset,
+                     uint64_t bytes);
 
 void bdrv_io_plug(BlockDriverState *bs);
 void bdrv_io_unplug(BlockDriverState *bs);
@@ -707,6 +718,13 @@ void bdrv_unregister_buf(BlockDriverState *bs, void *host);
  *                               recursion.
  *         BDRV_REQ_NO_SERIALISING - do not serialize with other overlapping
  *                                   requests currently in flight.
+ *         BDRV_REQ_COPY_ON_READ - only for @write_flags; populate the
+ *                                 @dst node like copy-on-read does.  Fail
+ *                                 with -EAGAIN if any part of the range is
+ *                                 already allocated in it, e.g. because it
+ *                                 was written since the caller checked.  The
+ *                                 range must be aligned to the cluster size
+ *                                 of the @dst node.
  *
  * Returns: 0 if succeeded; negative error code if failed.
  **/
@@ -56,6 +56,8 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -81,8 +83,22 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* cpu_get_host_ticks() when the request started, 0 unless the latency
+     * of the node is being measured */
+    int64_t start_ticks;
 } BdrvTrackedRequest;
 
+/* Latency of the requests that a node handles.  It is measured with
+ * cpu_get_host_ticks(), which is cheaper than reading a clock; start_ticks
+ * and start_ns let bdrv_latency_ns() convert ticks to nanoseconds.
+ */
+typedef struct BdrvLatency {
+    int64_t start_ticks;
+    int64_t start_ns;
+    BlockLatencyHdr hdr[BLOCK_MAX_IOTYPE];
+} BdrvLatency;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -320,6 +336,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -408,6 +425,15 @@ struct BlockDriver {
      * callback; see hd_geometry_guess().
      */
     int (*bdrv_probe_geometry)(BlockDriverState *bs, HDGeometry *geo);
+    /**
+     * Return a file descriptor from which @bytes bytes of guest data at
+     * *@offset can be read directly, and update *@offset to the position of
+     * the data in that file.  Return -ENOTSUP if the driver cannot expose
+     * its data this way.  The descriptor may change when @bs is reopened,
+     * so it is only valid while the caller keeps a request in flight.
+     */
+    int (*bdrv_get_data_fd)(BlockDriverState *bs, uint64_t *offset,
+                            uint64_t bytes);
 
     /**
      * bdrv_co_drain_begin is called if implemented in the beginning of a
@@ -775,13 +801,24 @@ struct BlockDriverState {
     /* Writing to the list requires the BQL _and_ the dirty_bitmap_mutex.
      * Reading from the list can be done with either the BQL or the
      * dirty_bitmap_mutex.  Modifying a bitmap only requires
-     * dirty_bitmap_mutex.  */
+     * dirty_bitmap_mutex, except that bdrv_set_dirty() sets bits without
+     * it; see bdrv_dirty_bitmaps_lock() in block/dirty-bitmap.c.  */
     QemuMutex dirty_bitmap_mutex;
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
 
+    /* Number of bdrv_set_dirty() calls that set bits without holding
+     * dirty_bitmap_mutex, and whether the holder of the mutex asked new
+     * ones to take it instead.  Accessed with atomic operations.  */
+    unsigned int dirty_bitmap_writers;
+    bool dirty_bitmap_exclusive;
+
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Latency histograms, NULL unless enabled with bdrv_latency_enable().
+     * Only changes while the node is drained.  */
+    BdrvLatency *latency;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1069,6 +1106,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: Whether to write compressed data to @target.
+ * @perf: Performance tuning parameters, or %NULL for the defaults.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1085,6 +1124,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
                             bool compress,
+                            const BackupPerf *perf,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
@@ -1160,6 +1200,9 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+void bdrv_latency_enable(BlockDriverState *bs, bool enable);
+uint64_t bdrv_latency_ns(BdrvLatency *latency, uint64_t ticks);
+
 void blockdev_close_all_bdrv_states(void);
 
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
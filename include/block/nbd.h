@@ -208,6 +208,10 @@ enum {
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Maximum size of a READ/WRITE request sent by the client if the server
+ * advertises a larger maximum block size than NBD_MAX_BUFFER_SIZE */
+#define NBD_MAX_CLIENT_BLOCK_SIZE (256 * 1024 * 1024)
+
 /* Maximum size of an export name. The NBD spec requires 256 and
  * suggests that servers support up to 4096, but we stick to only the
  * required size so that we can stack-allocate the names, and because
@@ -308,6 +312,7 @@ BlockBackend *nbd_export_get_blockdev(NBDExport *exp);
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_set_name(NBDExport *exp, const char *name);
 void nbd_export_set_description(NBDExport *exp, const char *description);
+void nbd_export_set_zero_copy(NBDExport *exp, bool enable);
 void nbd_export_close_all(void);
 
 void nbd_client_new(QIOChannelSocket *sioc,
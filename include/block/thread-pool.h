@@ -20,12 +20,33 @@
 
 #include "block/block.h"
 
+#define THREAD_POOL_MAX_THREADS_DEFAULT 64
+
+/* Latency histogram bins.  Bin 0 counts the requests that took less than
+ * 1 microsecond from submission until the worker finished them, bin i
+ * those that took between 2^(i-1) and 2^i microseconds; the last bin has
+ * no upper bound.
+ */
+#define THREAD_POOL_LATENCY_BINS 21
+
 typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+typedef struct ThreadPoolStats {
+    int min_threads;
+    int max_threads;
+    int cur_threads;
+    int idle_threads;
+    int queue_depth;
+    uint64_t requests;
+    uint64_t latency_bins[THREAD_POOL_LATENCY_BINS];
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
+void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
 
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
@@ -43,6 +43,13 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int io_limits_disabled;
 
+    /* Operations and bytes that can be performed without taking the
+     * ThrottleGroup lock, because they have already been accounted in
+     * throttle_state.  Accessed with atomic operations.
+     */
+    unsigned int credit_ops[2];
+    unsigned int credit_bytes[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
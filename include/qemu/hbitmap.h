@@ -61,6 +61,34 @@ struct HBitmapIter {
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_sparse:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap, as in hbitmap_alloc().
+ *
+ * Allocate a new HBitmap that only takes memory for the parts of the bitmap
+ * that contain both set and clear bits.  Large regions that are entirely
+ * clear or entirely set are stored in constant space.  The bitmap can be
+ * used with all the functions in this file.
+ */
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity);
+
+/**
+ * hbitmap_is_sparse:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether @hb was allocated with hbitmap_alloc_sparse().
+ */
+bool hbitmap_is_sparse(const HBitmap *hb);
+
+/**
+ * hbitmap_memory_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory currently used by @hb.
+ */
+uint64_t hbitmap_memory_size(const HBitmap *hb);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -125,6 +153,22 @@ uint64_t hbitmap_count(const HBitmap *hb);
  */
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_set_atomic:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to set (0-based).
+ * @count: Number of bits to set.
+ *
+ * Set a consecutive range of bits in an HBitmap, like hbitmap_set.
+ * Multiple threads can call this function on the same HBitmap at the same
+ * time, but no other function may access @hb concurrently, except for
+ * hbitmap_get(), hbitmap_count() and the functions that take a const
+ * HBitmap, such as hbitmap_iter_init(), as long as only one thread calls
+ * those.  Iterators that were initialized before the call may or may not
+ * see the new bits.
+ */
+void hbitmap_set_atomic(HBitmap *hb, uint64_t start, uint64_t count);
+
 /**
  * hbitmap_reset:
  * @hb: HBitmap to operate on.
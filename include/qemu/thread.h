@@ -161,6 +161,14 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/*
+ * Restrict @thread to the host CPUs set in the @nbits wide bitmap @host_cpus.
+ * Returns 0 on success, -errno on failure; -ENOSYS if the host does not
+ * support thread affinity.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *host_cpus,
+                             unsigned long nbits);
+
 struct Notifier;
 /**
  * qemu_thread_atexit_add:
@@ -115,6 +115,8 @@ void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta);
 
 int64_t throttle_compute_wait(LeakyBucket *bkt);
 
+double throttle_bucket_headroom(LeakyBucket *bkt);
+
 /* init/destroy cycle */
 void throttle_init(ThrottleState *ts);
 
@@ -153,6 +155,10 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              bool is_write);
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+void throttle_headroom(ThrottleState *ts, bool is_write,
+                       uint64_t *ops, uint64_t *bytes);
+void throttle_account_batch(ThrottleState *ts, bool is_write,
+                            uint64_t ops, uint64_t bytes, bool refund);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
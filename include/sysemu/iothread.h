@@ -37,6 +37,11 @@ typedef struct {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* AioContext thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+    DECLARE_BITMAP(thread_pool_cpus, THREAD_POOL_MAX_CPUS);
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -17,8 +17,10 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
@@ -110,6 +112,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
     iothread->thread_id = -1;
 }
 
@@ -162,12 +165,20 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
         iothread->ctx = NULL;
         return;
     }
+    aio_context_set_thread_pool_affinity(iothread->ctx,
+                                         iothread->thread_pool_cpus);
 
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
@@ -195,23 +206,29 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
 typedef struct {
     const char *name;
     ptrdiff_t offset; /* field's byte offset in IOThread struct */
-} PollParamInfo;
+} IOThreadParamInfo;
 
-static PollParamInfo poll_max_ns_info = {
+static IOThreadParamInfo poll_max_ns_info = {
     "poll-max-ns", offsetof(IOThread, poll_max_ns),
 };
-static PollParamInfo poll_grow_info = {
+static IOThreadParamInfo poll_grow_info = {
     "poll-grow", offsetof(IOThread, poll_grow),
 };
-static PollParamInfo poll_shrink_info = {
+static IOThreadParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
 
-static void iothread_get_poll_param(Object *obj, Visitor *v,
+static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
-    PollParamInfo *info = opaque;
+    IOThreadParamInfo *info = opaque;
     int64_t *field = (void *)iothread + info->offset;
 
     visit_type_int64(v, name, field, errp);
@@ -221,7 +238,7 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
-    PollParamInfo *info = opaque;
+    IOThreadParamInfo *info = opaque;
     int64_t *field = (void *)iothread + info->offset;
     Error *local_err = NULL;
     int64_t value;
@@ -251,23 +268,129 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value, old;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    old = *field;
+    *field = value;
+
+    /* The values are checked together once the iothread is complete */
+    if (iothread->ctx) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_err);
+        if (local_err) {
+            *field = old;
+        }
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_thread_pool_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **cpu = &host_cpus;
+    unsigned long value;
+
+    value = find_first_bit(iothread->thread_pool_cpus, THREAD_POOL_MAX_CPUS);
+    while (value < THREAD_POOL_MAX_CPUS) {
+        *cpu = g_malloc0(sizeof(**cpu));
+        (*cpu)->value = value;
+        cpu = &(*cpu)->next;
+
+        value = find_next_bit(iothread->thread_pool_cpus,
+                              THREAD_POOL_MAX_CPUS, value + 1);
+    }
+
+    visit_type_uint16List(v, name, &host_cpus, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+static void iothread_set_thread_pool_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+#ifdef CONFIG_PTHREAD_AFFINITY_NP
+    IOThread *iothread = IOTHREAD(obj);
+    DECLARE_BITMAP(host_cpus, THREAD_POOL_MAX_CPUS);
+    uint16List *list = NULL, *l;
+    Error *local_err = NULL;
+
+    visit_type_uint16List(v, name, &list, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    bitmap_zero(host_cpus, THREAD_POOL_MAX_CPUS);
+    for (l = list; l; l = l->next) {
+        if (l->value >= THREAD_POOL_MAX_CPUS) {
+            error_setg(&local_err, "Host CPU %" PRIu16 " is out of range "
+                       "[0, %d]", l->value, THREAD_POOL_MAX_CPUS - 1);
+            goto out;
+        }
+        set_bit(l->value, host_cpus);
+    }
+
+    bitmap_copy(iothread->thread_pool_cpus, host_cpus, THREAD_POOL_MAX_CPUS);
+    if (iothread->ctx) {
+        aio_context_set_thread_pool_affinity(iothread->ctx, host_cpus);
+    }
+
+out:
+    qapi_free_uint16List(list);
+    error_propagate(errp, local_err);
+#else
+    error_setg(errp, "Thread affinity is not supported by this QEMU");
+#endif
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
 
     object_class_property_add(klass, "poll-max-ns", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_max_ns_info, &error_abort);
     object_class_property_add(klass, "poll-grow", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_grow_info, &error_abort);
     object_class_property_add(klass, "poll-shrink", "int",
-                              iothread_get_poll_param,
+                              iothread_get_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-cpus", "uint16List",
+                              iothread_get_thread_pool_cpus,
+                              iothread_set_thread_pool_cpus,
+                              NULL, NULL, &error_abort);
+    object_class_property_set_description(klass, "thread-pool-cpus",
+        "Binds the thread pool workers to the list of host CPUs",
+        &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -300,12 +423,40 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+static ThreadPoolInfo *iothread_get_thread_pool_info(ThreadPool *pool)
+{
+    ThreadPoolInfo *info = g_new0(ThreadPoolInfo, 1);
+    ThreadPoolStats stats;
+    uint64List **boundary = &info->latency_boundaries;
+    uint64List **bin = &info->latency_bins;
+    int i;
+
+    thread_pool_get_stats(pool, &stats);
+    info->threads = stats.cur_threads;
+    info->idle_threads = stats.idle_threads;
+    info->queue_depth = stats.queue_depth;
+    info->requests = stats.requests;
+
+    for (i = 0; i < THREAD_POOL_LATENCY_BINS; i++) {
+        if (i < THREAD_POOL_LATENCY_BINS - 1) {
+            *boundary = g_new0(uint64List, 1);
+            (*boundary)->value = (1ULL << i) * SCALE_US;
+            boundary = &(*boundary)->next;
+        }
+        *bin = g_new0(uint64List, 1);
+        (*bin)->value = stats.latency_bins[i];
+        bin = &(*bin)->next;
+    }
+    return info;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
     IOThreadInfoList *elem;
     IOThreadInfo *info;
     IOThread *iothread;
+    ThreadPool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -318,6 +469,14 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->thread_pool_min = iothread->thread_pool_min;
+    info->thread_pool_max = iothread->thread_pool_max;
+
+    pool = iothread->ctx ? atomic_read(&iothread->ctx->thread_pool) : NULL;
+    if (pool) {
+        info->has_thread_pool = true;
+        info->thread_pool = iothread_get_thread_pool_info(pool);
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
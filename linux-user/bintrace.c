@@ -0,0 +1,303 @@
+/*
+ *  Binary system call tracing
+ *
+ *  Each guest thread appends fixed-size records to its own ring buffer
+ *  without taking any lock; a background thread drains the rings into
+ *  the trace file.  If a ring fills up because the writer cannot keep
+ *  up, records are dropped and the number of lost records is written
+ *  out as a BINTRACE_NR_DROPPED record.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/queue.h"
+#include "qemu.h"
+#include "bintrace.h"
+
+/* Number of records per thread, must be a power of two */
+#define BINTRACE_RING_SIZE 4096
+#define BINTRACE_RING_MASK (BINTRACE_RING_SIZE - 1)
+
+/* How long the writer sleeps when all rings are empty */
+#define BINTRACE_IDLE_US 1000
+
+typedef struct BinTraceRing {
+    BinTraceRecord records[BINTRACE_RING_SIZE];
+    unsigned head;          /* written by the owning thread only */
+    unsigned tail;          /* written by the writer thread only */
+    unsigned long dropped;      /* written by the owning thread only */
+    unsigned long dropped_seen; /* written by the writer thread only */
+    uint32_t tid;
+    bool dead;              /* owning thread has exited */
+    QLIST_ENTRY(BinTraceRing) next;
+} BinTraceRing;
+
+bool bintrace_enabled;
+bool bintrace_all;
+DECLARE_BITMAP(bintrace_filter, BINTRACE_MAX_SYSCALLS);
+
+static char *bintrace_filename;
+static FILE *bintrace_file;
+static QemuThread bintrace_thread;
+static bool bintrace_stop;
+
+/* Protects the list of rings, not their contents */
+static QemuMutex bintrace_lock;
+static QLIST_HEAD(, BinTraceRing) bintrace_rings =
+    QLIST_HEAD_INITIALIZER(bintrace_rings);
+
+static __thread BinTraceRing *bintrace_ring;
+
+static BinTraceRing *bintrace_ring_new(void)
+{
+    BinTraceRing *ring = g_new0(BinTraceRing, 1);
+
+    ring->tid = syscall(__NR_gettid);
+    qemu_mutex_lock(&bintrace_lock);
+    QLIST_INSERT_HEAD(&bintrace_rings, ring, next);
+    qemu_mutex_unlock(&bintrace_lock);
+    return ring;
+}
+
+void bintrace_record(int num, abi_long arg1, abi_long arg2, abi_long arg3,
+                     abi_long arg4, abi_long arg5, abi_long arg6,
+                     abi_long ret)
+{
+    BinTraceRing *ring = bintrace_ring;
+    BinTraceRecord *rec;
+    unsigned head;
+
+    if (unlikely(!ring)) {
+        ring = bintrace_ring = bintrace_ring_new();
+    }
+
+    head = ring->head;
+    if (head - atomic_load_acquire(&ring->tail) == BINTRACE_RING_SIZE) {
+        atomic_set(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    rec = &ring->records[head & BINTRACE_RING_MASK];
+    rec->timestamp = get_clock();
+    rec->tid = ring->tid;
+    rec->num = num;
+    rec->args[0] = (abi_ulong)arg1;
+    rec->args[1] = (abi_ulong)arg2;
+    rec->args[2] = (abi_ulong)arg3;
+    rec->args[3] = (abi_ulong)arg4;
+    rec->args[4] = (abi_ulong)arg5;
+    rec->args[5] = (abi_ulong)arg6;
+    rec->ret = ret;
+    atomic_store_release(&ring->head, head + 1);
+}
+
+/* Called by the owning thread just before it goes away. */
+void bintrace_thread_exit(void)
+{
+    BinTraceRing *ring = bintrace_ring;
+
+    if (ring) {
+        bintrace_ring = NULL;
+        atomic_store_release(&ring->dead, true);
+    }
+}
+
+/*
+ * Write out everything @ring holds.  Returns the number of records
+ * written.  Must be called with bintrace_lock held.
+ */
+static unsigned bintrace_drain_ring(BinTraceRing *ring)
+{
+    unsigned head = atomic_load_acquire(&ring->head);
+    unsigned tail = ring->tail;
+    unsigned count = head - tail;
+    unsigned long dropped = atomic_read(&ring->dropped);
+
+    while (tail != head) {
+        unsigned idx = tail & BINTRACE_RING_MASK;
+        unsigned n = MIN(head - tail, BINTRACE_RING_SIZE - idx);
+
+        fwrite(&ring->records[idx], sizeof(BinTraceRecord), n, bintrace_file);
+        tail += n;
+    }
+    atomic_store_release(&ring->tail, tail);
+
+    if (dropped != ring->dropped_seen) {
+        BinTraceRecord rec = {
+            .timestamp = get_clock(),
+            .tid = ring->tid,
+            .num = BINTRACE_NR_DROPPED,
+            .args[0] = dropped - ring->dropped_seen,
+        };
+
+        fwrite(&rec, sizeof(rec), 1, bintrace_file);
+        ring->dropped_seen = dropped;
+        count++;
+    }
+    return count;
+}
+
+static unsigned bintrace_drain(void)
+{
+    BinTraceRing *ring, *next;
+    unsigned count = 0;
+
+    qemu_mutex_lock(&bintrace_lock);
+    QLIST_FOREACH_SAFE(ring, &bintrace_rings, next, next) {
+        /* Read dead first so that no record can slip in after the drain */
+        bool dead = atomic_load_acquire(&ring->dead);
+
+        count += bintrace_drain_ring(ring);
+        if (dead) {
+            QLIST_REMOVE(ring, next);
+            g_free(ring);
+        }
+    }
+    if (count) {
+        fflush(bintrace_file);
+    }
+    qemu_mutex_unlock(&bintrace_lock);
+    return count;
+}
+
+static void *bintrace_writer(void *opaque)
+{
+    while (!atomic_read(&bintrace_stop)) {
+        if (!bintrace_drain()) {
+            g_usleep(BINTRACE_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+static void bintrace_open(const char *filename)
+{
+    BinTraceHeader hdr = {
+        .magic = BINTRACE_MAGIC,
+        .version = BINTRACE_VERSION,
+        .abi_bits = TARGET_ABI_BITS,
+    };
+
+    bintrace_file = fopen(filename, "wb");
+    if (!bintrace_file) {
+        fprintf(stderr, "qemu: could not open syscall trace file '%s': %s\n",
+                filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pstrcpy(hdr.target, sizeof(hdr.target), TARGET_NAME);
+    fwrite(&hdr, sizeof(hdr), 1, bintrace_file);
+
+    bintrace_stop = false;
+    qemu_thread_create(&bintrace_thread, "bintrace", bintrace_writer,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Enable binary tracing into @filename.  @filter is a comma separated
+ * list of syscall names to record, or NULL to record all of them.
+ */
+void bintrace_init(const char *filename, const char *filter)
+{
+    qemu_mutex_init(&bintrace_lock);
+
+    if (filter) {
+        gchar **names = g_strsplit(filter, ",", -1);
+        int i;
+
+        for (i = 0; names[i]; i++) {
+            int num = strace_syscall_nr(names[i]);
+
+            if (num < 0 || num >= BINTRACE_MAX_SYSCALLS) {
+                fprintf(stderr, "qemu: cannot trace unknown syscall '%s'\n",
+                        names[i]);
+                exit(EXIT_FAILURE);
+            }
+            set_bit(num, bintrace_filter);
+        }
+        g_strfreev(names);
+    } else {
+        bitmap_fill(bintrace_filter, BINTRACE_MAX_SYSCALLS);
+        bintrace_all = true;
+    }
+
+    bintrace_filename = g_strdup(filename);
+    bintrace_open(bintrace_filename);
+    bintrace_enabled = true;
+}
+
+/* Stop the writer and write out whatever is still buffered. */
+void bintrace_flush(void)
+{
+    if (!bintrace_enabled) {
+        return;
+    }
+    atomic_set(&bintrace_stop, true);
+    qemu_thread_join(&bintrace_thread);
+    bintrace_drain();
+    fclose(bintrace_file);
+    bintrace_file = NULL;
+    bintrace_enabled = false;
+}
+
+void bintrace_fork_start(void)
+{
+    if (bintrace_enabled) {
+        qemu_mutex_lock(&bintrace_lock);
+    }
+}
+
+/*
+ * The writer thread does not survive fork(), and the child's copies of
+ * the other threads' rings hold records the parent will write out.
+ * The child therefore starts over with its own file, named after the
+ * original one with the child's pid appended.
+ */
+void bintrace_fork_end(int child)
+{
+    BinTraceRing *ring, *next;
+    char *filename;
+
+    if (!bintrace_enabled) {
+        return;
+    }
+    if (!child) {
+        qemu_mutex_unlock(&bintrace_lock);
+        return;
+    }
+
+    QLIST_FOREACH_SAFE(ring, &bintrace_rings, next, next) {
+        QLIST_REMOVE(ring, next);
+        if (ring != bintrace_ring) {
+            g_free(ring);
+        }
+    }
+    if (bintrace_ring) {
+        bintrace_ring->tid = syscall(__NR_gettid);
+        bintrace_ring->head = bintrace_ring->tail = 0;
+        bintrace_ring->dropped = bintrace_ring->dropped_seen = 0;
+        QLIST_INSERT_HEAD(&bintrace_rings, bintrace_ring, next);
+    }
+    qemu_mutex_init(&bintrace_lock);
+
+    /* bintrace_drain() flushes before dropping the lock, so the
+     * inherited stdio buffer is empty.
+     */
+    fclose(bintrace_file);
+    filename = g_strdup_printf("%s.%d", bintrace_filename, getpid());
+    bintrace_open(filename);
+    g_free(filename);
+}
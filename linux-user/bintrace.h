@@ -0,0 +1,84 @@
+/*
+ *  Binary system call tracing
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BINTRACE_H
+#define BINTRACE_H
+
+#include "qemu/bitops.h"
+
+/*
+ * On-disk format, decoded offline by scripts/strace-decode.py.
+ *
+ * The file starts with a BinTraceHeader followed by a stream of
+ * BinTraceRecords.  All fields are in host byte order; the decoder uses
+ * the magic number to tell which one that was.  Records from different
+ * threads are interleaved in the order the writer thread drained them,
+ * so they are not necessarily sorted by timestamp.
+ */
+#define BINTRACE_MAGIC      0x31544353554d4551ULL /* "QEMUSCT1" */
+#define BINTRACE_VERSION    1
+
+/* Pseudo syscall number for a record reporting lost records in args[0] */
+#define BINTRACE_NR_DROPPED (-1)
+
+typedef struct BinTraceHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t abi_bits;
+    char target[16];
+} BinTraceHeader;
+
+typedef struct BinTraceRecord {
+    uint64_t timestamp;         /* ns, host monotonic clock */
+    uint32_t tid;
+    int32_t num;
+    uint64_t args[6];
+    int64_t ret;
+} BinTraceRecord;
+
+/* Syscall numbers below this can be filtered individually */
+#define BINTRACE_MAX_SYSCALLS 8192
+
+extern bool bintrace_enabled;
+extern bool bintrace_all;
+extern unsigned long bintrace_filter[BITS_TO_LONGS(BINTRACE_MAX_SYSCALLS)];
+
+void bintrace_init(const char *filename, const char *filter);
+void bintrace_record(int num, abi_long arg1, abi_long arg2, abi_long arg3,
+                     abi_long arg4, abi_long arg5, abi_long arg6,
+                     abi_long ret);
+void bintrace_thread_exit(void);
+void bintrace_flush(void);
+void bintrace_fork_start(void);
+void bintrace_fork_end(int child);
+
+/*
+ * Check whether syscall @num should be recorded.  This is the only part
+ * of the tracer on the syscall path for calls that were filtered out.
+ */
+static inline bool bintrace_wanted(int num)
+{
+    if (likely(!bintrace_enabled)) {
+        return false;
+    }
+    if ((unsigned)num >= BINTRACE_MAX_SYSCALLS) {
+        return bintrace_all;
+    }
+    return test_bit(num, bintrace_filter);
+}
+
+#endif
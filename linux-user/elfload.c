@@ -7,6 +7,8 @@
 #include "qemu.h"
 #include "disas/disas.h"
 #include "qemu/path.h"
+#include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 #ifdef _ARCH_PPC64
 #undef ARCH_DLINFO
@@ -20,6 +22,10 @@
 
 #define ELF_OSABI   ELFOSABI_SYSV
 
+/* Core dump tuning, set from the command line */
+int core_dump_threads = 1;
+bool core_dump_skip_file_backed;
+
 /* from personality.h */
 
 /*
@@ -2862,12 +2868,19 @@ struct vm_area_struct {
     target_ulong   vma_start;  /* start vaddr of memory region */
     target_ulong   vma_end;    /* end vaddr of memory region */
     abi_ulong      vma_flags;  /* protection etc. flags for the region */
+    abi_ulong      vma_filesz; /* number of bytes to dump */
     QTAILQ_ENTRY(vm_area_struct) vma_link;
 };
 
+struct host_file_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
 struct mm_struct {
     QTAILQ_HEAD(, vm_area_struct) mm_mmap;
     int mm_count;           /* number of mappings */
+    GArray *file_ranges;    /* file backed host mappings, if needed */
 };
 
 static struct mm_struct *vma_init(void);
@@ -2877,7 +2890,8 @@ static int vma_add_mapping(struct mm_struct *, target_ulong,
 static int vma_get_mapping_count(const struct mm_struct *);
 static struct vm_area_struct *vma_first(const struct mm_struct *);
 static struct vm_area_struct *vma_next(struct vm_area_struct *);
-static abi_ulong vma_dump_size(const struct vm_area_struct *);
+static abi_ulong vma_dump_size(const struct mm_struct *,
+                               const struct vm_area_struct *);
 static int vma_walker(void *priv, target_ulong start, target_ulong end,
                       unsigned long flags);
 
@@ -2954,6 +2968,7 @@ static struct mm_struct *vma_init(void)
         return (NULL);
 
     mm->mm_count = 0;
+    mm->file_ranges = NULL;
     QTAILQ_INIT(&mm->mm_mmap);
 
     return (mm);
@@ -2967,6 +2982,9 @@ static void vma_delete(struct mm_struct *mm)
         QTAILQ_REMOVE(&mm->mm_mmap, vma, vma_link);
         g_free(vma);
     }
+    if (mm->file_ranges) {
+        g_array_free(mm->file_ranges, true);
+    }
     g_free(mm);
 }
 
@@ -3003,15 +3021,96 @@ static int vma_get_mapping_count(const struct mm_struct *mm)
     return (mm->mm_count);
 }
 
+/*
+ * Record which host mappings are backed by a file, so that
+ * core_dump_skip_file_backed can leave out guest memory that a
+ * debugger can read from the original file.
+ */
+static void vma_read_host_maps(struct mm_struct *mm)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t len = 0;
+
+    mm->file_ranges = g_array_new(false, false,
+                                  sizeof(struct host_file_range));
+
+    fp = fopen("/proc/self/maps", "r");
+    if (fp == NULL) {
+        return;
+    }
+
+    while (getline(&line, &len, fp) != -1) {
+        struct host_file_range r;
+        uint64_t min, max, offset;
+        unsigned dev_maj, dev_min;
+        unsigned long inode;
+        char perms[5];
+
+        if (sscanf(line, "%" PRIx64 "-%" PRIx64 " %4s %" PRIx64 " %x:%x %lu",
+                   &min, &max, perms, &offset, &dev_maj, &dev_min,
+                   &inode) != 7 || inode == 0) {
+            continue;
+        }
+        r.start = min;
+        r.end = max;
+        g_array_append_val(mm->file_ranges, r);
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/* Is all of @vma backed by files on the host?  Host maps are sorted. */
+static bool vma_is_file_backed(const struct mm_struct *mm,
+                               const struct vm_area_struct *vma)
+{
+    uintptr_t start = (uintptr_t)g2h(vma->vma_start);
+    uintptr_t end = (uintptr_t)g2h(vma->vma_end - 1) + 1;
+    guint i;
+
+    for (i = 0; i < mm->file_ranges->len; i++) {
+        struct host_file_range *r = &g_array_index(mm->file_ranges,
+                                                   struct host_file_range, i);
+
+        if (r->end <= start) {
+            continue;
+        }
+        if (r->start > start) {
+            return false;
+        }
+        start = r->end;
+        if (start >= end) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Calculate file (dump) size of given memory region.
  */
-static abi_ulong vma_dump_size(const struct vm_area_struct *vma)
+static abi_ulong vma_dump_size(const struct mm_struct *mm,
+                               const struct vm_area_struct *vma)
 {
-    /* if we cannot even read the first page, skip it */
-    if (!access_ok(VERIFY_READ, vma->vma_start, TARGET_PAGE_SIZE))
+    /*
+     * If we cannot read all of it, skip it.  Regions have uniform
+     * flags, so this normally only has to look at the first page.
+     */
+    if (!access_ok(VERIFY_READ, vma->vma_start,
+                   vma->vma_end - vma->vma_start))
         return (0);
 
+    /*
+     * Read-only file mappings are not dirty; the debugger can get
+     * them from the file.
+     */
+    if (core_dump_skip_file_backed &&
+        !(vma->vma_flags & (PAGE_WRITE | PAGE_WRITE_ORG)) &&
+        vma_is_file_backed(mm, vma)) {
+        return 0;
+    }
+
     /*
      * Usually we don't dump executable pages as they contain
      * non-writable code that debugger can read directly from
@@ -3217,6 +3316,170 @@ static int core_dump_filename(const TaskState *ts, char *buf,
     return (0);
 }
 
+/*
+ * Guest memory is written in chunks of this size, which are shared out
+ * between core_dump_threads threads.
+ */
+#define CORE_DUMP_CHUNK_SIZE (8 * 1024 * 1024)
+
+typedef struct CoreDumpChunk {
+    abi_ulong addr;
+    abi_ulong len;
+    off_t offset;
+} CoreDumpChunk;
+
+typedef struct CoreDumpState {
+    int fd;
+    off_t limit;            /* RLIMIT_CORE, or -1 if unlimited */
+    CoreDumpChunk *chunks;
+    unsigned nchunks;
+    unsigned next;          /* next chunk to hand out */
+    int error;              /* first errno seen, or 0 */
+} CoreDumpState;
+
+/* Write guest memory directly to the core file, honoring RLIMIT_CORE. */
+static int core_dump_pwrite(CoreDumpState *s, abi_ulong addr,
+                            abi_ulong len, off_t offset)
+{
+    const char *p = g2h(addr);
+
+    if (s->limit >= 0) {
+        if (offset >= s->limit) {
+            return 0;
+        }
+        len = MIN(len, s->limit - offset);
+    }
+
+    while (len > 0) {
+        ssize_t n = pwrite(s->fd, p, len, offset);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        } else if (n == 0) {
+            return EIO;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Write one chunk, leaving a hole in the file for each page that is all
+ * zeroes.  This covers pages the guest never touched, too.
+ */
+static int core_dump_chunk(CoreDumpState *s, const CoreDumpChunk *c)
+{
+    abi_ulong pos, run_start = 0, run_len = 0;
+    int ret;
+
+    for (pos = 0; pos < c->len; pos += TARGET_PAGE_SIZE) {
+        if (!buffer_is_zero(g2h(c->addr + pos), TARGET_PAGE_SIZE)) {
+            if (!run_len) {
+                run_start = pos;
+            }
+            run_len += TARGET_PAGE_SIZE;
+            continue;
+        }
+        if (run_len) {
+            ret = core_dump_pwrite(s, c->addr + run_start, run_len,
+                                   c->offset + run_start);
+            if (ret) {
+                return ret;
+            }
+            run_len = 0;
+        }
+    }
+    if (run_len) {
+        return core_dump_pwrite(s, c->addr + run_start, run_len,
+                                c->offset + run_start);
+    }
+    return 0;
+}
+
+static void *core_dump_worker(void *opaque)
+{
+    CoreDumpState *s = opaque;
+    unsigned i;
+
+    while (!atomic_read(&s->error) &&
+           (i = atomic_fetch_inc(&s->next)) < s->nchunks) {
+        int ret = core_dump_chunk(s, &s->chunks[i]);
+
+        if (ret) {
+            atomic_cmpxchg(&s->error, 0, ret);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write the memory of all regions in @mm, the first of which starts at
+ * file offset @offset.  Returns 0 on success, an errno value otherwise.
+ */
+static int core_dump_memory(int fd, struct mm_struct *mm, off_t offset,
+                            const struct rlimit *dumpsize)
+{
+    struct vm_area_struct *vma;
+    CoreDumpState s = {
+        .fd = fd,
+        .limit = -1,
+    };
+    unsigned nthreads = MAX(core_dump_threads, 1);
+    QemuThread *threads;
+    unsigned i, n = 0;
+
+    if (dumpsize->rlim_cur != RLIM_INFINITY) {
+        s.limit = dumpsize->rlim_cur;
+    }
+
+    for (vma = vma_first(mm); vma != NULL; vma = vma_next(vma)) {
+        n += DIV_ROUND_UP(vma->vma_filesz, CORE_DUMP_CHUNK_SIZE);
+    }
+    s.chunks = g_new(CoreDumpChunk, n);
+
+    for (vma = vma_first(mm); vma != NULL; vma = vma_next(vma)) {
+        abi_ulong pos;
+
+        for (pos = 0; pos < vma->vma_filesz; pos += CORE_DUMP_CHUNK_SIZE) {
+            CoreDumpChunk *c = &s.chunks[s.nchunks++];
+
+            c->addr = vma->vma_start + pos;
+            c->len = MIN(vma->vma_filesz - pos, CORE_DUMP_CHUNK_SIZE);
+            c->offset = offset + pos;
+        }
+        offset += vma->vma_filesz;
+    }
+
+    nthreads = MIN(nthreads, MAX(s.nchunks, 1));
+    threads = g_new(QemuThread, nthreads);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "core-dump", core_dump_worker, &s,
+                           QEMU_THREAD_JOINABLE);
+    }
+    core_dump_worker(&s);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+    g_free(s.chunks);
+
+    /* Trailing holes don't extend the file by themselves */
+    if (!s.error) {
+        if (s.limit >= 0) {
+            offset = MIN(offset, s.limit);
+        }
+        if (ftruncate(fd, offset) < 0) {
+            s.error = errno;
+        }
+    }
+    return s.error;
+}
+
 static int dump_write(int fd, const void *ptr, size_t size)
 {
     const char *bufp = (const char *)ptr;
@@ -3462,7 +3725,7 @@ static int elf_core_dump(int signr, const CPUArchState *env)
     if (core_dump_filename(ts, corefile, sizeof (corefile)) < 0)
         return (-errno);
 
-    if ((fd = open(corefile, O_WRONLY | O_CREAT,
+    if ((fd = open(corefile, O_WRONLY | O_CREAT | O_TRUNC,
                    S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0)
         return (-errno);
 
@@ -3476,6 +3739,9 @@ static int elf_core_dump(int signr, const CPUArchState *env)
 
     walk_memory_regions(mm, vma_walker);
     segs = vma_get_mapping_count(mm);
+    if (core_dump_skip_file_backed) {
+        vma_read_host_maps(mm);
+    }
 
     /*
      * Construct valid coredump ELF header.  We also
@@ -3516,7 +3782,7 @@ static int elf_core_dump(int signr, const CPUArchState *env)
         phdr.p_offset = offset;
         phdr.p_vaddr = vma->vma_start;
         phdr.p_paddr = 0;
-        phdr.p_filesz = vma_dump_size(vma);
+        phdr.p_filesz = vma->vma_filesz = vma_dump_size(mm, vma);
         offset += phdr.p_filesz;
         phdr.p_memsz = vma->vma_end - vma->vma_start;
         phdr.p_flags = vma->vma_flags & PROT_READ ? PF_R : 0;
@@ -3539,39 +3805,12 @@ static int elf_core_dump(int signr, const CPUArchState *env)
     if (write_note_info(&info, fd) < 0)
         goto out;
 
-    /* align data to page boundary */
-    if (lseek(fd, data_offset, SEEK_SET) != data_offset)
-        goto out;
-
     /*
-     * Finally we can dump process memory into corefile as well.
+     * Finally we can dump process memory into corefile as well.  This
+     * writes at explicit offsets, starting at the page boundary after
+     * the notes.
      */
-    for (vma = vma_first(mm); vma != NULL; vma = vma_next(vma)) {
-        abi_ulong addr;
-        abi_ulong end;
-
-        end = vma->vma_start + vma_dump_size(vma);
-
-        for (addr = vma->vma_start; addr < end;
-             addr += TARGET_PAGE_SIZE) {
-            char page[TARGET_PAGE_SIZE];
-            int error;
-
-            /*
-             *  Read in page from target process memory and
-             *  write it to coredump file.
-             */
-            error = copy_from_user(page, addr, sizeof (page));
-            if (error != 0) {
-                (void) fprintf(stderr, "unable to dump " TARGET_ABI_FMT_lx "\n",
-                               addr);
-                errno = -error;
-                goto out;
-            }
-            if (dump_write(fd, page, TARGET_PAGE_SIZE) < 0)
-                goto out;
-        }
-    }
+    errno = core_dump_memory(fd, mm, data_offset, &dumpsize);
 
  out:
     free_note_info(&info);
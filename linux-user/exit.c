@@ -18,6 +18,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu.h"
+#include "bintrace.h"
 
 #ifdef CONFIG_GCOV
 extern void __gcov_dump(void);
@@ -31,5 +32,6 @@ void preexit_cleanup(CPUArchState *env, int code)
 #ifdef CONFIG_GCOV
         __gcov_dump();
 #endif
+        bintrace_flush();
         gdb_exit(env, code);
 }
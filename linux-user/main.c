@@ -24,6 +24,7 @@
 
 #include "qapi/error.h"
 #include "qemu.h"
+#include "bintrace.h"
 #include "qemu/path.h"
 #include "qemu/config-file.h"
 #include "qemu/cutils.h"
@@ -114,12 +115,14 @@ void fork_start(void)
 {
     start_exclusive();
     mmap_fork_start();
+    bintrace_fork_start();
     cpu_list_lock();
 }
 
 void fork_end(int child)
 {
     mmap_fork_end(child);
+    bintrace_fork_end(child);
     if (child) {
         CPUState *cpu, *next_cpu;
         /* Child processes created by fork() only have a single thread.
@@ -371,6 +374,49 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static char *strace_file;
+static void handle_arg_strace_file(const char *arg)
+{
+    g_free(strace_file);
+    strace_file = g_strdup(arg);
+}
+
+static char *strace_filter;
+static void handle_arg_strace_filter(const char *arg)
+{
+    g_free(strace_filter);
+    strace_filter = g_strdup(arg);
+}
+
+static void handle_arg_core_threads(const char *arg)
+{
+    unsigned long long n;
+
+    if (parse_uint_full(arg, &n, 0) != 0 || n < 1 || n > 64) {
+        fprintf(stderr, "Invalid number of core dump threads: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    core_dump_threads = n;
+}
+
+static void handle_arg_core_filter(const char *arg)
+{
+    if (!strcmp(arg, "all")) {
+        core_dump_skip_file_backed = false;
+    } else if (!strcmp(arg, "modified")) {
+        core_dump_skip_file_backed = true;
+    } else {
+        fprintf(stderr, "Invalid core dump filter: %s "
+                "(must be 'all' or 'modified')\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_no_fast_syscall(const char *arg)
+{
+    enable_fast_syscall = false;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_NAME " version " QEMU_FULL_VERSION
@@ -432,6 +478,17 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"strace-file", "QEMU_STRACE_FILE", true,  handle_arg_strace_file,
+     "file",       "record system calls in binary form to 'file'"},
+    {"strace-filter", "QEMU_STRACE_FILTER", true, handle_arg_strace_filter,
+     "name[,...]", "only record the listed system calls with -strace-file"},
+    {"no-fast-syscall", "QEMU_NO_FAST_SYSCALL", false,
+     handle_arg_no_fast_syscall,
+     "",           "always leave the cpu loop for system calls"},
+    {"core-threads", "QEMU_CORE_THREADS", true, handle_arg_core_threads,
+     "n",          "write core dumps using 'n' threads"},
+    {"core-filter", "QEMU_CORE_FILTER", true,  handle_arg_core_filter,
+     "all|modified", "leave read-only file mappings out of core dumps"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
@@ -635,6 +692,10 @@ int main(int argc, char **argv, char **envp)
     }
     trace_init_file(trace_file);
 
+    if (strace_file) {
+        bintrace_init(strace_file, strace_filter);
+    }
+
     /* Zero out regs */
     memset(regs, 0, sizeof(struct target_pt_regs));
 
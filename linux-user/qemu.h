@@ -17,6 +17,7 @@
 #include "target_syscall.h"
 #include "exec/gdbstub.h"
 #include "qemu/queue.h"
+#include "qemu/bitops.h"
 
 /* This is the size of the host kernel's sigset_t, needed where we make
  * direct system calls that take a sigset_t pointer and a size.
@@ -131,6 +132,11 @@ typedef struct TaskState {
 
     struct emulated_sigtable sync_signal;
     struct emulated_sigtable sigtab[TARGET_NSIG];
+    /* Bit (sig - 1) is set if sigtab[sig - 1] is pending, so that
+     * process_pending_signals() does not have to scan the whole table.
+     * Only written with host signals blocked or from the signal handler.
+     */
+    unsigned long sigtab_pending[BITS_TO_LONGS(TARGET_NSIG)];
     /* This thread's signal mask, as requested by the guest program.
      * The actual signal mask of this thread may differ:
      *  + we don't let SIGSEGV and SIGBUS be blocked while running guest code
@@ -152,6 +158,13 @@ typedef struct TaskState {
      */
     int signal_pending;
 
+    /* Nonzero if this thread is known to have all host signals blocked
+     * (except possibly SIGSEGV and SIGBUS), either by block_signals() or
+     * because host_signal_handler() returned.  process_pending_signals()
+     * then does not need to block them again.  Zero means "unknown".
+     */
+    int host_sigs_blocked;
+
 } __attribute__((aligned(16))) TaskState;
 
 extern char *exec_path;
@@ -199,6 +212,8 @@ int info_is_fdpic(struct image_info *info);
 
 uint32_t get_elf_eflags(int fd);
 int load_elf_binary(struct linux_binprm *bprm, struct image_info *info);
+extern int core_dump_threads;
+extern bool core_dump_skip_file_backed;
 int load_flt_binary(struct linux_binprm *bprm, struct image_info *info);
 
 abi_long memcpy_to_target(abi_ulong dest, const void *src,
@@ -210,6 +225,9 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                     abi_long arg2, abi_long arg3, abi_long arg4,
                     abi_long arg5, abi_long arg6, abi_long arg7,
                     abi_long arg8);
+bool do_fast_syscall(void *cpu_env, int num, abi_long arg1, abi_long arg2,
+                     abi_long *ret);
+extern bool enable_fast_syscall;
 void gemu_log(const char *fmt, ...) GCC_FMT_ATTR(1, 2);
 extern __thread CPUState *thread_cpu;
 void cpu_loop(CPUArchState *env);
@@ -385,6 +403,13 @@ void print_syscall_ret(int num, abi_long arg1);
  * --- SIGSEGV {si_signo=SIGSEGV, si_code=SI_KERNEL, si_addr=0} ---
  */
 void print_taken_signal(int target_signum, const target_siginfo_t *tinfo);
+/**
+ * strace_syscall_nr:
+ * @name: syscall name as printed by -strace
+ *
+ * Return the target syscall number for @name, or -1 if it is unknown.
+ */
+int strace_syscall_nr(const char *name);
 extern int do_strace;
 
 /* signal.c */
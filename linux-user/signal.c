@@ -185,6 +185,7 @@ int block_signals(void)
      */
     sigfillset(&set);
     sigprocmask(SIG_SETMASK, &set, 0);
+    ts->host_sigs_blocked = 1;
 
     return atomic_xchg(&ts->signal_pending, 1);
 }
@@ -674,6 +675,7 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
     k = &ts->sigtab[sig - 1];
     k->info = tinfo;
     k->pending = sig;
+    set_bit(sig - 1, ts->sigtab_pending);
     ts->signal_pending = 1;
 
     /* Block host signals until target signal handler entered. We
@@ -693,6 +695,7 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
     memset(&uc->uc_sigmask, 0xff, SIGSET_T_SIZE);
     sigdelset(&uc->uc_sigmask, SIGSEGV);
     sigdelset(&uc->uc_sigmask, SIGBUS);
+    ts->host_sigs_blocked = 1;
 
     /* interrupt the virtual CPU as soon as possible */
     cpu_exit(thread_cpu);
@@ -930,8 +933,11 @@ void process_pending_signals(CPUArchState *cpu_env)
 
     while (atomic_read(&ts->signal_pending)) {
         /* FIXME: This is not threadsafe.  */
-        sigfillset(&set);
-        sigprocmask(SIG_SETMASK, &set, 0);
+        if (!ts->host_sigs_blocked) {
+            sigfillset(&set);
+            sigprocmask(SIG_SETMASK, &set, 0);
+            ts->host_sigs_blocked = 1;
+        }
 
     restart_scan:
         sig = ts->sync_signal.pending;
@@ -953,13 +959,17 @@ void process_pending_signals(CPUArchState *cpu_env)
             handle_pending_signal(cpu_env, sig, &ts->sync_signal);
         }
 
-        for (sig = 1; sig <= TARGET_NSIG; sig++) {
-            blocked_set = ts->in_sigsuspend ?
-                &ts->sigsuspend_mask : &ts->signal_mask;
-
-            if (ts->sigtab[sig - 1].pending &&
-                (!sigismember(blocked_set,
-                              target_to_host_signal_table[sig]))) {
+        /* Only look at the signals that are actually pending, lowest
+         * first.  All deliverable ones are handled before host signals
+         * are unblocked again.
+         */
+        blocked_set = ts->in_sigsuspend ?
+            &ts->sigsuspend_mask : &ts->signal_mask;
+        for (sig = find_first_bit(ts->sigtab_pending, TARGET_NSIG) + 1;
+             sig <= TARGET_NSIG;
+             sig = find_next_bit(ts->sigtab_pending, TARGET_NSIG, sig) + 1) {
+            if (!sigismember(blocked_set, target_to_host_signal_table[sig])) {
+                clear_bit(sig - 1, ts->sigtab_pending);
                 handle_pending_signal(cpu_env, sig, &ts->sigtab[sig - 1]);
                 /* Restart scan from the beginning, as handle_pending_signal
                  * might have resulted in a new synchronous signal (eg SIGSEGV).
@@ -978,6 +988,13 @@ void process_pending_signals(CPUArchState *cpu_env)
         sigdelset(&set, SIGSEGV);
         sigdelset(&set, SIGBUS);
         sigprocmask(SIG_SETMASK, &set, 0);
+        /* Only clear the flag once host signals are unblocked.  A host
+         * signal taken before the sigprocmask() sets it, and it must not
+         * survive the unblocking.  One taken between the two lines leaves
+         * host signals blocked with the flag clear, which only costs a
+         * redundant sigprocmask() at the top of the loop.
+         */
+        ts->host_sigs_blocked = 0;
     }
     ts->in_sigsuspend = 0;
 }
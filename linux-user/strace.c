@@ -2664,6 +2664,19 @@ print_syscall_ret(int num, abi_long ret)
         }
 }
 
+/* Look up a syscall number by name, returns -1 if it is unknown. */
+int strace_syscall_nr(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nsyscalls; i++) {
+        if (!strcmp(scnames[i].name, name)) {
+            return scnames[i].nr;
+        }
+    }
+    return -1;
+}
+
 void print_taken_signal(int target_signum, const target_siginfo_t *tinfo)
 {
     /* Print the strace output for a signal being taken:
@@ -111,6 +111,7 @@
 
 #include "qemu.h"
 #include "fd-trans.h"
+#include "bintrace.h"
 
 #ifndef CLONE_IO
 #define CLONE_IO                0x80000000      /* Clone io context */
@@ -2379,6 +2380,34 @@ static void target_to_host_low_high(abi_ulong tlow,
     *hhigh = (off >> HOST_LONG_BITS / 2) >> HOST_LONG_BITS / 2;
 }
 
+/* Vectored I/O is frequent enough that the host iovec array should not
+ * cost a malloc/free pair per syscall.  Each thread keeps a small array
+ * for the common case; longer vectors, or a nested user, fall back to
+ * the heap.
+ */
+#define IOVEC_SCRATCH_COUNT 64
+
+static __thread struct iovec iovec_scratch[IOVEC_SCRATCH_COUNT];
+static __thread bool iovec_scratch_busy;
+
+static struct iovec *iovec_alloc(abi_ulong count)
+{
+    if (likely(count <= IOVEC_SCRATCH_COUNT && !iovec_scratch_busy)) {
+        iovec_scratch_busy = true;
+        return iovec_scratch;
+    }
+    return g_try_new(struct iovec, count);
+}
+
+static void iovec_free(struct iovec *vec)
+{
+    if (likely(vec == iovec_scratch)) {
+        iovec_scratch_busy = false;
+    } else {
+        g_free(vec);
+    }
+}
+
 static struct iovec *lock_iovec(int type, abi_ulong target_addr,
                                 abi_ulong count, int copy)
 {
@@ -2398,7 +2427,7 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
         return NULL;
     }
 
-    vec = g_try_new0(struct iovec, count);
+    vec = iovec_alloc(count);
     if (vec == NULL) {
         errno = ENOMEM;
         return NULL;
@@ -2462,7 +2491,7 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
     }
     unlock_user(target_vec, target_addr, 0);
  fail2:
-    g_free(vec);
+    iovec_free(vec);
     errno = err;
     return NULL;
 }
@@ -2470,6 +2499,10 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
 static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
                          abi_ulong count, int copy)
 {
+#ifdef DEBUG_REMAP
+    /* unlock_user() is a no-op otherwise, so there is no need to go
+     * through the target iovec array again.
+     */
     struct target_iovec *target_vec;
     int i;
 
@@ -2486,8 +2519,9 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
         unlock_user(target_vec, target_addr, 0);
     }
+#endif
 
-    g_free(vec);
+    iovec_free(vec);
 }
 
 static inline int target_to_host_sock_type(int *type)
@@ -2633,6 +2667,35 @@ static abi_long do_connect(int sockfd, abi_ulong target_addr,
     return get_errno(safe_connect(sockfd, addr, addrlen));
 }
 
+/* Likewise for the host control message buffer of sendmsg/recvmsg,
+ * which also keeps a guest-controlled size off the stack.
+ */
+#define CMSG_SCRATCH_SIZE 1024
+
+static __thread union {
+    struct cmsghdr align;
+    char buf[CMSG_SCRATCH_SIZE];
+} cmsg_scratch;
+static __thread bool cmsg_scratch_busy;
+
+static void *cmsg_alloc(size_t len)
+{
+    if (likely(len <= CMSG_SCRATCH_SIZE && !cmsg_scratch_busy)) {
+        cmsg_scratch_busy = true;
+        return cmsg_scratch.buf;
+    }
+    return g_try_malloc(len);
+}
+
+static void cmsg_free(void *buf)
+{
+    if (likely(buf == cmsg_scratch.buf)) {
+        cmsg_scratch_busy = false;
+    } else {
+        g_free(buf);
+    }
+}
+
 /* do_sendrecvmsg_locked() Must return target values and target errnos. */
 static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
                                       int flags, int send)
@@ -2643,6 +2706,7 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
     struct iovec *vec;
     abi_ulong target_vec;
 
+    msg.msg_control = NULL;
     if (msgp->msg_name) {
         msg.msg_namelen = tswap32(msgp->msg_namelen);
         msg.msg_name = alloca(msg.msg_namelen+1);
@@ -2664,7 +2728,11 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
         msg.msg_namelen = 0;
     }
     msg.msg_controllen = 2 * tswapal(msgp->msg_controllen);
-    msg.msg_control = alloca(msg.msg_controllen);
+    msg.msg_control = cmsg_alloc(msg.msg_controllen);
+    if (msg.msg_control == NULL && msg.msg_controllen) {
+        ret = -TARGET_ENOMEM;
+        goto out2;
+    }
     memset(msg.msg_control, 0, msg.msg_controllen);
 
     msg.msg_flags = tswap32(msgp->msg_flags);
@@ -2736,6 +2804,7 @@ static abi_long do_sendrecvmsg_locked(int fd, struct target_msghdr *msgp,
 out:
     unlock_iovec(vec, target_vec, count, !send);
 out2:
+    cmsg_free(msg.msg_control);
     return ret;
 }
 
@@ -6939,6 +7008,7 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
             thread_cpu = NULL;
             object_unref(OBJECT(cpu));
             g_free(ts);
+            bintrace_thread_exit();
             rcu_unregister_thread();
             pthread_exit(NULL);
         }
@@ -11480,6 +11550,97 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
     return ret;
 }
 
+bool enable_fast_syscall = true;
+
+/* Syscalls that only read host clocks (or the current cpu) are common
+ * enough in timestamp-heavy guests that the round trip through cpu_loop()
+ * shows up in profiles.  Targets whose syscall instruction is implemented
+ * by a helper call this first, directly from generated code; on success
+ * the result is stored in *ret and the guest carries on without leaving
+ * cpu_exec().  Returns false if the syscall must take the slow path, e.g.
+ * because -strace wants to see it.
+ */
+bool do_fast_syscall(void *cpu_env, int num, abi_long arg1, abi_long arg2,
+                     abi_long *ret)
+{
+    CPUState *cpu = ENV_GET_CPU(cpu_env);
+
+    if (!enable_fast_syscall || unlikely(do_strace)) {
+        return false;
+    }
+
+    switch (num) {
+#ifdef TARGET_NR_clock_gettime
+    case TARGET_NR_clock_gettime:
+#endif
+    case TARGET_NR_gettimeofday:
+#ifdef TARGET_NR_time
+    case TARGET_NR_time:
+#endif
+    case TARGET_NR_getcpu:
+        break;
+    default:
+        return false;
+    }
+
+    trace_guest_user_syscall(cpu, num, arg1, arg2, 0, 0, 0, 0, 0, 0);
+
+    switch (num) {
+#ifdef TARGET_NR_clock_gettime
+    case TARGET_NR_clock_gettime:
+    {
+        struct timespec ts;
+        *ret = get_errno(clock_gettime(arg1, &ts));
+        if (!is_error(*ret)) {
+            *ret = host_to_target_timespec(arg2, &ts);
+        }
+        break;
+    }
+#endif
+    case TARGET_NR_gettimeofday:
+    {
+        struct timeval tv;
+        *ret = get_errno(gettimeofday(&tv, NULL));
+        if (!is_error(*ret) && copy_to_user_timeval(arg1, &tv)) {
+            *ret = -TARGET_EFAULT;
+        }
+        break;
+    }
+#ifdef TARGET_NR_time
+    case TARGET_NR_time:
+    {
+        time_t host_time;
+        *ret = get_errno(time(&host_time));
+        if (!is_error(*ret) && arg1 && put_user_sal(host_time, arg1)) {
+            *ret = -TARGET_EFAULT;
+        }
+        break;
+    }
+#endif
+    case TARGET_NR_getcpu:
+    {
+        unsigned cpu_id, node;
+        *ret = get_errno(sys_getcpu(arg1 ? &cpu_id : NULL,
+                                    arg2 ? &node : NULL,
+                                    NULL));
+        if (!is_error(*ret)) {
+            if ((arg1 && put_user_u32(cpu_id, arg1)) ||
+                (arg2 && put_user_u32(node, arg2))) {
+                *ret = -TARGET_EFAULT;
+            }
+        }
+        break;
+    }
+    }
+
+    if (bintrace_wanted(num)) {
+        bintrace_record(num, arg1, arg2, 0, 0, 0, 0, *ret);
+    }
+
+    trace_guest_user_syscall_ret(cpu, num, *ret);
+    return true;
+}
+
 abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                     abi_long arg2, abi_long arg3, abi_long arg4,
                     abi_long arg5, abi_long arg6, abi_long arg7,
@@ -11515,6 +11676,10 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                           arg5, arg6, arg7, arg8);
     }
 
+    if (bintrace_wanted(num)) {
+        bintrace_record(num, arg1, arg2, arg3, arg4, arg5, arg6, ret);
+    }
+
     trace_guest_user_syscall_ret(cpu, num, ret);
     return ret;
 }
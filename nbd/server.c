@@ -19,9 +19,15 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 #include "nbd-internal.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_DIRTY_BITMAP 1
 
@@ -80,6 +86,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint16_t nbdflags;
+    bool zero_copy; /* send read payloads straight from the image file */
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
@@ -1495,6 +1502,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->zero_copy = true;
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
         error_setg_errno(errp, -exp->size,
@@ -1560,6 +1568,11 @@ void nbd_export_set_description(NBDExport *exp, const char *description)
     exp->description = g_strdup(description);
 }
 
+void nbd_export_set_zero_copy(NBDExport *exp, bool enable)
+{
+    exp->zero_copy = enable;
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -1664,6 +1677,129 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    int sockfd;
+    int fd;
+    off_t offset;
+    size_t bytes;
+} NBDSendfileData;
+
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(data->sockfd, data->fd, &data->offset, data->bytes);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/* Send the reply header in @iov followed by @size bytes of the export at
+ * @offset, which the kernel copies from the image file to the socket
+ * without going through @data.
+ *
+ * Returns -ENOTSUP without sending anything if the export or the channel
+ * do not allow this, and the caller must send the data itself.  If
+ * sendfile() fails after the header went out, the rest of the payload is
+ * read into @data and sent from there.  Other errors are fatal for the
+ * connection.
+ */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  uint8_t *data, size_t size,
+                                                  Error **errp)
+{
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t file_offset = offset + exp->dev_offset;
+    NBDSendfileData sf;
+    size_t done = 0;
+    int fd, ret;
+
+    /* TLS has to encrypt the payload in user space anyway */
+    if (!exp->zero_copy || client->ioc != QIO_CHANNEL(client->sioc) ||
+        !bs || atomic_read(&bs->quiesce_counter)) {
+        return -ENOTSUP;
+    }
+
+    /* The descriptor stays valid while we have a request in flight, because
+     * reopening @bs drains it first */
+    bdrv_inc_in_flight(bs);
+    fd = bdrv_get_data_fd(bs, &file_offset, size);
+    if (fd < 0) {
+        bdrv_dec_in_flight(bs);
+        return -ENOTSUP;
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        bdrv_dec_in_flight(bs);
+        ret = -EIO;
+        goto out;
+    }
+
+    trace_nbd_co_send_zero_copy(offset, size);
+    sf = (NBDSendfileData) {
+        .sockfd = client->sioc->fd,
+        .fd = fd,
+    };
+    while (done < size) {
+        sf.offset = file_offset + done;
+        sf.bytes = size - done;
+        ret = thread_pool_submit_co(aio_get_thread_pool(exp->ctx),
+                                    nbd_sendfile_worker, &sf);
+        if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+        } else if (ret <= 0) {
+            break;
+        } else {
+            done += ret;
+        }
+    }
+    bdrv_dec_in_flight(bs);
+
+    if (done == size) {
+        ret = 0;
+        goto out;
+    }
+
+    trace_nbd_co_send_zero_copy_fallback(offset + done, size - done, ret);
+    ret = blk_pread(exp->blk, offset + exp->dev_offset + done,
+                    data + done, size - done);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "reading from file failed");
+        ret = -EIO;
+        goto out;
+    }
+    ret = qio_channel_write_all(client->ioc, (char *)data + done,
+                                size - done, errp) < 0 ? -EIO : 0;
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+#else
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  uint8_t *data, size_t size,
+                                                  Error **errp)
+{
+    return -ENOTSUP;
+}
+#endif
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1693,6 +1829,27 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+/* Like nbd_co_send_simple_reply() for a successful read, but the payload is
+ * sent directly from the export.  Returns -ENOTSUP if that is not possible,
+ * in which case the caller reads into @data and sends it itself. */
+static int coroutine_fn nbd_co_send_simple_read_zero_copy(NBDClient *client,
+                                                          uint64_t handle,
+                                                          uint64_t offset,
+                                                          uint8_t *data,
+                                                          size_t size,
+                                                          Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 1, offset, data, size,
+                                     errp);
+}
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1742,6 +1899,28 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/* Like nbd_co_send_structured_read(), but the payload is sent directly from
+ * the export.  Returns -ENOTSUP if that is not possible, in which case the
+ * caller reads into @data and uses nbd_co_send_structured_read(). */
+static int coroutine_fn nbd_co_send_structured_read_zero_copy(
+        NBDClient *client, uint64_t handle, uint64_t offset, uint8_t *data,
+        size_t size, bool final, Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    assert(size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 1, offset, data, size,
+                                     errp);
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1815,15 +1994,22 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_structured_read_zero_copy(
+                    client, handle, offset + progress, data + progress, pnum,
+                    final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk,
+                                offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2173,6 +2359,23 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->type == NBD_CMD_READ && request->len) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read_zero_copy(client,
+                                                        request->handle,
+                                                        request->from, data,
+                                                        request->len, true,
+                                                        errp);
+        } else {
+            ret = nbd_co_send_simple_read_zero_copy(client, request->handle,
+                                                    request->from, data,
+                                                    request->len, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0 || request->type == NBD_CMD_CACHE) {
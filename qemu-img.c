@@ -43,6 +43,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 
@@ -66,6 +67,7 @@ enum {
     OPTION_SIZE = 264,
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
+    OPTION_THREADS = 267,
 };
 
 typedef enum OutputFormat {
@@ -176,6 +178,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--threads' specifies how many threads detect zeroes and compress\n"
+           "       clusters in parallel during the convert process (defaults to 1)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1072,18 +1076,12 @@ done:
  */
 static int64_t find_nonzero(const uint8_t *buf, int64_t n)
 {
-    int64_t i;
-    int64_t end = QEMU_ALIGN_DOWN(n, BDRV_SECTOR_SIZE);
+    int64_t i = buffer_find_nonzero_offset(buf, n);
 
-    for (i = 0; i < end; i += BDRV_SECTOR_SIZE) {
-        if (!buffer_is_zero(buf + i, BDRV_SECTOR_SIZE)) {
-            return i;
-        }
-    }
-    if (i < n && !buffer_is_zero(buf + i, n - end)) {
-        return i;
+    if (i == n) {
+        return -1;
     }
-    return -1;
+    return QEMU_ALIGN_DOWN(i, BDRV_SECTOR_SIZE);
 }
 
 /*
@@ -1101,16 +1099,25 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum,
 {
     bool is_zero;
     int i, tail;
+    size_t zero_bytes;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, 512);
-    for(i = 1; i < n; i++) {
-        buf += 512;
-        if (is_zero != buffer_is_zero(buf, 512)) {
-            break;
+
+    /* A zero run is measured in a single pass over the buffer; data is
+     * still checked sector by sector, but that stops at the first non-zero
+     * byte of each sector. */
+    zero_bytes = buffer_find_nonzero_offset(buf, (size_t)n * BDRV_SECTOR_SIZE);
+    i = zero_bytes / BDRV_SECTOR_SIZE;
+    is_zero = i > 0;
+    if (!is_zero) {
+        for (i = 1; i < n; i++) {
+            buf += BDRV_SECTOR_SIZE;
+            if (buffer_is_zero(buf, BDRV_SECTOR_SIZE)) {
+                break;
+            }
         }
     }
 
@@ -1568,12 +1575,14 @@ typedef struct ImgConvertState {
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
+    bool ordered_compressed_writes;
     bool copy_range;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long num_threads;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
     int64_t wait_sector_num[MAX_COROUTINES];
@@ -1806,6 +1815,70 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+typedef struct ConvertZeroCheck {
+    const uint8_t *buf;
+    size_t len;
+} ConvertZeroCheck;
+
+static int convert_is_zero_func(void *opaque)
+{
+    ConvertZeroCheck *zc = opaque;
+
+    return buffer_is_zero(zc->buf, zc->len);
+}
+
+/*
+ * Checks in a worker thread whether the buffer read for a BLK_DATA chunk is
+ * all zeroes, so that scanning it does not keep the coroutines busy on the
+ * main thread. Returns true if the chunk can be treated as BLK_ZERO.
+ */
+static bool coroutine_fn convert_co_is_zero(ImgConvertState *s,
+                                            int64_t sector_num, int n,
+                                            const uint8_t *buf)
+{
+    ConvertZeroCheck zc = {
+        .buf = buf,
+        .len = n * BDRV_SECTOR_SIZE,
+    };
+
+    /* convert_co_write() writes out an unaligned zero tail as data, keep it
+     * that way */
+    if (!s->compressed && ((sector_num + n) & (s->alignment - 1)) &&
+        sector_num + n != s->total_sectors) {
+        return false;
+    }
+
+    return thread_pool_submit_co(aio_get_thread_pool(qemu_get_aio_context()),
+                                 convert_is_zero_func, &zc);
+}
+
+/*
+ * Lets the coroutine that waits to write at @sector_num proceed. If @defer is
+ * true, it only runs once the calling coroutine yields.
+ */
+static void convert_co_wake_writer(ImgConvertState *s, int64_t sector_num,
+                                   bool defer)
+{
+    int i;
+
+    s->wr_offs = sector_num;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (defer) {
+                aio_co_wake(s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1872,6 +1945,15 @@ retry:
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
+        /* Zero detection runs before waiting for our turn to write, so with
+         * several threads it overlaps with the other coroutines' work */
+        if (status == BLK_DATA && !copy_range && s->num_threads > 1 &&
+            s->min_sparse && s->ret == -EINPROGRESS &&
+            convert_co_is_zero(s, sector_num, n, buf))
+        {
+            status = BLK_ZERO;
+        }
+
         if (s->wr_in_order) {
             /* keep writes in order */
             while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
@@ -1879,6 +1961,12 @@ retry:
                 qemu_coroutine_yield();
             }
             s->wait_sector_num[index] = -1;
+
+            /* The driver keeps compressed writes in submission order, so the
+             * next one may start compressing as soon as ours is submitted */
+            if (s->compressed && s->ordered_compressed_writes) {
+                convert_co_wake_writer(s, sector_num + n, true);
+            }
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -1898,21 +1986,11 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order &&
+            !(s->compressed && s->ordered_compressed_writes)) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_writer(s, sector_num + n, false);
         }
     }
 
@@ -2021,7 +2099,9 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .num_threads        = 1,
     };
+    bool explicit_num_coroutines = false;
 
     for(;;) {
         static const struct option long_options[] = {
@@ -2030,6 +2110,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2128,6 +2209,15 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            explicit_num_coroutines = true;
+            break;
+        case OPTION_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_COROUTINES) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d", MAX_COROUTINES);
+                goto fail_getopt;
+            }
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2163,6 +2253,12 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    /* Keep enough requests in flight to feed all threads */
+    if (!explicit_num_coroutines) {
+        s.num_coroutines = MAX(s.num_coroutines,
+                               MIN(MAX_COROUTINES, 2 * s.num_threads));
+    }
+
     if (s.compressed && s.copy_range) {
         error_report("Cannot enable copy offloading when -c is used");
         goto fail_getopt;
@@ -2358,6 +2454,12 @@ static int img_convert(int argc, char **argv)
     if (!skip_create) {
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
+
+        /* Compression happens in the qcow2 driver, give it as many threads */
+        if (s.compressed && s.num_threads > 1 &&
+            !strcmp(drv->format_name, "qcow2")) {
+            qdict_put_int(open_opts, "compress-threads", s.num_threads);
+        }
     }
 
     if (!skip_create) {
@@ -2450,6 +2552,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.ordered_compressed_writes = bdi.ordered_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
         s.unallocated_blocks_are_zero = bdi.unallocated_blocks_are_zero;
     }
@@ -4081,7 +4184,8 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -4124,6 +4228,14 @@ static int img_bench(int argc, char **argv)
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            ret = bdrv_parse_aio(optarg, &flags);
+            if (ret < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                ret = -1;
+                goto out;
+            }
+            break;
         case 'o':
         {
             offset = cvtnum(optarg);
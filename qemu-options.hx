@@ -680,7 +680,7 @@ This is the protocol-level block driver for accessing regular files.
 @item filename
 The path to the image file in the local filesystem
 @item aio
-Specifies the AIO backend (threads/native, default: threads)
+Specifies the AIO backend (threads/native/io_uring, default: threads)
 @item locking
 Specifies whether the image file is protected with Linux OFD / POSIX locks. The
 default is to use the Linux Open File Descriptor API if available, otherwise no
@@ -750,6 +750,22 @@ Clean unused entries in the L2 and refcount caches. The interval is in seconds.
 The default value is 600 on supporting platforms, and 0 on other platforms.
 Setting it to 0 disables this feature.
 
+@item alloc-reserve-size
+Host space in bytes that is reserved at once for each sequential allocating
+writer. Its following writes take their clusters from the reservation without
+updating refcounts and stay contiguous in the image file. Reserved clusters
+that have not been used when QEMU crashes are leaked (default: 0, which
+disables reservations)
+
+@item compress-threads
+The maximum number of clusters that are compressed in parallel for compressed
+writes, e.g. by @code{qemu-img convert -c} (default: 4)
+
+@item l2-readahead
+The number of L2 cache entries that are read in the background ahead of
+sequential requests. It is limited to half of the L2 cache size (default: 0,
+which disables readahead)
+
 @item pass-discard-request
 Whether discard requests to the qcow2 device should be forwarded to the data
 source (on/off; default: on if discard=unmap is specified, off otherwise)
@@ -790,7 +806,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -858,7 +875,8 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO and Linux io_uring.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for linux-user binary syscall trace files (-strace-file)
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: strace-decode.py <syscall_nr.h> <strace.list> <trace-file>
+#
+# <syscall_nr.h> is linux-user/<arch>/syscall_nr.h for the guest that was
+# traced; <strace.list> is linux-user/strace.list.  Guest memory is not
+# available offline, so string and structure arguments are printed as
+# addresses.
+
+from __future__ import print_function
+import os
+import re
+import struct
+import sys
+
+MAGIC = 0x31544353554d4551
+NR_DROPPED = -1
+
+header_fmt = 'QII16s'
+record_fmt = 'QIi6Qq'
+
+define_re = re.compile(r'^\s*#\s*define\s+TARGET_NR_(\w+)\s+(.+?)\s*$')
+entry_re = re.compile(r'\{\s*TARGET_NR_(\w+)\s*,\s*"(\w*)"\s*,\s*'
+                      r'(NULL|(?:"(?:[^"\\]|\\.)*"|\s|TARGET_ABI_FMT_\w+)+)'
+                      r'\s*,')
+conv_re = re.compile(r'%([#0 +-]*)(\d*)(?:hh|h|ll|l|z)?([dipuxXos])')
+
+def read_syscall_nrs(fname):
+    '''Return a dict mapping syscall numbers to names'''
+    defs = {}
+    for line in open(fname):
+        m = define_re.match(line)
+        if m:
+            defs[m.group(1)] = re.sub(r'/\*.*?\*/', '', m.group(2)).strip()
+
+    values = {}
+    def evaluate(name, depth=0):
+        if name in values:
+            return values[name]
+        if depth > 16:
+            raise ValueError(name)
+        expr = re.sub(r'TARGET_NR_(\w+)',
+                      lambda m: str(evaluate(m.group(1), depth + 1)),
+                      defs[name])
+        expr = re.sub(r'(?<=[0-9a-fA-F])[uUlL]+\b', '', expr)
+        values[name] = int(eval(expr, {'__builtins__': {}}))
+        return values[name]
+
+    nrs = {}
+    for name in defs:
+        try:
+            nrs[evaluate(name)] = name
+        except (ValueError, KeyError, SyntaxError, NameError):
+            pass
+    return nrs
+
+def read_strace_list(fname):
+    '''Return a dict mapping syscall names to their format string'''
+    text = open(fname).read()
+    formats = {}
+    for m in entry_re.finditer(text):
+        fmt = m.group(3).strip()
+        if fmt == 'NULL':
+            formats[m.group(2)] = None
+            continue
+        fmt = re.sub(r'TARGET_ABI_FMT_l(\w)', r'"%l\1"', fmt)
+        fmt = ''.join(re.findall(r'"((?:[^"\\]|\\.)*)"', fmt))
+        formats[m.group(2)] = fmt.replace('\\n', '')
+    return formats
+
+def to_signed(value, bits):
+    if value & (1 << (bits - 1)):
+        return value - (1 << bits)
+    return value
+
+def format_call(name, fmt, args, abi_bits):
+    if fmt is None:
+        return '%s(%s)' % (name, ','.join(str(to_signed(a, abi_bits))
+                                          for a in args))
+    pieces = []
+    pos = 0
+    argi = -1
+    for m in conv_re.finditer(fmt):
+        pieces.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, conv = m.groups()
+        if argi < 0:
+            # The first conversion is always the syscall name
+            pieces.append(name)
+        elif argi < len(args):
+            value = args[argi]
+            if conv in 'di':
+                pieces.append(('%' + flags + width + 'd') %
+                              to_signed(value, abi_bits))
+            elif conv in 'ps':
+                pieces.append('0x%x' % value)
+            else:
+                pieces.append(('%' + flags + width + conv) % value)
+        argi += 1
+    pieces.append(fmt[pos:])
+    return ''.join(pieces)
+
+def format_ret(ret):
+    if -4096 < ret < 0:
+        return '-1 errno=%d (%s)' % (-ret, os.strerror(-ret))
+    return '%d' % ret
+
+def process(nrs, formats, fobj):
+    magic = fobj.read(8)
+    if len(magic) != 8:
+        sys.stderr.write('trace file is truncated\n')
+        sys.exit(1)
+    if struct.unpack('<Q', magic)[0] == MAGIC:
+        endian = '<'
+    elif struct.unpack('>Q', magic)[0] == MAGIC:
+        endian = '>'
+    else:
+        sys.stderr.write('not a syscall trace file\n')
+        sys.exit(1)
+
+    hlen = struct.calcsize(endian + header_fmt)
+    hdr = struct.unpack(endian + header_fmt, magic + fobj.read(hlen - 8))
+    abi_bits = hdr[2]
+
+    rlen = struct.calcsize(endian + record_fmt)
+    while True:
+        buf = fobj.read(rlen)
+        if len(buf) != rlen:
+            break
+        rec = struct.unpack(endian + record_fmt, buf)
+        timestamp, tid, num = rec[0:3]
+        args = rec[3:9]
+        ret = rec[9]
+        prefix = '%d %d.%09d ' % (tid, timestamp // 1000000000,
+                                  timestamp % 1000000000)
+        if num == NR_DROPPED:
+            print(prefix + '--- %d records dropped ---' % args[0])
+            continue
+        name = nrs.get(num)
+        if name is None:
+            print(prefix + 'Unknown syscall %d = %s' % (num, format_ret(ret)))
+            continue
+        print(prefix + format_call(name, formats.get(name), args, abi_bits) +
+              ' = ' + format_ret(ret))
+
+def main(args):
+    if len(args) != 4:
+        sys.stderr.write('usage: %s <syscall_nr.h> <strace.list> '
+                         '<trace-file>\n' % args[0])
+        sys.exit(1)
+    nrs = read_syscall_nrs(args[1])
+    formats = read_strace_list(args[2])
+    with open(args[3], 'rb') as fobj:
+        process(nrs, formats, fobj)
+
+if __name__ == '__main__':
+    main(sys.argv)
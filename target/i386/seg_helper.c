@@ -26,6 +26,10 @@
 #include "exec/cpu_ldst.h"
 #include "exec/log.h"
 
+#ifdef CONFIG_LINUX_USER
+#include "qemu.h"
+#endif
+
 //#define DEBUG_PCALL
 
 #ifdef DEBUG_PCALL
@@ -973,6 +977,19 @@ static void do_interrupt64(CPUX86State *env, int intno, int is_int,
 void helper_syscall(CPUX86State *env, int next_eip_addend)
 {
     CPUState *cs = CPU(x86_env_get_cpu(env));
+#if defined(CONFIG_LINUX_USER) && !defined(TARGET_ABI32)
+    abi_long ret;
+
+    /* Clock reads are answered without leaving the cpu loop; the
+     * translator ends the TB after the syscall insn either way.
+     */
+    if (do_fast_syscall(env, env->regs[R_EAX], env->regs[R_EDI],
+                        env->regs[R_ESI], &ret)) {
+        env->regs[R_EAX] = ret;
+        env->eip += next_eip_addend;
+        return;
+    }
+#endif
 
     cs->exception_index = EXCP_SYSCALL;
     env->exception_next_eip = env->eip + next_eip_addend;
@@ -0,0 +1,95 @@
+/*
+ * QEMU buffer_is_zero speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+
+#define BUFFER_SIZE (2 * MiB)
+
+static uint8_t *buffer;
+
+/* Scan the zero buffer sector by sector, the way qemu-img convert used to
+ * look for the end of a zero run.
+ */
+static size_t zero_run_by_sector(const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && buffer_is_zero(buf + i, 512); i += 512) {
+        /* nothing */
+    }
+    return i;
+}
+
+static void test_is_zero_speed(size_t chunk_size, unsigned accel)
+{
+    double total = 0.0;
+    size_t i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i + chunk_size <= BUFFER_SIZE; i += chunk_size) {
+            g_assert(buffer_is_zero(buffer + i, chunk_size));
+        }
+        total += BUFFER_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    total /= MiB;
+    g_print("accel %u: buffer_is_zero chunk_size %zu bytes: ",
+            accel, chunk_size);
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+}
+
+static void test_zero_run_speed(bool by_sector, unsigned accel)
+{
+    double total = 0.0;
+    size_t run;
+
+    g_test_timer_start();
+    do {
+        run = by_sector ? zero_run_by_sector(buffer, BUFFER_SIZE)
+                        : buffer_find_nonzero_offset(buffer, BUFFER_SIZE);
+        g_assert_cmpuint(run, ==, BUFFER_SIZE);
+        total += BUFFER_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    total /= MiB;
+    g_print("accel %u: zero run (%s): ", accel,
+            by_sector ? "per-sector buffer_is_zero"
+                      : "buffer_find_nonzero_offset");
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+}
+
+static void test_speed(void)
+{
+    unsigned accel = 0;
+    size_t i;
+
+    buffer = g_malloc0(BUFFER_SIZE);
+
+    /* Accelerator 0 is the best one the host supports; every following
+       round drops one, down to the plain integer implementation.  */
+    do {
+        for (i = 64; i <= 64 * KiB; i *= 4) {
+            test_is_zero_speed(i, accel);
+        }
+        test_zero_run_speed(true, accel);
+        test_zero_run_speed(false, accel);
+        accel++;
+    } while (test_buffer_is_zero_next_accel());
+
+    g_free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero/speed", test_speed);
+
+    return g_test_run();
+}
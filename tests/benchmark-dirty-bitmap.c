@@ -0,0 +1,161 @@
+/*
+ * Dirty bitmap write path benchmark
+ *
+ * Several iothreads mark random 4 KiB writes as dirty in two bitmaps of the
+ * same node, either through bdrv_set_dirty() or by taking the bitmap lock
+ * around every write, as bdrv_set_dirty() used to do.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "iothread.h"
+
+#define NUM_CONTEXTS    4
+#define DISK_SIZE       (64 * GiB)
+#define WRITE_SIZE      (4 * KiB)
+
+static IOThread *threads[NUM_CONTEXTS];
+static BlockDriverState *bs;
+static BdrvDirtyBitmap *bitmaps[2];
+
+static bool now_stopping;
+static int running;
+static bool use_lock;
+static uint64_t nb_writes[NUM_CONTEXTS];
+
+static void writer_entry(void *opaque)
+{
+    int id = (uintptr_t)opaque;
+    uint64_t seed = (id + 1) * 0x9e3779b97f4a7c15ULL;
+    uint64_t n = 0;
+    int i;
+
+    while (!atomic_read(&now_stopping)) {
+        int64_t offset;
+
+        /* xorshift, so that the random generator does not take a lock */
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        offset = (seed % (DISK_SIZE / WRITE_SIZE)) * WRITE_SIZE;
+
+        if (use_lock) {
+            bdrv_dirty_bitmap_lock(bitmaps[0]);
+            for (i = 0; i < ARRAY_SIZE(bitmaps); i++) {
+                bdrv_set_dirty_bitmap_locked(bitmaps[i], offset, WRITE_SIZE);
+            }
+            bdrv_dirty_bitmap_unlock(bitmaps[0]);
+        } else {
+            bdrv_set_dirty(bs, offset, WRITE_SIZE);
+        }
+        n++;
+    }
+
+    nb_writes[id] = n;
+    atomic_dec(&running);
+}
+
+static void test_write_speed(int nb_threads, bool locked, bool readers)
+{
+    uint64_t total = 0, nb_reads = 0;
+    int i;
+
+    use_lock = locked;
+    now_stopping = false;
+    running = nb_threads;
+
+    for (i = 0; i < nb_threads; i++) {
+        Coroutine *co = qemu_coroutine_create(writer_entry,
+                                              (void *)(uintptr_t)i);
+        aio_co_schedule(iothread_get_aio_context(threads[i]), co);
+    }
+
+    /* Optionally emulate a block job or the monitor that looks at the
+     * bitmaps every now and then.
+     */
+    g_test_timer_start();
+    while (g_test_timer_elapsed() < 1.0) {
+        if (readers) {
+            bdrv_dirty_bitmap_lock(bitmaps[0]);
+            bdrv_get_dirty_locked(bs, bitmaps[0], 0);
+            bdrv_dirty_bitmap_unlock(bitmaps[0]);
+            nb_reads++;
+            g_usleep(100);
+        } else {
+            g_usleep(10000);
+        }
+    }
+
+    atomic_mb_set(&now_stopping, true);
+    while (atomic_mb_read(&running) > 0) {
+        g_usleep(1000);
+    }
+    for (i = 0; i < nb_threads; i++) {
+        total += nb_writes[i];
+    }
+
+    g_print("%d iothreads, %s%s: %.2f Mwrites/sec",
+            nb_threads, locked ? "bitmap lock" : "bdrv_set_dirty",
+            readers ? ", with reader" : "",
+            total / g_test_timer_last() / 1000000);
+    if (readers) {
+        g_print(" (%" PRIu64 " reads)", nb_reads);
+    }
+    g_print("\n");
+
+    for (i = 0; i < ARRAY_SIZE(bitmaps); i++) {
+        bdrv_clear_dirty_bitmap(bitmaps[i], NULL);
+    }
+}
+
+static void test_speed(void)
+{
+    QDict *options = qdict_new();
+    int i, n;
+
+    qdict_put_str(options, "size", "64G");
+    bs = bdrv_open("null-co://", NULL, options, BDRV_O_RDWR | BDRV_O_PROTOCOL,
+                   &error_abort);
+    for (i = 0; i < ARRAY_SIZE(bitmaps); i++) {
+        bitmaps[i] = bdrv_create_dirty_bitmap(bs, 64 * KiB, NULL,
+                                              &error_abort);
+    }
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        threads[i] = iothread_new();
+    }
+
+    for (n = 1; n <= NUM_CONTEXTS; n *= 2) {
+        test_write_speed(n, true, false);
+        test_write_speed(n, false, false);
+        test_write_speed(n, false, true);
+    }
+
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        iothread_join(threads[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(bitmaps); i++) {
+        bdrv_release_dirty_bitmap(bs, bitmaps[i]);
+    }
+    bdrv_unref(bs);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dirty-bitmap/set-dirty/speed", test_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,129 @@
+/*
+ * QEMU HBitmap benchmark: dense vs. sparse representation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* A 4 TiB disk tracked with the default 64 KiB granularity */
+#define DISK_SIZE   (4 * TiB)
+#define GRANULARITY 16
+#define WRITE_SIZE  (64 * KiB)
+
+typedef enum {
+    PATTERN_EMPTY,
+    PATTERN_RANDOM,         /* scattered 64 KiB writes */
+    PATTERN_SEQUENTIAL,     /* one long run, as after a full copy */
+    PATTERN_FULL,
+} Pattern;
+
+static const char *pattern_name[] = {
+    [PATTERN_EMPTY] = "empty",
+    [PATTERN_RANDOM] = "random",
+    [PATTERN_SEQUENTIAL] = "sequential",
+    [PATTERN_FULL] = "full",
+};
+
+static HBitmap *bitmap_new(bool sparse)
+{
+    return sparse ? hbitmap_alloc_sparse(DISK_SIZE, GRANULARITY)
+                  : hbitmap_alloc(DISK_SIZE, GRANULARITY);
+}
+
+static void bitmap_fill(HBitmap *hb, Pattern pattern, uint64_t nb_writes)
+{
+    uint64_t i;
+
+    switch (pattern) {
+    case PATTERN_EMPTY:
+        break;
+    case PATTERN_RANDOM:
+        for (i = 0; i < nb_writes; i++) {
+            uint64_t offset = g_test_rand_int_range(0, DISK_SIZE / WRITE_SIZE);
+            hbitmap_set(hb, offset * WRITE_SIZE, WRITE_SIZE);
+        }
+        break;
+    case PATTERN_SEQUENTIAL:
+        hbitmap_set(hb, 0, MIN(nb_writes * WRITE_SIZE, DISK_SIZE));
+        break;
+    case PATTERN_FULL:
+        hbitmap_set(hb, 0, DISK_SIZE);
+        break;
+    }
+}
+
+static void test_memory(Pattern pattern, bool sparse)
+{
+    HBitmap *hb = bitmap_new(sparse);
+
+    bitmap_fill(hb, pattern, 100000);
+    g_print("%s %s: %" PRIu64 " dirty bytes, %.2f KiB of memory\n",
+            sparse ? "sparse" : "dense", pattern_name[pattern],
+            hbitmap_count(hb), (double)hbitmap_memory_size(hb) / KiB);
+    hbitmap_free(hb);
+}
+
+static void test_set_speed(bool sparse)
+{
+    HBitmap *hb = bitmap_new(sparse);
+    uint64_t nb_writes = 0;
+
+    g_test_timer_start();
+    do {
+        bitmap_fill(hb, PATTERN_RANDOM, 10000);
+        nb_writes += 10000;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    g_print("%s: random set: %.2f Mops/sec\n", sparse ? "sparse" : "dense",
+            nb_writes / g_test_timer_last() / 1000000);
+    hbitmap_free(hb);
+}
+
+static void test_iter_speed(Pattern pattern, bool sparse)
+{
+    HBitmap *hb = bitmap_new(sparse);
+    HBitmapIter hbi;
+    uint64_t nb_bits = 0;
+
+    bitmap_fill(hb, pattern, 100000);
+
+    g_test_timer_start();
+    do {
+        hbitmap_iter_init(&hbi, hb, 0);
+        while (hbitmap_iter_next(&hbi, true) >= 0) {
+            nb_bits++;
+        }
+    } while (g_test_timer_elapsed() < 1.0);
+
+    g_print("%s %s: iterate: %.2f Mbits/sec\n",
+            sparse ? "sparse" : "dense", pattern_name[pattern],
+            nb_bits / g_test_timer_last() / 1000000);
+    hbitmap_free(hb);
+}
+
+static void test_speed(void)
+{
+    Pattern pattern;
+    int sparse;
+
+    for (sparse = 0; sparse <= 1; sparse++) {
+        for (pattern = PATTERN_EMPTY; pattern <= PATTERN_FULL; pattern++) {
+            test_memory(pattern, sparse);
+        }
+        test_set_speed(sparse);
+        test_iter_speed(PATTERN_RANDOM, sparse);
+        test_iter_speed(PATTERN_SEQUENTIAL, sparse);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hbitmap/sparse/speed", test_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,112 @@
+/*
+ * qcow2 allocating write benchmark
+ *
+ * Fills a fresh image with several interleaved sequential writers, like a
+ * guest running a multi-job fio write, once without and once with host
+ * cluster reservations (alloc-reserve-size).  Each writer fills its own
+ * region of the disk and all writers are in flight at the same time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+
+#define MAX_WRITERS     8
+#define WRITE_SIZE      (64 * KiB)
+#define REGION_SIZE     (32 * MiB)
+
+static BlockBackend *blk;
+static int running;
+
+static void coroutine_fn writer_entry(void *opaque)
+{
+    int64_t start = (uintptr_t)opaque * REGION_SIZE;
+    void *buf = blk_blockalign(blk, WRITE_SIZE);
+    struct iovec iov = { .iov_base = buf, .iov_len = WRITE_SIZE };
+    QEMUIOVector qiov;
+    int64_t offset;
+    int ret;
+
+    memset(buf, 0x11, WRITE_SIZE);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    for (offset = start; offset < start + REGION_SIZE; offset += WRITE_SIZE) {
+        ret = blk_co_pwritev(blk, offset, WRITE_SIZE, &qiov, 0);
+        g_assert_cmpint(ret, ==, 0);
+    }
+
+    qemu_vfree(buf);
+    running--;
+}
+
+static void test_write_speed(const char *path, int nb_writers,
+                             const char *reserve_size)
+{
+    QDict *options = qdict_new();
+    int i;
+
+    bdrv_img_create(path, "qcow2", NULL, NULL, NULL,
+                    nb_writers * REGION_SIZE, 0, true, &error_abort);
+
+    qdict_put_str(options, "driver", "qcow2");
+    qdict_put_str(options, "alloc-reserve-size", reserve_size);
+    blk = blk_new_open(path, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    running = nb_writers;
+
+    g_test_timer_start();
+    for (i = 0; i < nb_writers; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(writer_entry,
+                                                   (void *)(uintptr_t)i));
+    }
+    while (running > 0) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(blk_flush(blk), ==, 0);
+    g_test_timer_elapsed();
+
+    g_print("%d writers, alloc-reserve-size=%s: %.2f MB/sec\n",
+            nb_writers, reserve_size,
+            nb_writers * REGION_SIZE / g_test_timer_last() / MiB);
+
+    blk_unref(blk);
+    blk = NULL;
+}
+
+static void test_speed(void)
+{
+    char *path;
+    int fd, n;
+
+    fd = g_file_open_tmp("qcow2-alloc-bench-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    for (n = 1; n <= MAX_WRITERS; n *= 2) {
+        test_write_speed(path, n, "0");
+        test_write_speed(path, n, "8M");
+    }
+
+    unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2/alloc/speed", test_speed);
+
+    return g_test_run();
+}
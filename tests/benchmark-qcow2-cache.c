@@ -0,0 +1,128 @@
+/*
+ * qcow2 metadata cache benchmark
+ *
+ * Issues 4 KiB reads at scattered offsets of a large image whose L2 tables
+ * are all allocated, once with an L2 cache that covers the whole image
+ * (every lookup hits one of a thousand cached tables) and once with a small
+ * cache (most lookups miss and evict a table).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+
+#define IMAGE_SIZE      (512 * GiB)
+#define REQUEST_SIZE    (4 * KiB)
+#define QUEUE_DEPTH     64
+
+/* A step of a large prime number of requests touches a different L2 table
+ * on almost every request */
+#define STEP            (1000003 * REQUEST_SIZE)
+
+static BlockBackend *blk;
+
+static bool now_stopping;
+static int running;
+static uint64_t nb_reads;
+static int64_t next_offset;
+
+static void coroutine_fn reader_entry(void *opaque)
+{
+    void *buf = blk_blockalign(blk, REQUEST_SIZE);
+    struct iovec iov = { .iov_base = buf, .iov_len = REQUEST_SIZE };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    while (!now_stopping) {
+        int64_t offset = next_offset;
+
+        next_offset = (next_offset + STEP) % IMAGE_SIZE;
+        ret = blk_co_preadv(blk, offset, REQUEST_SIZE, &qiov, 0);
+        g_assert_cmpint(ret, ==, 0);
+        nb_reads++;
+    }
+
+    qemu_vfree(buf);
+    running--;
+}
+
+static void test_read_speed(const char *path, const char *cache_size)
+{
+    QDict *options = qdict_new();
+    uint64_t total;
+    int i;
+
+    qdict_put_str(options, "driver", "qcow2");
+    qdict_put_str(options, "l2-cache-size", cache_size);
+    blk = blk_new_open(path, NULL, options, 0, &error_abort);
+
+    now_stopping = false;
+    running = QUEUE_DEPTH;
+    nb_reads = 0;
+    next_offset = 0;
+
+    g_test_timer_start();
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(reader_entry, NULL));
+    }
+    while (g_test_timer_elapsed() < 1.0) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    total = nb_reads;
+
+    now_stopping = true;
+    while (running > 0) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+
+    g_print("l2-cache-size=%s: %.2f kreads/sec\n",
+            cache_size, total / g_test_timer_last() / 1000);
+
+    blk_unref(blk);
+    blk = NULL;
+}
+
+static void test_speed(void)
+{
+    char *path, *options;
+    int fd;
+
+    fd = g_file_open_tmp("qcow2-cache-bench-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    /* preallocation=metadata allocates every L2 table, but the data
+     * clusters stay sparse in the host file */
+    options = g_strdup("preallocation=metadata");
+    bdrv_img_create(path, "qcow2", NULL, NULL, options, IMAGE_SIZE, 0, true,
+                    &error_abort);
+    g_free(options);
+
+    test_read_speed(path, "64M");
+    test_read_speed(path, "1M");
+
+    unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2/cache/speed", test_speed);
+
+    return g_test_run();
+}
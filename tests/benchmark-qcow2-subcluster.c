@@ -0,0 +1,124 @@
+/*
+ * qcow2 subcluster allocation benchmark
+ *
+ * Issues 4 KiB writes to an overlay of a fully allocated backing image,
+ * once without and once with extended L2 entries.  Every write lands in a
+ * new cluster, so without subclusters each one has to copy a whole cluster
+ * from the backing file, while with extended_l2=on only the affected
+ * subcluster is copied.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+
+#define CLUSTER_SIZE    (1 * MiB)
+#define NUM_WRITES      256
+#define IMAGE_SIZE      (NUM_WRITES * CLUSTER_SIZE)
+#define WRITE_SIZE      (4 * KiB)
+
+static BlockBackend *open_image(const char *path, const char *driver)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", driver);
+    return blk_new_open(path, NULL, options, BDRV_O_RDWR, &error_abort);
+}
+
+static void fill_base(const char *path)
+{
+    BlockBackend *blk = open_image(path, "raw");
+    void *buf = blk_blockalign(blk, CLUSTER_SIZE);
+    int64_t offset;
+
+    memset(buf, 0x11, CLUSTER_SIZE);
+    for (offset = 0; offset < IMAGE_SIZE; offset += CLUSTER_SIZE) {
+        g_assert_cmpint(blk_pwrite(blk, offset, buf, CLUSTER_SIZE, 0), ==,
+                        CLUSTER_SIZE);
+    }
+
+    qemu_vfree(buf);
+    blk_unref(blk);
+}
+
+static void test_write_speed(const char *path, const char *base,
+                             bool extended_l2)
+{
+    BlockBackend *blk;
+    struct stat st;
+    char *options;
+    void *buf;
+    int i;
+
+    options = g_strdup_printf("cluster_size=%" PRId64 ",extended_l2=%s",
+                              CLUSTER_SIZE, extended_l2 ? "on" : "off");
+    bdrv_img_create(path, "qcow2", base, "raw", options, IMAGE_SIZE, 0, true,
+                    &error_abort);
+    g_free(options);
+
+    blk = open_image(path, "qcow2");
+    buf = blk_blockalign(blk, WRITE_SIZE);
+    memset(buf, 0x22, WRITE_SIZE);
+
+    /* One write at a time, each in a cluster of its own */
+    g_test_timer_start();
+    for (i = 0; i < NUM_WRITES; i++) {
+        g_assert_cmpint(blk_pwrite(blk, (int64_t)i * CLUSTER_SIZE, buf,
+                                   WRITE_SIZE, 0), ==, WRITE_SIZE);
+    }
+    g_assert_cmpint(blk_flush(blk), ==, 0);
+    g_test_timer_elapsed();
+
+    qemu_vfree(buf);
+    blk_unref(blk);
+
+    g_assert_cmpint(stat(path, &st), ==, 0);
+    g_print("extended_l2=%s: %.2f kwrites/sec, image file size %" PRId64
+            " KiB\n", extended_l2 ? "on" : "off",
+            NUM_WRITES / g_test_timer_last() / 1000,
+            (int64_t)st.st_blocks * 512 / KiB);
+}
+
+static void test_speed(void)
+{
+    char *base, *path;
+    int fd;
+
+    fd = g_file_open_tmp("qcow2-subcluster-bench-base-XXXXXX", &base, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+    fd = g_file_open_tmp("qcow2-subcluster-bench-XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    bdrv_img_create(base, "raw", NULL, NULL, NULL, IMAGE_SIZE, 0, true,
+                    &error_abort);
+    fill_base(base);
+
+    test_write_speed(path, base, false);
+    test_write_speed(path, base, true);
+
+    unlink(path);
+    unlink(base);
+    g_free(path);
+    g_free(base);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2/subcluster/speed", test_speed);
+
+    return g_test_run();
+}
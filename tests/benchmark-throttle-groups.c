@@ -0,0 +1,162 @@
+/*
+ * Throttle group benchmark
+ *
+ * Many members of one throttle group, spread across iothreads, send 4 KiB
+ * reads through throttle_group_co_io_limits_intercept().  With limits that
+ * are far away, most requests use the credit of their member and do not
+ * take the group lock.  Setting iops-size below the request size makes every
+ * request go through the round-robin scheduler, as all requests used to.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "qemu/throttle.h"
+#include "block/throttle-groups.h"
+#include "iothread.h"
+
+#define NUM_CONTEXTS    4
+#define NUM_MEMBERS     64
+#define REQUEST_SIZE    (4 * KiB)
+
+typedef enum {
+    MODE_CREDIT,            /* limits far away */
+    MODE_LOCKED,            /* same limits, credit disabled by iops-size */
+    MODE_THROTTLED,         /* the group runs at its limit */
+} Mode;
+
+static const char *mode_name[] = {
+    [MODE_CREDIT] = "limits not reached",
+    [MODE_LOCKED] = "limits not reached, no credit",
+    [MODE_THROTTLED] = "throttled to 200000 iops",
+};
+
+static IOThread *threads[NUM_CONTEXTS];
+static ThrottleGroupMember members[NUM_MEMBERS];
+
+static bool now_stopping;
+static int running;
+static int nb_threads;
+static uint64_t nb_requests[NUM_CONTEXTS];
+
+static void coroutine_fn requester_entry(void *opaque)
+{
+    int id = (uintptr_t)opaque;
+    uint64_t n = 0;
+    int i = id;
+
+    /* Cycle through the members of this iothread */
+    while (!atomic_read(&now_stopping)) {
+        throttle_group_co_io_limits_intercept(&members[i], REQUEST_SIZE,
+                                              false);
+        i += nb_threads;
+        if (i >= NUM_MEMBERS) {
+            i = id;
+        }
+        n++;
+    }
+
+    nb_requests[id] = n;
+    atomic_dec(&running);
+}
+
+static void set_contexts(int n)
+{
+    int i;
+
+    for (i = 0; i < NUM_MEMBERS; i++) {
+        throttle_group_detach_aio_context(&members[i]);
+        throttle_group_attach_aio_context(&members[i],
+            iothread_get_aio_context(threads[i % n]));
+    }
+    nb_threads = n;
+}
+
+static void test_intercept_speed(Mode mode)
+{
+    ThrottleConfig cfg;
+    uint64_t total = 0;
+    int i;
+
+    throttle_config_init(&cfg);
+    if (mode == MODE_THROTTLED) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].avg = 200000;
+    } else {
+        cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1000000000;
+        cfg.buckets[THROTTLE_BPS_TOTAL].avg = 100 * TiB;
+    }
+    if (mode == MODE_LOCKED) {
+        cfg.op_size = REQUEST_SIZE / 2;
+    }
+    throttle_group_config(&members[0], &cfg);
+
+    now_stopping = false;
+    running = nb_threads;
+    for (i = 0; i < nb_threads; i++) {
+        Coroutine *co = qemu_coroutine_create(requester_entry,
+                                              (void *)(uintptr_t)i);
+        aio_co_schedule(iothread_get_aio_context(threads[i]), co);
+    }
+
+    g_test_timer_start();
+    while (g_test_timer_elapsed() < 1.0) {
+        g_usleep(10000);
+    }
+
+    atomic_mb_set(&now_stopping, true);
+    while (atomic_mb_read(&running) > 0) {
+        g_usleep(1000);
+    }
+    for (i = 0; i < nb_threads; i++) {
+        total += nb_requests[i];
+    }
+
+    g_print("%d iothreads, %d members, %s: %.2f Mreqs/sec\n",
+            nb_threads, NUM_MEMBERS, mode_name[mode],
+            total / g_test_timer_last() / 1000000);
+}
+
+static void test_speed(void)
+{
+    Mode mode;
+    int i, n;
+
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        threads[i] = iothread_new();
+    }
+    for (i = 0; i < NUM_MEMBERS; i++) {
+        throttle_group_register_tgm(&members[i], "bench",
+                                    iothread_get_aio_context(threads[0]));
+    }
+
+    for (n = 1; n <= NUM_CONTEXTS; n *= 2) {
+        set_contexts(n);
+        for (mode = MODE_CREDIT; mode <= MODE_THROTTLED; mode++) {
+            test_intercept_speed(mode);
+        }
+    }
+
+    for (i = 0; i < NUM_MEMBERS; i++) {
+        throttle_group_unregister_tgm(&members[i]);
+    }
+    for (i = 0; i < NUM_CONTEXTS; i++) {
+        iothread_join(threads[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle-groups/intercept/speed", test_speed);
+
+    return g_test_run();
+}
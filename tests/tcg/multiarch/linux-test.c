@@ -224,8 +224,9 @@ static void test_fork(void)
 static void test_time(void)
 {
     struct timeval tv, tv2;
-    struct timespec ts, rem;
+    struct timespec ts, rem, mono1, mono2;
     struct rusage rusg1, rusg2;
+    time_t t;
     int ti, i;
 
     chk_error(gettimeofday(&tv, NULL));
@@ -240,6 +241,21 @@ static void test_time(void)
     if (ti >= 2)
         error("gettimeofday");
 
+    chk_error(clock_gettime(CLOCK_MONOTONIC, &mono1));
+    for (i = 0; i < 1000; i++) {
+        chk_error(clock_gettime(CLOCK_MONOTONIC, &mono2));
+        if (mono2.tv_sec < mono1.tv_sec ||
+            (mono2.tv_sec == mono1.tv_sec && mono2.tv_nsec < mono1.tv_nsec)) {
+            error("clock_gettime");
+        }
+        mono1 = mono2;
+    }
+    t = time(NULL);
+    chk_error(gettimeofday(&tv, NULL));
+    if (tv.tv_sec < t) {
+        error("time");
+    }
+
     chk_error(getrusage(RUSAGE_SELF, &rusg1));
     for(i = 0;i < 10000; i++);
     chk_error(getrusage(RUSAGE_SELF, &rusg2));
@@ -0,0 +1,111 @@
+/*
+ * Signal delivery microbenchmark
+ *
+ * Measures the cost of delivering signals to the guest and of the
+ * sigprocmask() calls that garbage collector safepoints and profilers
+ * tend to make around them:
+ *
+ *  - a thread raising SIGUSR1 at itself in a tight loop
+ *  - blocking and unblocking SIGPROF in a tight loop
+ *  - a high frequency ITIMER_PROF while the guest spins
+ *
+ * Usage: sigstorm-bench [iterations]
+ *
+ * Like the other *-bench programs it is not run by check-tcg; use
+ * "make bench" in the tests build dir of a linux-user target.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+static volatile sig_atomic_t usr1_count;
+static volatile sig_atomic_t prof_count;
+
+static void usr1_handler(int sig)
+{
+    usr1_count++;
+}
+
+static void prof_handler(int sig)
+{
+    prof_count++;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, long n, double secs)
+{
+    printf("%-24s %8ld in %.3f s: %.0f/s\n", what, n, secs, n / secs);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    struct sigaction sa;
+    struct itimerval it;
+    sigset_t set;
+    double start, secs;
+    long i;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = usr1_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = prof_handler;
+    sigaction(SIGPROF, &sa, NULL);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        raise(SIGUSR1);
+    }
+    secs = now() - start;
+    if (usr1_count != iterations) {
+        fprintf(stderr, "lost signals: %ld of %ld delivered\n",
+                (long)usr1_count, iterations);
+        return 1;
+    }
+    report("raise(SIGUSR1)", iterations, secs);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        sigprocmask(SIG_BLOCK, &set, NULL);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+    }
+    secs = now() - start;
+    report("sigprocmask pairs", iterations, secs);
+
+    /* 10 kHz profiling timer for a fixed amount of spinning */
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 100;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+    start = now();
+    while (now() - start < 0.5) {
+        /* spin */
+    }
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    secs = now() - start;
+    report("SIGPROF while spinning", prof_count, secs);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Core dump test
+ *
+ * Without arguments, maps a large anonymous region, touches a few pages
+ * of it, prints its address and crashes.  With the name of the resulting
+ * core file and that address, checks that the region was dumped with the
+ * right contents and that its untouched pages are holes in the file.
+ *
+ * Usage: test-coredump
+ *        test-coredump <core file> <address>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __SIZEOF_POINTER__ == 8
+typedef Elf64_Ehdr Ehdr;
+typedef Elf64_Phdr Phdr;
+#else
+typedef Elf32_Ehdr Ehdr;
+typedef Elf32_Phdr Phdr;
+#endif
+
+/* Several core dump chunks, so that more than one thread gets work */
+#define REGION_SIZE (64 * 1024 * 1024)
+
+static long page_size;
+
+/* Touched pages: the first, one on either side of a chunk boundary and
+ * the last */
+static unsigned long touched_offset(int i)
+{
+    switch (i) {
+    case 0:
+        return 0;
+    case 1:
+        return 8 * 1024 * 1024 - page_size;
+    case 2:
+        return 8 * 1024 * 1024;
+    default:
+        return REGION_SIZE - page_size;
+    }
+}
+
+#define NR_TOUCHED 4
+
+static void fill_page(unsigned char *p, int i)
+{
+    long j;
+
+    for (j = 0; j < page_size; j++) {
+        p[j] = (j * 7 + i * 31) % 251 + 1;
+    }
+}
+
+static int crash(void)
+{
+    unsigned char *p;
+    int i;
+
+    p = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < NR_TOUCHED; i++) {
+        fill_page(p + touched_offset(i), i);
+    }
+
+    printf("%lx\n", (unsigned long)p);
+    fflush(stdout);
+
+    raise(SIGSEGV);
+    return EXIT_FAILURE;
+}
+
+static int check(const char *corefile, unsigned long addr)
+{
+    unsigned char *buf = malloc(page_size);
+    unsigned char *expected = malloc(page_size);
+    Ehdr ehdr;
+    Phdr phdr;
+    struct stat st;
+    unsigned long off;
+    off_t region_offset = -1;
+    int fd, i;
+
+    fd = open(corefile, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(corefile);
+        return EXIT_FAILURE;
+    }
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_type != ET_CORE) {
+        fprintf(stderr, "%s: not an ELF core file\n", corefile);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        if (pread(fd, &phdr, sizeof(phdr),
+                  ehdr.e_phoff + i * ehdr.e_phentsize) != sizeof(phdr)) {
+            perror("pread");
+            return EXIT_FAILURE;
+        }
+        if (phdr.p_type == PT_LOAD && phdr.p_vaddr <= addr &&
+            addr + REGION_SIZE <= phdr.p_vaddr + phdr.p_filesz) {
+            region_offset = phdr.p_offset + (addr - phdr.p_vaddr);
+            break;
+        }
+    }
+    if (region_offset < 0) {
+        fprintf(stderr, "region at 0x%lx was not dumped\n", addr);
+        return EXIT_FAILURE;
+    }
+
+    for (off = 0; off < REGION_SIZE; off += page_size) {
+        memset(expected, 0, page_size);
+        for (i = 0; i < NR_TOUCHED; i++) {
+            if (touched_offset(i) == off) {
+                fill_page(expected, i);
+            }
+        }
+        if (pread(fd, buf, page_size, region_offset + off) != page_size ||
+            memcmp(buf, expected, page_size)) {
+            fprintf(stderr, "wrong contents at offset 0x%lx\n", off);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Only the touched pages and the rest of the process are allocated */
+    if ((long long)st.st_blocks * 512 >= REGION_SIZE / 2) {
+        fprintf(stderr, "core file is not sparse: %lld bytes allocated\n",
+                (long long)st.st_blocks * 512);
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+    free(buf);
+    free(expected);
+    printf("core file ok\n");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+
+    if (argc == 3) {
+        return check(argv[1], strtoul(argv[2], NULL, 16));
+    }
+    return crash();
+}
@@ -0,0 +1,79 @@
+/*
+ * writev throughput microbenchmark
+ *
+ * Measures how fast the user-mode emulator can translate and issue
+ * vectored writes.  The data goes to /dev/null, so the time is dominated
+ * by the per-syscall overhead of the emulator rather than the host.
+ *
+ * Usage: writev-bench [iterations] [iovecs per call]
+ *
+ * Like the other *-bench programs it is not run by check-tcg; use
+ * "make bench" in the tests build dir of a linux-user target.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define MAX_IOV   1024
+#define CHUNK     64
+
+static char buf[MAX_IOV][CHUNK];
+static struct iovec iov[MAX_IOV];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    int niov = argc > 2 ? atoi(argv[2]) : 8;
+    double start, secs;
+    long i;
+    int fd;
+
+    if (iterations <= 0 || niov <= 0 || niov > MAX_IOV) {
+        fprintf(stderr, "usage: %s [iterations] [iovecs (1-%d)]\n",
+                argv[0], MAX_IOV);
+        return 1;
+    }
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < niov; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = CHUNK;
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        if (writev(fd, iov, niov) != niov * CHUNK) {
+            perror("writev");
+            return 1;
+        }
+    }
+    secs = now() - start;
+
+    printf("%ld writev calls of %d x %d bytes in %.3f s: "
+           "%.0f calls/s, %.1f MB/s\n",
+           iterations, niov, CHUNK, secs, iterations / secs,
+           iterations * (double)niov * CHUNK / secs / 1e6);
+    close(fd);
+    return 0;
+}
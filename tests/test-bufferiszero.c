@@ -58,13 +58,54 @@ static void test_1(void)
     }
 }
 
+static void test_find_nonzero(void)
+{
+    size_t s, a, o;
+
+    g_assert_cmpuint(buffer_find_nonzero_offset(buffer, sizeof(buffer)), ==,
+                     sizeof(buffer));
+
+    /* A marker far into the buffer is found past several skipped chunks.  */
+    buffer[sizeof(buffer) - 1] = 1;
+    g_assert_cmpuint(buffer_find_nonzero_offset(buffer, sizeof(buffer)), ==,
+                     sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    /* Markers outside the buffer are not found.  */
+    for (a = 1; a <= 64; a++) {
+        for (s = 1; s < 1024; s++) {
+            buffer[a - 1] = 1;
+            buffer[a + s] = 1;
+            g_assert_cmpuint(buffer_find_nonzero_offset(buffer + a, s), ==, s);
+            buffer[a - 1] = 0;
+            buffer[a + s] = 0;
+        }
+    }
+
+    /* The first of two markers is reported.  */
+    for (a = 1; a <= 64; a++) {
+        for (s = 1; s < 1024; s++) {
+            for (o = 0; o < s; ++o) {
+                buffer[a + o] = 1;
+                buffer[a + s - 1] = 1;
+                g_assert_cmpuint(buffer_find_nonzero_offset(buffer + a, s),
+                                 ==, o);
+                buffer[a + o] = 0;
+                buffer[a + s - 1] = 0;
+            }
+        }
+    }
+}
+
 static void test_2(void)
 {
     if (g_test_perf()) {
         test_1();
+        test_find_nonzero();
     } else {
         do {
             test_1();
+            test_find_nonzero();
         } while (test_buffer_is_zero_next_accel());
     }
 }
@@ -12,7 +12,9 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
+#include "qemu/thread.h"
 #include "block/block.h"
+#include "qapi/error.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -27,6 +29,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           sparse;
 } TestHBitmapData;
 
 
@@ -92,7 +95,11 @@ static void hbitmap_test_init(TestHBitmapData *data,
                               uint64_t size, int granularity)
 {
     size_t n;
-    data->hb = hbitmap_alloc(size, granularity);
+    if (data->sparse) {
+        data->hb = hbitmap_alloc_sparse(size, granularity);
+    } else {
+        data->hb = hbitmap_alloc(size, granularity);
+    }
 
     n = DIV_ROUND_UP(size, BITS_PER_LONG);
     if (n == 0) {
@@ -921,6 +928,21 @@ static void hbitmap_test_add(const char *testpath,
                hbitmap_test_teardown);
 }
 
+static void hbitmap_test_setup_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    data->sparse = true;
+}
+
+/* Same as hbitmap_test_add, but the test uses hbitmap_alloc_sparse */
+static void hbitmap_test_add_sparse(const char *testpath,
+                                    void (*test_func)(TestHBitmapData *data,
+                                                      const void *user_data))
+{
+    g_test_add(testpath, TestHBitmapData, NULL, hbitmap_test_setup_sparse,
+               test_func, hbitmap_test_teardown);
+}
+
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
                                         const void *unused)
 {
@@ -992,6 +1014,169 @@ static void test_hbitmap_next_zero_4(TestHBitmapData *data, const void *unused)
     test_hbitmap_next_zero_do(data, 4);
 }
 
+/* Check that @hb and @ref have the same bits set, starting at @first */
+static void hbitmap_test_compare(HBitmap *hb, HBitmap *ref, uint64_t first)
+{
+    HBitmapIter hbi, ref_hbi;
+    int64_t next;
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(ref));
+    hbitmap_iter_init(&hbi, hb, first);
+    hbitmap_iter_init(&ref_hbi, ref, first);
+    do {
+        next = hbitmap_iter_next(&ref_hbi, true);
+        g_assert_cmpint(hbitmap_iter_next(&hbi, true), ==, next);
+    } while (next >= 0);
+}
+
+static void test_hbitmap_set_atomic(TestHBitmapData *data,
+                                    const void *unused)
+{
+    HBitmap *ref;
+    HBitmapIter hbi;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    data->meta = hbitmap_create_meta(data->hb, BITS_PER_LONG);
+    ref = hbitmap_alloc(data->size, 0);
+
+    /* Bits and count are visible right away, the upper levels after a sync */
+    hbitmap_set_atomic(data->hb, L2 + 5, 3);
+    hbitmap_set(ref, L2 + 5, 3);
+    g_assert(hbitmap_get(data->hb, L2 + 6));
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 3);
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi, true), ==, L2 + 5);
+
+    hbitmap_set_atomic(data->hb, L3 - 7, L3);
+    hbitmap_set_atomic(data->hb, L3 - 10, 5);
+    hbitmap_set_atomic(data->hb, L2 + 5, 3);
+    hbitmap_set(ref, L3 - 10, L3 + 3);
+    g_assert(hbitmap_get(data->meta, L3));
+    hbitmap_test_compare(data->hb, ref, 0);
+
+    /* Mix with the non-atomic functions */
+    hbitmap_reset(data->hb, L3 - 4, 5);
+    hbitmap_reset(ref, L3 - 4, 5);
+    hbitmap_set_atomic(data->hb, L3 * 2 - 1, 1);
+    hbitmap_set(ref, L3 * 2 - 1, 1);
+    hbitmap_test_compare(data->hb, ref, L3 - L1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 10), ==, L3 - 4);
+
+    hbitmap_free(ref);
+}
+
+typedef struct TestSetAtomicThread {
+    HBitmap *hb;
+    int id;
+} TestSetAtomicThread;
+
+static void *test_hbitmap_set_atomic_thread(void *opaque)
+{
+    TestSetAtomicThread *t = opaque;
+    uint64_t i;
+
+    /* Each thread sets every fourth run of L1 + 1 bits, so that runs of
+     * different threads share words.
+     */
+    for (i = t->id * (L1 + 1); i + L1 + 1 <= L3; i += 4 * (L1 + 1)) {
+        hbitmap_set_atomic(t->hb, i, L1 + 1);
+    }
+    return NULL;
+}
+
+static void test_hbitmap_set_atomic_threads(TestHBitmapData *data,
+                                            const void *unused)
+{
+    TestSetAtomicThread t[4];
+    QemuThread threads[4];
+    int i;
+
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < 4; i++) {
+        t[i] = (TestSetAtomicThread) { .hb = data->hb, .id = i };
+        qemu_thread_create(&threads[i], "set-atomic",
+                           test_hbitmap_set_atomic_thread, &t[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < 4; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    hbitmap_test_set(data, 0, (L3 / (L1 + 1)) * (L1 + 1));
+}
+
+static void test_hbitmap_sparse_memory(TestHBitmapData *data,
+                                       const void *unused)
+{
+    uint64_t empty_size;
+
+    hbitmap_test_init(data, L3 * 4, 0);
+    empty_size = hbitmap_memory_size(data->hb);
+
+    /* Setting everything must not allocate the last level */
+    hbitmap_test_set(data, 0, data->size);
+    g_assert_cmpint(hbitmap_memory_size(data->hb), ==, empty_size);
+    hbitmap_test_check(data, 0);
+
+    /* A single hole needs one page... */
+    hbitmap_test_reset(data, L3 + 17, 1);
+    g_assert_cmpint(hbitmap_memory_size(data->hb), >, empty_size);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, L3 + 17);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 + 18), ==, -1);
+
+    /* ... which is freed as soon as it becomes empty */
+    hbitmap_test_reset(data, 0, data->size);
+    g_assert_cmpint(hbitmap_memory_size(data->hb), ==, empty_size);
+
+    hbitmap_test_set(data, L2 * 3, 1);
+    hbitmap_test_set(data, L3 * 3 + 5, L2);
+    hbitmap_test_reset(data, L2 * 3, 1);
+    hbitmap_test_reset(data, L3 * 3 + 5, L2);
+    g_assert_cmpint(hbitmap_memory_size(data->hb), ==, empty_size);
+}
+
+static void test_hbitmap_sparse_dense(TestHBitmapData *data,
+                                      const void *unused)
+{
+    HBitmap *dense, *merged;
+    char *dense_hash, *sparse_hash;
+    uint8_t *buf;
+    uint64_t buf_size;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    dense = hbitmap_alloc(data->size, 0);
+
+    hbitmap_set(dense, 0, L3 - 3);
+    hbitmap_set(dense, L3 + L1 * 7, L2 + 9);
+    hbitmap_test_set(data, L3 - 100, L3);
+
+    /* Merging is possible in both directions */
+    merged = hbitmap_alloc(data->size, 0);
+    g_assert(hbitmap_merge(dense, data->hb, merged));
+    g_assert(hbitmap_merge(data->hb, dense, data->hb));
+    g_assert_cmpint(hbitmap_count(merged), ==, hbitmap_count(data->hb));
+
+    /* The hash does not depend on the representation */
+    dense_hash = hbitmap_sha256(merged, &error_abort);
+    sparse_hash = hbitmap_sha256(data->hb, &error_abort);
+    g_assert_cmpstr(dense_hash, ==, sparse_hash);
+
+    /* Neither does the serialized format */
+    buf_size = hbitmap_serialization_size(merged, 0, data->size);
+    buf = g_malloc0(buf_size);
+    hbitmap_serialize_part(merged, buf, 0, data->size);
+    hbitmap_reset_all(data->hb);
+    hbitmap_deserialize_part(data->hb, buf, 0, data->size, true);
+    g_assert_cmpint(hbitmap_count(merged), ==, hbitmap_count(data->hb));
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, L3 * 2 - 100);
+
+    g_free(buf);
+    g_free(dense_hash);
+    g_free(sparse_hash);
+    hbitmap_free(merged);
+    hbitmap_free(dense);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1058,6 +1243,43 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_zero/next_zero_4",
                      test_hbitmap_next_zero_4);
 
+    hbitmap_test_add("/hbitmap/set/atomic", test_hbitmap_set_atomic);
+    hbitmap_test_add("/hbitmap/set/atomic-threads",
+                     test_hbitmap_set_atomic_threads);
+
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/atomic",
+                            test_hbitmap_set_atomic);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/atomic-threads",
+                            test_hbitmap_set_atomic_threads);
+    hbitmap_test_add_sparse("/hbitmap/sparse/iter/partial",
+                            test_hbitmap_iter_partial);
+    hbitmap_test_add_sparse("/hbitmap/sparse/iter/granularity",
+                            test_hbitmap_iter_granularity);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/all", test_hbitmap_set_all);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/general", test_hbitmap_set);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/overlap",
+                            test_hbitmap_set_overlap);
+    hbitmap_test_add_sparse("/hbitmap/sparse/reset/general",
+                            test_hbitmap_reset);
+    hbitmap_test_add_sparse("/hbitmap/sparse/reset/all",
+                            test_hbitmap_reset_all);
+    hbitmap_test_add_sparse("/hbitmap/sparse/truncate/grow/large",
+                            test_hbitmap_truncate_grow_large);
+    hbitmap_test_add_sparse("/hbitmap/sparse/truncate/shrink/large",
+                            test_hbitmap_truncate_shrink_large);
+    hbitmap_test_add_sparse("/hbitmap/sparse/meta/sector",
+                            test_hbitmap_meta_sector);
+    hbitmap_test_add_sparse("/hbitmap/sparse/serialize/part",
+                            test_hbitmap_serialize_part);
+    hbitmap_test_add_sparse("/hbitmap/sparse/serialize/zeroes",
+                            test_hbitmap_serialize_zeroes);
+    hbitmap_test_add_sparse("/hbitmap/sparse/next_zero/next_zero_0",
+                            test_hbitmap_next_zero_0);
+    hbitmap_test_add_sparse("/hbitmap/sparse/memory",
+                            test_hbitmap_sparse_memory);
+    hbitmap_test_add_sparse("/hbitmap/sparse/dense",
+                            test_hbitmap_sparse_dense);
+
     g_test_run();
 
     return 0;
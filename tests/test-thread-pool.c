@@ -222,6 +222,58 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static void test_params(void)
+{
+    WorkerTestData data[10];
+    ThreadPoolStats stats;
+    uint64_t requests, sum;
+    int i;
+
+    thread_pool_get_stats(pool, &stats);
+    requests = stats.requests;
+
+    /* The minimum number of workers is started right away */
+    aio_context_set_thread_pool_params(ctx, 4, 4, &error_abort);
+    thread_pool_get_stats(pool, &stats);
+    g_assert_cmpint(stats.min_threads, ==, 4);
+    g_assert_cmpint(stats.max_threads, ==, 4);
+    g_assert_cmpint(stats.cur_threads, >=, 4);
+
+    /* Completions are accounted for in the statistics */
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, worker_cb, &data[i], done_cb, &data[i]);
+        active++;
+    }
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    thread_pool_get_stats(pool, &stats);
+    g_assert_cmpint(stats.queue_depth, ==, 0);
+    g_assert_cmpuint(stats.requests, ==, requests + ARRAY_SIZE(data));
+    for (i = 0, sum = 0; i < THREAD_POOL_LATENCY_BINS; i++) {
+        sum += stats.latency_bins[i];
+    }
+    g_assert_cmpuint(sum, ==, stats.requests);
+
+    aio_context_set_thread_pool_params(ctx, 0, THREAD_POOL_MAX_THREADS_DEFAULT,
+                                       &error_abort);
+}
+
+static void test_params_invalid(void)
+{
+    Error *local_err = NULL;
+
+    aio_context_set_thread_pool_params(ctx, 2, 1, &local_err);
+    error_free_or_abort(&local_err);
+    aio_context_set_thread_pool_params(ctx, 0, 0, &local_err);
+    error_free_or_abort(&local_err);
+    aio_context_set_thread_pool_params(ctx, -1, 1, &local_err);
+    error_free_or_abort(&local_err);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_abort);
@@ -235,6 +287,8 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/params", test_params);
+    g_test_add_func("/thread-pool/params-invalid", test_params_invalid);
 
     return g_test_run();
 }
@@ -141,6 +141,62 @@ static void test_compute_wait(void)
     }
 }
 
+static void test_headroom(void)
+{
+    uint64_t ops, bytes;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_READ].avg = 100;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 10000;
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* without bkt.max, a tenth of bkt.avg can be done at once */
+    throttle_headroom(&ts, false, &ops, &bytes);
+    g_assert_cmpint(ops, ==, 10);
+    g_assert_cmpint(bytes, ==, 1000);
+
+    /* writes have no limit */
+    throttle_headroom(&ts, true, &ops, &bytes);
+    g_assert(ops == UINT64_MAX);
+    g_assert(bytes == UINT64_MAX);
+
+    throttle_account_batch(&ts, false, 4, 600, false);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 4));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 600));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    throttle_headroom(&ts, false, &ops, &bytes);
+    g_assert_cmpint(ops, ==, 6);
+    g_assert_cmpint(bytes, ==, 400);
+
+    /* the whole headroom can be used before having to wait */
+    throttle_account_batch(&ts, false, 6, 400, false);
+    g_assert(!throttle_compute_wait(&ts.cfg.buckets[THROTTLE_OPS_READ]));
+    g_assert(!throttle_compute_wait(&ts.cfg.buckets[THROTTLE_BPS_READ]));
+    throttle_account(&ts, false, 512);
+    g_assert(throttle_compute_wait(&ts.cfg.buckets[THROTTLE_OPS_READ]));
+    g_assert(throttle_compute_wait(&ts.cfg.buckets[THROTTLE_BPS_READ]));
+    throttle_headroom(&ts, false, &ops, &bytes);
+    g_assert_cmpint(ops, ==, 0);
+    g_assert_cmpint(bytes, ==, 0);
+
+    /* giving back more than was accounted empties the buckets */
+    throttle_account_batch(&ts, false, 100, 10000, true);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 0));
+
+    /* the burst bucket limits the headroom too */
+    cfg.buckets[THROTTLE_OPS_READ].max = 200;
+    cfg.buckets[THROTTLE_OPS_READ].burst_length = 2;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    throttle_headroom(&ts, false, &ops, &bytes);
+    g_assert_cmpint(ops, ==, 20);
+    throttle_account_batch(&ts, false, 5, 0, false);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].burst_level, 5));
+    throttle_headroom(&ts, false, &ops, &bytes);
+    g_assert_cmpint(ops, ==, 15);
+}
+
 /* functions to test ThrottleState initialization/destroy methods */
 static void read_timer_cb(void *opaque)
 {
@@ -734,6 +790,64 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+static void coroutine_fn read_intercept_entry(void *opaque)
+{
+    throttle_group_co_io_limits_intercept(opaque, 4096, false);
+}
+
+static void test_group_credit(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1;
+    ThrottleGroupMember *tgm1;
+    unsigned int credit;
+    double level;
+
+    blk1 = blk_new(0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "credit", blk_get_aio_context(blk1));
+
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_READ].avg = 1000;
+    throttle_group_config(tgm1, &cfg1);
+
+    /* The first request takes the lock and gets credit for half of what
+     * the group can still do before throttling (100 - 1 operations) */
+    qemu_coroutine_enter(qemu_coroutine_create(read_intercept_entry, tgm1));
+    credit = atomic_read(&tgm1->credit_ops[0]);
+    g_assert_cmpuint(credit, ==, 49);
+    g_assert_cmpuint(atomic_read(&tgm1->credit_ops[1]), ==, 0);
+
+    /* The credit is already accounted, together with the first request */
+    throttle_group_get_config(tgm1, &cfg1);
+    level = cfg1.buckets[THROTTLE_OPS_READ].level;
+    g_assert(double_cmp(level, credit + 1));
+
+    /* Requests that use it do not change the bucket */
+    while (credit--) {
+        qemu_coroutine_enter(qemu_coroutine_create(read_intercept_entry,
+                                                   tgm1));
+        g_assert_cmpuint(atomic_read(&tgm1->credit_ops[0]), ==, credit);
+    }
+    throttle_group_get_config(tgm1, &cfg1);
+    g_assert(double_cmp(cfg1.buckets[THROTTLE_OPS_READ].level, level));
+
+    /* A new configuration drops the credit */
+    qemu_coroutine_enter(qemu_coroutine_create(read_intercept_entry, tgm1));
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_READ].avg = 2000;
+    throttle_group_config(tgm1, &cfg1);
+    g_assert_cmpuint(atomic_read(&tgm1->credit_ops[0]), ==, 0);
+
+    /* Let throttle_group_config() restart the (empty) queues */
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+
+    throttle_group_unregister_tgm(tgm1);
+    blk_unref(blk1);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -747,6 +861,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
     g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/headroom",           test_headroom);
     g_test_add_func("/throttle/init",               test_init);
     g_test_add_func("/throttle/destroy",            test_destroy);
     g_test_add_func("/throttle/have_timer",         test_have_timer);
@@ -761,6 +876,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/credit",      test_group_credit);
     return g_test_run();
 }
 
@@ -277,6 +277,14 @@ aio_ctx_finalize(GSource     *source)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring) {
+        luring_detach_aio_context(ctx->linux_io_uring, ctx);
+        luring_cleanup(ctx->linux_io_uring);
+        ctx->linux_io_uring = NULL;
+    }
+#endif
+
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
@@ -296,6 +304,7 @@ aio_ctx_finalize(GSource     *source)
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
     qemu_rec_mutex_destroy(&ctx->lock);
+    qemu_mutex_destroy(&ctx->thread_pool_lock);
     qemu_lockcnt_destroy(&ctx->list_lock);
     timerlistgroup_deinit(&ctx->tlg);
     aio_context_destroy(ctx);
@@ -316,10 +325,57 @@ GSource *aio_get_g_source(AioContext *ctx)
 
 ThreadPool *aio_get_thread_pool(AioContext *ctx)
 {
-    if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_new(ctx);
+    ThreadPool *pool = atomic_mb_read(&ctx->thread_pool);
+
+    if (!pool) {
+        qemu_mutex_lock(&ctx->thread_pool_lock);
+        pool = ctx->thread_pool;
+        if (!pool) {
+            pool = thread_pool_new(ctx);
+            atomic_mb_set(&ctx->thread_pool, pool);
+        }
+        qemu_mutex_unlock(&ctx->thread_pool_lock);
+    }
+    return pool;
+}
+
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp)
+{
+    ThreadPool *pool;
+
+    if (min < 0 || max <= 0 || min > max || max > INT_MAX) {
+        error_setg(errp, "thread-pool-min must be in range [0, "
+                   "thread-pool-max] and thread-pool-max in range [1, %d]",
+                   INT_MAX);
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->thread_pool_lock);
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+
+    /* A pool created after this point starts with the new values */
+    pool = ctx->thread_pool;
+    if (pool) {
+        thread_pool_update_params(pool, ctx);
+    }
+    qemu_mutex_unlock(&ctx->thread_pool_lock);
+}
+
+void aio_context_set_thread_pool_affinity(AioContext *ctx,
+                                          const unsigned long *host_cpus)
+{
+    ThreadPool *pool;
+
+    qemu_mutex_lock(&ctx->thread_pool_lock);
+    bitmap_copy(ctx->thread_pool_cpus, host_cpus, THREAD_POOL_MAX_CPUS);
+
+    pool = ctx->thread_pool;
+    if (pool) {
+        thread_pool_update_params(pool, ctx);
     }
-    return ctx->thread_pool;
+    qemu_mutex_unlock(&ctx->thread_pool_lock);
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -341,6 +397,25 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+{
+    if (!ctx->linux_io_uring) {
+        ctx->linux_io_uring = luring_init(errp);
+        if (ctx->linux_io_uring) {
+            luring_attach_aio_context(ctx->linux_io_uring, ctx);
+        }
+    }
+    return ctx->linux_io_uring;
+}
+
+LuringState *aio_get_linux_io_uring(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring);
+    return ctx->linux_io_uring;
+}
+#endif
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -431,6 +506,9 @@ AioContext *aio_context_new(Error **errp)
                            event_notifier_poll);
 #ifdef CONFIG_LINUX_AIO
     ctx->linux_aio = NULL;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    ctx->linux_io_uring = NULL;
 #endif
     ctx->thread_pool = NULL;
     qemu_rec_mutex_init(&ctx->lock);
@@ -441,6 +519,11 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
 
+    qemu_mutex_init(&ctx->thread_pool_lock);
+    ctx->thread_pool_min = 0;
+    ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    bitmap_zero(ctx->thread_pool_cpus, THREAD_POOL_MAX_CPUS);
+
     return ctx;
 fail:
     g_source_destroy(&ctx->source);
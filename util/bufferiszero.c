@@ -186,14 +186,51 @@ buffer_zero_avx2(const void *buf, size_t len)
     return _mm256_testz_si256(t, t);
 }
 #pragma GCC pop_options
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+/* Note that this function requires len >= 256.  */
+
+static bool
+buffer_zero_avx512(const void *buf, size_t len)
+{
+    /* Begin with an unaligned head of 64 bytes.  */
+    __m512i t = _mm512_loadu_si512(buf);
+    __m512i *p = (__m512i *)(((uintptr_t)buf + 5 * 64) & -64);
+    __m512i *e = (__m512i *)(((uintptr_t)buf + len) & -64);
+
+    /* Loop over 64-byte aligned blocks of 256.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(_mm512_test_epi64_mask(t, t))) {
+            return false;
+        }
+        t = p[-4] | p[-3] | p[-2] | p[-1];
+        p += 4;
+    }
+
+    /* Finish the last block of 256 unaligned.  */
+    t |= _mm512_loadu_si512(buf + len - 4 * 64);
+    t |= _mm512_loadu_si512(buf + len - 3 * 64);
+    t |= _mm512_loadu_si512(buf + len - 2 * 64);
+    t |= _mm512_loadu_si512(buf + len - 1 * 64);
+
+    return !_mm512_test_epi64_mask(t, t);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
 #endif /* CONFIG_AVX2_OPT */
 
 /* Note that for test_buffer_is_zero_next_accel, the most preferred
  * ISA must have the least significant bit.
  */
-#define CACHE_AVX2    1
-#define CACHE_SSE4    2
-#define CACHE_SSE2    4
+#define CACHE_AVX512F 1
+#define CACHE_AVX2    2
+#define CACHE_SSE4    4
+#define CACHE_SSE2    8
 
 /* Make sure that these variables are appropriately initialized when
  * SSE2 is enabled on the compiler command-line, but the compiler is
@@ -210,15 +247,65 @@ buffer_zero_avx2(const void *buf, size_t len)
 # define INIT_ACCEL buffer_zero_sse2
 #endif
 
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/* Advanced SIMD is mandatory on AArch64, so there is no need to probe
+ * for it; it is still registered as an accelerator so that the integer
+ * fallback can be tested as well.
+ */
+static bool
+buffer_zero_neon(const void *buf, size_t len)
+{
+    uint64x2_t t = vreinterpretq_u64_u8(vld1q_u8(buf));
+    const uint64x2_t *p = (uint64x2_t *)(((uintptr_t)buf + 5 * 16) & -16);
+    const uint64x2_t *e = (uint64x2_t *)(((uintptr_t)buf + len) & -16);
+
+    /* Loop over 16-byte aligned blocks of 64.  */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(vmaxvq_u32(vreinterpretq_u32_u64(t)))) {
+            return false;
+        }
+        t = vorrq_u64(vorrq_u64(p[-4], p[-3]), vorrq_u64(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the aligned tail.  */
+    t = vorrq_u64(t, e[-3]);
+    t = vorrq_u64(t, e[-2]);
+    t = vorrq_u64(t, e[-1]);
+
+    /* Finish the unaligned tail.  */
+    t = vorrq_u64(t, vreinterpretq_u64_u8(vld1q_u8(buf + len - 16)));
+
+    return vmaxvq_u32(vreinterpretq_u32_u64(t)) == 0;
+}
+
+#define CACHE_NEON    1
+
+#define INIT_CACHE CACHE_NEON
+#define INIT_ACCEL buffer_zero_neon
+#endif
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__) || defined(__aarch64__)
 static unsigned cpuid_cache = INIT_CACHE;
 static bool (*buffer_accel)(const void *, size_t) = INIT_ACCEL;
+static size_t length_to_accel = 64;
 
 static void init_accel(unsigned cache)
 {
     bool (*fn)(const void *, size_t) = buffer_zero_int;
+    size_t len = 64;
+#ifdef __aarch64__
+    if (cache & CACHE_NEON) {
+        fn = buffer_zero_neon;
+    }
+#else
     if (cache & CACHE_SSE2) {
         fn = buffer_zero_sse2;
     }
+#endif
 #ifdef CONFIG_AVX2_OPT
     if (cache & CACHE_SSE4) {
         fn = buffer_zero_sse4;
@@ -226,8 +313,15 @@ static void init_accel(unsigned cache)
     if (cache & CACHE_AVX2) {
         fn = buffer_zero_avx2;
     }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512F) {
+        fn = buffer_zero_avx512;
+        len = 256;
+    }
 #endif
     buffer_accel = fn;
+    length_to_accel = len;
 }
 
 #ifdef CONFIG_AVX2_OPT
@@ -256,6 +350,14 @@ static void __attribute__((constructor)) init_cpuid_cache(void)
             if ((bv & 6) == 6 && (b & bit_AVX2)) {
                 cache |= CACHE_AVX2;
             }
+            /* 0xe6:
+             *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
+             *                    and ZMM16-ZMM31 state are enabled by OS)
+             *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
+             */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                cache |= CACHE_AVX512F;
+            }
         }
     }
     cpuid_cache = cache;
@@ -278,7 +380,7 @@ bool test_buffer_is_zero_next_accel(void)
 
 static bool select_accel_fn(const void *buf, size_t len)
 {
-    if (likely(len >= 64)) {
+    if (likely(len >= length_to_accel)) {
         return buffer_accel(buf, len);
     }
     return buffer_zero_int(buf, len);
@@ -308,3 +410,40 @@ bool buffer_is_zero(const void *buf, size_t len)
        includes a check for an unrolled loop over 64-bit integers.  */
     return select_accel_fn(buf, len);
 }
+
+/* Granularity at which buffer_find_nonzero_offset() skips zero data with
+ * the accelerated check before narrowing down on a non-zero chunk.
+ */
+#define BUFFER_FIND_CHUNK  4096
+
+/*
+ * Returns the offset of the first non-zero byte in the buffer, or @len if
+ * the buffer is all zeroes.  The result is thus also the length of the zero
+ * run at the start of the buffer.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t i, n;
+
+    /* Skip whole chunks of zeroes at the speed of the accelerator.  */
+    for (i = 0; i < len; i += n) {
+        n = MIN(len - i, BUFFER_FIND_CHUNK);
+        if (!buffer_is_zero(p + i, n)) {
+            break;
+        }
+    }
+    if (i == len) {
+        return len;
+    }
+
+    /* The chunk at i has a non-zero byte; narrow down to a 64-byte block,
+       then to the byte itself.  */
+    while (buffer_is_zero(p + i, MIN(len - i, 64))) {
+        i += 64;
+    }
+    while (!p[i]) {
+        i++;
+    }
+    return i;
+}
@@ -11,7 +11,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/stats64.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -50,8 +52,37 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level is by far the largest, so it is split in pages of
+ * HB_PAGE_LONGS words.  A bitmap created with hbitmap_alloc() allocates all
+ * of its pages up front.  A sparse bitmap (hbitmap_alloc_sparse()) instead
+ * represents a page that has no bits set with a NULL pointer and a page that
+ * has all bits set with HB_FULL_PAGE; only pages that mix set and clear bits
+ * take memory.  The upper levels, which are 1/BITS_PER_LONG of the size of
+ * the last level, are always allocated.  A multi-terabyte disk that is only
+ * dirty in a few places, or that is mostly dirty in long runs, thus costs
+ * very little memory even at a fine granularity.
+ *
+ * hbitmap_set_atomic() lets several threads set bits at the same time, as
+ * long as nothing else accesses the bitmap concurrently.  It only touches the
+ * last level, using atomic fetch-and-or on its words.  When a word goes from
+ * zero to nonzero, the page that contains it is marked as stale; the upper
+ * levels of stale pages are brought up to date by the next function that
+ * needs them, such as hbitmap_iter_init() or hbitmap_reset().  Words that
+ * already had bits set do not need any bookkeeping, so repeated writes to
+ * the same region only cost one atomic operation per word.
  */
 
+#define HB_PAGE_SHIFT       9
+#define HB_PAGE_LONGS       (1ULL << HB_PAGE_SHIFT)
+
+/* Number of words in the 2nd-last level that describe one page.  */
+#define HB_PAGE_UPPER_LONGS (HB_PAGE_LONGS >> BITS_PER_LEVEL)
+
+/* Marker for a page of a sparse bitmap that has all bits set.  */
+static unsigned long hb_full_page_marker;
+#define HB_FULL_PAGE        (&hb_full_page_marker)
+
 struct HBitmap {
     /* Number of total bits in the bottom level.  */
     uint64_t size;
@@ -88,14 +119,142 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level is
+     * not stored here but in @pages.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each levels[] array, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* The last level, in pages of HB_PAGE_LONGS words.  In a sparse bitmap
+     * a page can also be NULL (all zeroes) or HB_FULL_PAGE (all ones).
+     */
+    unsigned long **pages;
+    uint64_t nb_pages;
+
+    /* Number of pages that are actually allocated.  */
+    size_t allocated_pages;
+
+    /* Bits set by hbitmap_set_atomic(), and how many of them were already
+     * added to @count.  @atomic_count is never reset while the bitmap can
+     * be set concurrently, so that no addition is lost.
+     */
+    Stat64 atomic_count;
+    uint64_t atomic_synced;
+
+    /* One bit per page whose upper levels may be out of date because
+     * hbitmap_set_atomic() turned one of its words from zero to nonzero,
+     * and whether any such bit is set.
+     */
+    unsigned long *stale_pages;
+    bool stale;
+
+    /* True if empty and full pages are freed.  */
+    bool sparse;
 };
 
+/* Return word @pos of the last level.  */
+static inline unsigned long hb_last_word(const HBitmap *hb, uint64_t pos)
+{
+    unsigned long *page = hb->pages[pos >> HB_PAGE_SHIFT];
+
+    if (!page) {
+        return 0;
+    } else if (page == HB_FULL_PAGE) {
+        return ~0UL;
+    }
+    return page[pos & (HB_PAGE_LONGS - 1)];
+}
+
+/* Return word @pos of @level.  */
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_last_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Replace page @idx of the last level with @page, which may also be NULL or
+ * HB_FULL_PAGE.  The previous page is freed.
+ */
+static void hb_page_replace(HBitmap *hb, uint64_t idx, unsigned long *page)
+{
+    unsigned long *old = hb->pages[idx];
+
+    if (old && old != HB_FULL_PAGE) {
+        g_free(old);
+        hb->allocated_pages--;
+    }
+    if (page && page != HB_FULL_PAGE) {
+        hb->allocated_pages++;
+    }
+    hb->pages[idx] = page;
+}
+
+/* Return a pointer to word @pos of @level, allocating the page that contains
+ * it if needed.  If the word lives in a page that only consists of copies of
+ * @skip, return NULL instead: an operation that leaves the word equal to
+ * @skip has nothing to do in that case.
+ */
+static unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos,
+                                  unsigned long skip)
+{
+    uint64_t idx = pos >> HB_PAGE_SHIFT;
+    unsigned long *page;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    page = hb->pages[idx];
+    if (!page || page == HB_FULL_PAGE) {
+        if ((!page && skip == 0) || (page && skip == ~0UL)) {
+            return NULL;
+        }
+        page = g_new(unsigned long, HB_PAGE_LONGS);
+        memset(page, hb->pages[idx] ? 0xff : 0,
+               HB_PAGE_LONGS * sizeof(unsigned long));
+        hb_page_replace(hb, idx, page);
+    }
+    return &page[pos & (HB_PAGE_LONGS - 1)];
+}
+
+/* Set words [@from, @to) of @level to @value, which is either 0 or ~0UL.
+ * Returns true if the level above may have to change, i.e. if any of the
+ * words was zero (when setting) or nonzero (when resetting).
+ */
+static bool hb_fill_words(HBitmap *hb, int level, uint64_t from, uint64_t to,
+                          unsigned long value)
+{
+    bool changed = false;
+    unsigned long *word;
+
+    while (from < to) {
+        if (hb->sparse && level == HBITMAP_LEVELS - 1 &&
+            !(from & (HB_PAGE_LONGS - 1)) && to - from >= HB_PAGE_LONGS) {
+            uint64_t idx = from >> HB_PAGE_SHIFT;
+            unsigned long *page = value ? HB_FULL_PAGE : NULL;
+
+            changed |= hb->pages[idx] != page;
+            hb_page_replace(hb, idx, page);
+            from += HB_PAGE_LONGS;
+            continue;
+        }
+
+        word = hb_word_ptr(hb, level, from, value);
+        if (word) {
+            changed |= value ? *word == 0 : *word != 0;
+            *word = value;
+        }
+        from++;
+    }
+    return changed;
+}
+
+static void hb_sync(const HBitmap *hb);
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -131,7 +290,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -144,7 +303,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi, bool advance)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_last_word(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -170,6 +329,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     unsigned i, bit;
     uint64_t pos;
 
+    hb_sync(hb);
     hbi->hb = hb;
     pos = first >> hb->granularity;
     assert(pos < hb->size);
@@ -181,7 +341,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -195,9 +355,8 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
     uint64_t sz = hb->sizes[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur = hb_last_word(hb, pos);
     unsigned start_bit_offset =
             (start >> hb->granularity) & (BITS_PER_LONG - 1);
     int64_t res;
@@ -208,13 +367,18 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            /* Full pages of a sparse bitmap can be skipped at once.  */
+            while (pos < sz && !(pos & (HB_PAGE_LONGS - 1)) &&
+                   hb->pages[pos >> HB_PAGE_SHIFT] == HB_FULL_PAGE) {
+                pos += HB_PAGE_LONGS;
+            }
+        } while (pos < sz && hb_last_word(hb, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_last_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -233,7 +397,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
 
 bool hbitmap_empty(const HBitmap *hb)
 {
-    return hb->count == 0;
+    return hb->count == 0 &&
+           stat64_get(&hb->atomic_count) == hb->atomic_synced;
 }
 
 int hbitmap_granularity(const HBitmap *hb)
@@ -243,7 +408,8 @@ int hbitmap_granularity(const HBitmap *hb)
 
 uint64_t hbitmap_count(const HBitmap *hb)
 {
-    return hb->count << hb->granularity;
+    return (hb->count + stat64_get(&hb->atomic_count) - hb->atomic_synced)
+           << hb->granularity;
 }
 
 /* Count the number of set bits between start and end, not accounting for
@@ -294,6 +460,15 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
     return old != *elem;
 }
 
+/* Apply hb_set_elem to word @pos of @level.  */
+static bool hb_set_word(HBitmap *hb, int level, uint64_t pos,
+                        uint64_t start, uint64_t last)
+{
+    unsigned long *elem = hb_word_ptr(hb, level, pos, ~0UL);
+
+    return elem && hb_set_elem(elem, start, last);
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
@@ -302,23 +477,14 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
-    size_t i;
 
-    i = pos;
-    if (i < lastpos) {
+    if (pos < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
-        }
+        changed |= hb_set_word(hb, level, pos, start, next - 1);
+        changed |= hb_fill_words(hb, level, pos + 1, lastpos, ~0UL);
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_word(hb, level, lastpos, start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -329,6 +495,25 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     return changed;
 }
 
+/* Turn the pages of a sparse bitmap that are entirely covered by the bits
+ * @first to @last into full pages.  Pages in the middle of the range already
+ * were replaced by hb_fill_words, so only the two at the edges are checked.
+ */
+static void hb_collapse_full_pages(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    uint64_t page_bits = HB_PAGE_LONGS << BITS_PER_LEVEL;
+    uint64_t idx[2] = { first / page_bits, last / page_bits };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (idx[i] * page_bits >= first &&
+            (idx[i] + 1) * page_bits - 1 <= last &&
+            (idx[i] + 1) * HB_PAGE_LONGS <= hb->sizes[HBITMAP_LEVELS - 1]) {
+            hb_page_replace(hb, idx[i], HB_FULL_PAGE);
+        }
+    }
+}
+
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -343,13 +528,170 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
     n = last - first + 1;
 
+    hb_sync(hb);
     hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        if (hb->sparse) {
+            hb_collapse_full_pages(hb, first, last);
+        }
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
+    }
+}
+
+/* Mark page @idx as needing an update of the upper levels.  */
+static void hb_mark_stale(HBitmap *hb, uint64_t idx)
+{
+    unsigned long *p = &hb->stale_pages[BIT_WORD(idx)];
+
+    if (!(atomic_read(p) & BIT_MASK(idx))) {
+        atomic_or(p, BIT_MASK(idx));
+    }
+    if (!atomic_read(&hb->stale)) {
+        atomic_set(&hb->stale, true);
+    }
+}
+
+/* Return page @idx of the last level for hbitmap_set_atomic(), allocating it
+ * if it is empty.  Another thread may be doing the same, so the new page is
+ * installed with a compare-and-swap.
+ */
+static unsigned long *hb_page_get_atomic(HBitmap *hb, uint64_t idx)
+{
+    unsigned long *page = atomic_rcu_read(&hb->pages[idx]);
+    unsigned long *new_page, *old;
+
+    if (page) {
+        return page;
+    }
+
+    new_page = g_new0(unsigned long, HB_PAGE_LONGS);
+    old = atomic_cmpxchg(&hb->pages[idx], NULL, new_page);
+    if (old) {
+        g_free(new_page);
+        return old;
+    }
+    atomic_inc(&hb->allocated_pages);
+    return new_page;
+}
+
+void hbitmap_set_atomic(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    uint64_t page_bits = HB_PAGE_LONGS << BITS_PER_LEVEL;
+    uint64_t first, last = start + count - 1;
+    uint64_t pos, lastpos, added = 0;
+
+    trace_hbitmap_set(hb, start, count,
+                      start >> hb->granularity, last >> hb->granularity);
+
+    first = start >> hb->granularity;
+    last >>= hb->granularity;
+    assert(last < hb->size);
+
+    lastpos = last >> BITS_PER_LEVEL;
+    for (pos = first >> BITS_PER_LEVEL; pos <= lastpos; pos++) {
+        uint64_t idx = pos >> HB_PAGE_SHIFT;
+        unsigned long mask = ~0UL;
+        unsigned long *page;
+        unsigned long old;
+
+        /* An empty page that is covered entirely becomes full at once */
+        if (hb->sparse && !(pos & (HB_PAGE_LONGS - 1)) &&
+            idx * page_bits >= first && (idx + 1) * page_bits - 1 <= last &&
+            (idx + 1) * HB_PAGE_LONGS <= hb->sizes[HBITMAP_LEVELS - 1] &&
+            atomic_cmpxchg(&hb->pages[idx], NULL, HB_FULL_PAGE) == NULL) {
+            added += page_bits;
+            hb_mark_stale(hb, idx);
+            pos += HB_PAGE_LONGS - 1;
+            continue;
+        }
+
+        page = hb_page_get_atomic(hb, idx);
+        if (page == HB_FULL_PAGE) {
+            pos |= HB_PAGE_LONGS - 1;
+            continue;
+        }
+
+        if (pos == first >> BITS_PER_LEVEL) {
+            mask &= ~0UL << (first & (BITS_PER_LONG - 1));
+        }
+        if (pos == lastpos) {
+            mask &= ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
+        }
+
+        old = atomic_fetch_or(&page[pos & (HB_PAGE_LONGS - 1)], mask);
+        added += ctpopl(mask & ~old);
+        if (!old) {
+            hb_mark_stale(hb, idx);
+        }
+    }
+
+    if (added) {
+        stat64_add(&hb->atomic_count, added);
+        if (hb->meta) {
+            hbitmap_set_atomic(hb->meta, start, count);
+        }
     }
 }
 
+/* Bring the upper levels up to date after hbitmap_set_atomic(), and add the
+ * bits it set to hb->count.  This does not change the contents of the bitmap,
+ * so it is also done by functions that take a const HBitmap.
+ *
+ * hbitmap_set_atomic() may run concurrently: each stale mark is cleared
+ * before its page is scanned, and hb->stale before the marks, so a word
+ * that is set too late to be seen here leaves its page marked for the next
+ * call.  Two calls must not run at the same time, though.
+ */
+static void hb_sync(const HBitmap *const_hb)
+{
+    HBitmap *hb = (HBitmap *)const_hb;
+    uint64_t total, idx;
+
+    total = stat64_get(&hb->atomic_count);
+    hb->count += total - hb->atomic_synced;
+    hb->atomic_synced = total;
+    if (!atomic_read(&hb->stale)) {
+        return;
+    }
+
+    atomic_set(&hb->stale, false);
+    smp_mb();
+
+    for (idx = find_first_bit(hb->stale_pages, hb->nb_pages);
+         idx < hb->nb_pages;
+         idx = find_next_bit(hb->stale_pages, hb->nb_pages, idx + 1)) {
+        uint64_t pos = idx * HB_PAGE_LONGS;
+        uint64_t end = MIN(pos + HB_PAGE_LONGS,
+                           hb->sizes[HBITMAP_LEVELS - 1]);
+        unsigned long *page;
+
+        atomic_and(&hb->stale_pages[BIT_WORD(idx)], ~BIT_MASK(idx));
+        page = atomic_rcu_read(&hb->pages[idx]);
+        if (page == HB_FULL_PAGE) {
+            hb_set_between(hb, HBITMAP_LEVELS - 2, pos, end - 1);
+            continue;
+        }
+        for (; page && pos < end; pos++) {
+            if (atomic_read(&page[pos & (HB_PAGE_LONGS - 1)])) {
+                hb_set_between(hb, HBITMAP_LEVELS - 2, pos, pos);
+            }
+        }
+    }
+}
+
+/* Drop the state of hbitmap_set_atomic() after the upper levels and the
+ * count were recomputed from scratch.
+ */
+static void hb_sync_reset(HBitmap *hb)
+{
+    stat64_init(&hb->atomic_count, 0);
+    hb->atomic_synced = 0;
+    bitmap_zero(hb->stale_pages, hb->nb_pages);
+    hb->stale = false;
+}
+
 /* Resetting works the other way round: propagate up if the new
  * value is zero.
  */
@@ -368,6 +710,15 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     return blanked;
 }
 
+/* Apply hb_reset_elem to word @pos of @level.  */
+static bool hb_reset_word(HBitmap *hb, int level, uint64_t pos,
+                          uint64_t start, uint64_t last)
+{
+    unsigned long *elem = hb_word_ptr(hb, level, pos, 0);
+
+    return elem && hb_reset_elem(elem, start, last);
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
@@ -387,25 +738,18 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_word(hb, level, i, start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
-        }
+        changed |= hb_fill_words(hb, level, i + 1, lastpos, 0);
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_word(hb, level, lastpos, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -419,6 +763,32 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
 }
 
+/* Free the pages of a sparse bitmap between the words @first and @last of
+ * the last level that do not have any bit set anymore.
+ */
+static void hb_release_empty_pages(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    const unsigned long *upper = hb->levels[HBITMAP_LEVELS - 2];
+    uint64_t idx, j;
+
+    for (idx = first >> HB_PAGE_SHIFT; idx <= last >> HB_PAGE_SHIFT; idx++) {
+        if (!hb->pages[idx] || hb->pages[idx] == HB_FULL_PAGE) {
+            continue;
+        }
+        for (j = 0; j < HB_PAGE_UPPER_LONGS; j++) {
+            uint64_t upper_pos = idx * HB_PAGE_UPPER_LONGS + j;
+
+            if (upper_pos < hb->sizes[HBITMAP_LEVELS - 2] &&
+                upper[upper_pos]) {
+                break;
+            }
+        }
+        if (j == HB_PAGE_UPPER_LONGS) {
+            hb_page_replace(hb, idx, NULL);
+        }
+    }
+}
+
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -432,10 +802,16 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     assert(last < hb->size);
 
+    hb_sync(hb);
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        if (hb->sparse) {
+            hb_release_empty_pages(hb, first >> BITS_PER_LEVEL,
+                                   last >> BITS_PER_LEVEL);
+        }
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
@@ -444,12 +820,14 @@ void hbitmap_reset_all(HBitmap *hb)
     unsigned int i;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, 0, hb->sizes[HBITMAP_LEVELS - 1], 0);
 
     hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
     hb->count = 0;
+    hb_sync_reset(hb);
 }
 
 bool hbitmap_is_serializable(const HBitmap *hb)
@@ -477,7 +855,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_last_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -494,7 +872,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -508,7 +886,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -516,7 +894,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -530,7 +908,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -539,9 +917,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_last_word(hb, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -553,7 +931,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -562,12 +940,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el, *dest;
 
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+
+        dest = hb_word_ptr(hb, HBITMAP_LEVELS - 1, cur, el);
+        if (dest) {
+            *dest = el;
         }
 
         buf += sizeof(unsigned long);
@@ -582,14 +962,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, first + el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -599,24 +979,56 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, HBITMAP_LEVELS - 1, first, first + el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
 }
 
+/* Free the pages of a sparse bitmap that have no bit set, and replace those
+ * that have all bits set with HB_FULL_PAGE.
+ */
+static void hb_compact_pages(HBitmap *hb)
+{
+    uint64_t size = hb->sizes[HBITMAP_LEVELS - 1];
+    uint64_t idx, j;
+
+    for (idx = 0; idx < hb->nb_pages; idx++) {
+        unsigned long *page = hb->pages[idx];
+        uint64_t nb_words = MIN(size - idx * HB_PAGE_LONGS, HB_PAGE_LONGS);
+        unsigned long all_and = ~0UL, all_or = 0;
+
+        if (!page || page == HB_FULL_PAGE) {
+            continue;
+        }
+        for (j = 0; j < nb_words; j++) {
+            all_and &= page[j];
+            all_or |= page[j];
+        }
+        if (!all_or) {
+            hb_page_replace(hb, idx, NULL);
+        } else if (all_and == ~0UL && nb_words == HB_PAGE_LONGS) {
+            hb_page_replace(hb, idx, HB_FULL_PAGE);
+        }
+    }
+}
+
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
     int lev;
 
+    if (bitmap->sparse) {
+        hb_compact_pages(bitmap);
+    }
+
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
     size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
@@ -626,7 +1038,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -634,20 +1046,51 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb_sync_reset(bitmap);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t idx;
+
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    for (idx = 0; idx < hb->nb_pages; idx++) {
+        hb_page_replace(hb, idx, NULL);
+    }
+    g_free(hb->pages);
+    g_free(hb->stale_pages);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+/* Grow or shrink the page array of @hb to cover @size words.  */
+static void hb_resize_pages(HBitmap *hb, uint64_t size)
+{
+    uint64_t nb_pages = DIV_ROUND_UP(size, HB_PAGE_LONGS);
+    uint64_t idx;
+
+    for (idx = nb_pages; idx < hb->nb_pages; idx++) {
+        hb_page_replace(hb, idx, NULL);
+    }
+    hb->pages = g_renew(unsigned long *, hb->pages, nb_pages);
+    for (idx = hb->nb_pages; idx < nb_pages; idx++) {
+        hb->pages[idx] = NULL;
+        if (!hb->sparse) {
+            hb_page_replace(hb, idx, g_new0(unsigned long, HB_PAGE_LONGS));
+        }
+    }
+
+    /* The caller has synced the upper levels, so no page is stale.  */
+    g_free(hb->stale_pages);
+    hb->stale_pages = bitmap_new(nb_pages);
+    hb->nb_pages = nb_pages;
+}
+
+static HBitmap *hbitmap_do_alloc(uint64_t size, int granularity, bool sparse)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
@@ -658,10 +1101,15 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 
     hb->size = size;
     hb->granularity = granularity;
+    hb->sparse = sparse;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_pages(hb, size);
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -673,6 +1121,34 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, false);
+}
+
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, true);
+}
+
+bool hbitmap_is_sparse(const HBitmap *hb)
+{
+    return hb->sparse;
+}
+
+uint64_t hbitmap_memory_size(const HBitmap *hb)
+{
+    uint64_t size = sizeof(*hb);
+    unsigned i;
+
+    for (i = 0; i < HBITMAP_LEVELS - 1; i++) {
+        size += hb->sizes[i] * sizeof(unsigned long);
+    }
+    size += hb->nb_pages * sizeof(unsigned long *);
+    size += hb->allocated_pages * HB_PAGE_LONGS * sizeof(unsigned long);
+    return size;
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -690,6 +1166,8 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         return;
     }
 
+    hb_sync(hb);
+
     /* If we're losing bits, let's clear those bits before we invalidate all of
      * our invariants. This helps keep the bitcount consistent, and will prevent
      * us from carrying around garbage bits beyond the end of the map.
@@ -712,6 +1190,13 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            /* New words in an existing page are already zero: shrinking
+             * cleared them with hbitmap_reset() above.
+             */
+            hb_resize_pages(hb, size);
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -728,6 +1213,39 @@ bool hbitmap_can_merge(const HBitmap *a, const HBitmap *b)
     return (a->size == b->size) && (a->granularity == b->granularity);
 }
 
+/* Merge page @idx of the last level of @a and @b into @result.  */
+static void hb_merge_page(const HBitmap *a, const HBitmap *b, HBitmap *result,
+                          uint64_t idx)
+{
+    unsigned long *page_a = a->pages[idx];
+    unsigned long *page_b = b->pages[idx];
+    uint64_t pos = idx * HB_PAGE_LONGS;
+    uint64_t end = MIN(pos + HB_PAGE_LONGS, result->sizes[HBITMAP_LEVELS - 1]);
+
+    if (result->sparse) {
+        if (page_a == HB_FULL_PAGE || page_b == HB_FULL_PAGE) {
+            hb_page_replace(result, idx, HB_FULL_PAGE);
+            return;
+        }
+        if (!page_a && !page_b) {
+            hb_page_replace(result, idx, NULL);
+            return;
+        }
+    }
+    if (!page_b && a == result) {
+        return;
+    }
+
+    for (; pos < end; pos++) {
+        unsigned long el = hb_last_word(a, pos) | hb_last_word(b, pos);
+        unsigned long *dest = hb_word_ptr(result, HBITMAP_LEVELS - 1, pos, el);
+
+        if (dest) {
+            *dest = el;
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let A := A (BITOR) B.
  * Bitmap B will not be modified.
@@ -749,11 +1267,18 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
+    hb_sync(a);
+    hb_sync(b);
+    hb_sync(result);
+
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (j = 0; j < a->nb_pages; j++) {
+        hb_merge_page(a, b, result, j);
+    }
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
@@ -769,8 +1294,9 @@ HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_size)
 {
     assert(!(chunk_size & (chunk_size - 1)));
     assert(!hb->meta);
-    hb->meta = hbitmap_alloc(hb->size << hb->granularity,
-                             hb->granularity + ctz32(chunk_size));
+    hb->meta = hbitmap_do_alloc(hb->size << hb->granularity,
+                                hb->granularity + ctz32(chunk_size),
+                                hb->sparse);
     return hb->meta;
 }
 
@@ -784,9 +1310,39 @@ void hbitmap_free_meta(HBitmap *hb)
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    struct iovec *iov = g_new(struct iovec, bitmap->nb_pages);
+    unsigned long *zero_page = NULL, *full_page = NULL;
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t idx;
+
+    /* Hash the pages in order, so that the result does not depend on how
+     * the bitmap is stored.
+     */
+    for (idx = 0; idx < bitmap->nb_pages; idx++) {
+        unsigned long *page = bitmap->pages[idx];
+
+        if (!page) {
+            if (!zero_page) {
+                zero_page = g_new0(unsigned long, HB_PAGE_LONGS);
+            }
+            page = zero_page;
+        } else if (page == HB_FULL_PAGE) {
+            if (!full_page) {
+                full_page = g_new(unsigned long, HB_PAGE_LONGS);
+                memset(full_page, 0xff, HB_PAGE_LONGS * sizeof(unsigned long));
+            }
+            page = full_page;
+        }
+        iov[idx].iov_base = page;
+        iov[idx].iov_len = MIN(size, HB_PAGE_LONGS * sizeof(unsigned long));
+        size -= iov[idx].iov_len;
+    }
+
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nb_pages,
+                         &hash, errp);
 
+    g_free(zero_page);
+    g_free(full_page);
+    g_free(iov);
     return hash;
 }
@@ -19,6 +19,8 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -46,11 +48,20 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Time of submission, for the latency histogram.  */
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
+
+    /* Lock-free list of finished requests, see ThreadPool.done_list.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
+    /* Only accessed from the pool's AioContext.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) completed;
 };
 
 struct ThreadPool {
@@ -59,46 +70,133 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
+    /* Requests that the workers have finished, most recent first.  Workers
+     * push to it without taking lock, and only the one that finds it empty
+     * schedules completion_bh, so that a burst of completions is handled
+     * by a single run of the bottom half.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    int queue_depth;     /* length of request_list */
+    DECLARE_BITMAP(cpus, THREAD_POOL_MAX_CPUS);
+    unsigned cpus_gen;   /* incremented whenever cpus changes */
+    uint64_t requests;
+    uint64_t latency_bins[THREAD_POOL_LATENCY_BINS];
     bool stopping;
 };
 
+static void thread_pool_push_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = atomic_read(&pool->done_list.slh_first);
+        req->done.sle_next = old;
+    } while (atomic_cmpxchg(&pool->done_list.slh_first, old, req) != old);
+
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
+static void thread_pool_account(ThreadPool *pool, int64_t latency_ns)
+{
+    uint64_t us = MAX(latency_ns, 0) / SCALE_US;
+    int bin = us ? 64 - clz64(us) : 0;
+
+    /* Runs with lock taken.  */
+    pool->requests++;
+    pool->latency_bins[MIN(bin, THREAD_POOL_LATENCY_BINS - 1)]++;
+}
+
+static void worker_set_affinity(ThreadPool *pool)
+{
+    QemuThread self;
+    int ret;
+
+    /* Runs with lock taken.  An empty set keeps the affinity that was
+     * inherited from the main thread.
+     */
+    if (bitmap_empty(pool->cpus, THREAD_POOL_MAX_CPUS)) {
+        return;
+    }
+    qemu_thread_get_self(&self);
+    ret = qemu_thread_set_affinity(&self, pool->cpus, THREAD_POOL_MAX_CPUS);
+    trace_thread_pool_set_affinity(pool, ret);
+}
+
+static bool back_to_sleep(ThreadPool *pool, int ret)
+{
+    /* The semaphore timed out.  Keep waiting if we raced with the
+     * submission of a request, or if the pool must keep min_threads
+     * workers around.
+     */
+    return ret == -1 && !pool->stopping &&
+           (!QTAILQ_EMPTY(&pool->request_list) ||
+            pool->cur_threads <= pool->min_threads);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned cpus_gen;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    worker_set_affinity(pool);
+    cpus_gen = pool->cpus_gen;
 
     while (!pool->stopping) {
         ThreadPoolElement *req;
         int ret;
 
+        if (cpus_gen != pool->cpus_gen) {
+            worker_set_affinity(pool);
+            cpus_gen = pool->cpus_gen;
+        }
+
         do {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+        } while (back_to_sleep(pool, ret));
         if (ret == -1 || pool->stopping) {
             break;
         }
+        if (pool->cur_threads > pool->max_threads) {
+            /* The maximum was lowered; hand the wakeup over to another
+             * worker if it was meant for a request.
+             */
+            if (!QTAILQ_EMPTY(&pool->request_list)) {
+                qemu_sem_post(&pool->sem);
+            }
+            break;
+        }
 
         req = QTAILQ_FIRST(&pool->request_list);
+        if (!req) {
+            /* Woken up by thread_pool_update_params() */
+            continue;
+        }
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        pool->queue_depth--;
         req->state = THREAD_ACTIVE;
         qemu_mutex_unlock(&pool->lock);
 
@@ -110,8 +208,8 @@ static void *worker_thread(void *opaque)
         req->state = THREAD_DONE;
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
+        thread_pool_account(pool, get_clock() - req->submit_ns);
+        thread_pool_push_done(pool, req);
     }
 
     pool->cur_threads--;
@@ -160,18 +258,39 @@ static void spawn_thread(ThreadPool *pool)
     }
 }
 
+/* Returns the oldest finished request, moving the whole batch published by
+ * the workers to pool->completed when that is empty.
+ */
+static ThreadPoolElement *thread_pool_next_completed(ThreadPool *pool)
+{
+    QSLIST_HEAD(, ThreadPoolElement) done;
+    ThreadPoolElement *elem;
+
+    if (QSIMPLEQ_EMPTY(&pool->completed)) {
+        QSLIST_MOVE_ATOMIC(&done, &pool->done_list);
+
+        /* done_list is in reverse order of completion.  */
+        while ((elem = QSLIST_FIRST(&done))) {
+            QSLIST_REMOVE_HEAD(&done, done);
+            QSIMPLEQ_INSERT_HEAD(&pool->completed, elem, completed);
+        }
+    }
+
+    elem = QSIMPLEQ_FIRST(&pool->completed);
+    if (elem) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, completed);
+    }
+    return elem;
+}
+
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
-
+    while ((elem = thread_pool_next_completed(pool))) {
+        assert(elem->state == THREAD_DONE);
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
@@ -190,16 +309,12 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because the loop looks at
+             * done_list again before exiting.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -220,10 +335,12 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        pool->queue_depth--;
 
-        elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        smp_wmb();
+        elem->state = THREAD_DONE;
+        thread_pool_push_done(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -253,16 +370,22 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    /* Every queued request will take one of the idle workers; start a new
+     * one if there are not enough of them left for this request.
+     */
+    if (pool->queue_depth >= pool->idle_threads &&
+        pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
     QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queue_depth++;
     qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
@@ -308,11 +431,55 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSIMPLEQ_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx);
+}
+
+/* Called with ctx->thread_pool_lock held */
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+    if (!bitmap_equal(pool->cpus, ctx->thread_pool_cpus,
+                      THREAD_POOL_MAX_CPUS)) {
+        bitmap_copy(pool->cpus, ctx->thread_pool_cpus, THREAD_POOL_MAX_CPUS);
+        pool->cpus_gen++;
+    }
+
+    /* Start workers until there are min_threads of them, or wake up idle
+     * ones so that they exit until there are at most max_threads.
+     */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    for (i = pool->cur_threads; i > pool->max_threads; i--) {
+        qemu_sem_post(&pool->sem);
+    }
+
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    qemu_mutex_lock(&pool->lock);
+    stats->min_threads = pool->min_threads;
+    stats->max_threads = pool->max_threads;
+    stats->cur_threads = pool->cur_threads;
+    stats->idle_threads = pool->idle_threads;
+    stats->queue_depth = pool->queue_depth;
+    stats->requests = pool->requests;
+    memcpy(stats->latency_bins, pool->latency_bins,
+           sizeof(stats->latency_bins));
+    qemu_mutex_unlock(&pool->lock);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -87,6 +87,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the sizes of the main and burst buckets
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +125,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -134,6 +146,28 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
     return 0;
 }
 
+/* This function computes how many units can still be accounted to a leaky
+ * bucket before throttle_compute_wait() asks for a wait
+ *
+ * @bkt: the leaky bucket we operate on, which must have a limit
+ * @ret: the number of units
+ */
+double throttle_bucket_headroom(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size;
+    double headroom;
+
+    assert(bkt->avg);
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+
+    headroom = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        headroom = MIN(headroom, burst_bucket_size - bkt->burst_level);
+    }
+
+    return MAX(headroom, 0);
+}
+
 /* This function compute the time that must be waited while this IO
  *
  * @is_write:   true if the current IO is a write, false if it's a read
@@ -445,6 +479,25 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Add @units to the level of a bucket, which cannot go below zero */
+static void throttle_bucket_add(LeakyBucket *bkt, double units)
+{
+    bkt->level = MAX(bkt->level + units, 0);
+    if (bkt->burst_length > 1) {
+        bkt->burst_level = MAX(bkt->burst_level + units, 0);
+    }
+}
+
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -452,14 +505,6 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
     double units = 1.0;
     unsigned i;
 
@@ -485,6 +530,68 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* Compute how many operations and bytes of one type can be accounted
+ * before a request of that type has to wait.  The result is UINT64_MAX
+ * for a unit that has no limit.
+ *
+ * The buckets must have leaked recently, for example by a call to
+ * throttle_schedule_timer().
+ *
+ * @is_write: the type of operation (read/write)
+ * @ops:      the number of operations
+ * @bytes:    the number of bytes
+ */
+void throttle_headroom(ThrottleState *ts, bool is_write,
+                       uint64_t *ops, uint64_t *bytes)
+{
+    unsigned i;
+
+    *ops = UINT64_MAX;
+    *bytes = UINT64_MAX;
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            *bytes = MIN(*bytes, throttle_bucket_headroom(bkt));
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            *ops = MIN(*ops, throttle_bucket_headroom(bkt));
+        }
+    }
+}
+
+/* Account, or give back, a batch of operations of the same type at once.
+ * Unlike throttle_account(), each operation counts as one unit whatever
+ * cfg.op_size, and buckets without a limit are left alone.
+ *
+ * @is_write: the type of operation (read/write)
+ * @ops:      the number of operations
+ * @bytes:    the total size of the operations
+ * @refund:   true to give back operations that were not performed
+ */
+void throttle_account_batch(ThrottleState *ts, bool is_write,
+                            uint64_t ops, uint64_t bytes, bool refund)
+{
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            throttle_bucket_add(bkt, refund ? -(double)bytes : bytes);
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            throttle_bucket_add(bkt, refund ? -(double)ops : ops);
+        }
+    }
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from